@@ -0,0 +1,346 @@
+// Measures what bidi-tee costs: runs a synthetic child that echoes its
+// stdin to stdout, once connected directly with pipes and then through
+// bidi-tee in various configurations, and sends it messages of a given size
+// at a given rate. Reports throughput, the latency until each message is
+// echoed back and the CPU bidi-tee used for forwarding.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+
+static const char kEchoArg[] = "--echo";
+
+// Bidi-tee options of the configurations run by default; "direct" is the
+// child without bidi-tee.
+static const char *const kDefaultConfigs[] = {
+  "direct",
+  "-e select",
+  "-e epoll",
+  "-e epoll -z",
+  "-e epoll -a block",
+  "-e uring",
+  "-e uring -z",
+  "-e uring -a block",
+};
+
+static int usage(const char *progname, int retval) {
+  fprintf(stderr, "Usage: %s [<options>] <path/to/bidi-tee>\n", progname);
+  fprintf(stderr,
+          "-h            : this help\n"
+          "-s <bytes>    : size of each message (default: 64)\n"
+          "-n <count>    : number of messages per run (default: 100000)\n"
+          "-r <rate>     : messages per second; 0 sends as fast as the "
+          "window\n"
+          "                allows (default: 0)\n"
+          "-w <KiB>      : maximum bytes in flight (default: 32)\n"
+          "-d <dir>      : directory for the logs (default: /tmp)\n"
+          "-c <options>  : bidi-tee options of a configuration to run, "
+          "'direct'\n"
+          "                for none. Can be given multiple times; default is "
+          "a\n"
+          "                set covering the event loops and the zero-copy "
+          "and\n"
+          "                async writer modes.\n");
+  return retval;
+}
+
+static int64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double Seconds(const struct timeval &tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool WriteAll(int fd, const char *data, size_t len) {
+  while (len) {
+    const ssize_t w = write(fd, data, len);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    data += w;
+    len -= w;
+  }
+  return true;
+}
+
+// The synthetic child: echo whatever comes in.
+static int RunEcho() {
+  char buf[65536];
+  for (;;) {
+    const ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    if (!WriteAll(STDOUT_FILENO, buf, r)) return 1;
+  }
+}
+
+static std::vector<std::string> SplitWords(const std::string &str) {
+  std::vector<std::string> result;
+  size_t pos = 0;
+  while ((pos = str.find_first_not_of(' ', pos)) != std::string::npos) {
+    const size_t end = std::min(str.find(' ', pos), str.size());
+    result.push_back(str.substr(pos, end - pos));
+    pos = end;
+  }
+  return result;
+}
+
+struct BenchOptions {
+  size_t message_size = 64;
+  uint64_t messages = 100000;
+  double rate = 0;
+  size_t window = 32 << 10;
+};
+
+struct RunResult {
+  bool ok = false;
+  double seconds = 0;
+  Histogram latency;
+  double cpu_seconds = 0;  // Of bidi-tee, or the echo child if direct.
+};
+
+// Start the command with pipes to its stdin and stdout.
+static pid_t Spawn(const std::vector<std::string> &args, int *to_child,
+                   int *from_child) {
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    std::vector<char *> argv;
+    for (const std::string &arg : args) argv.push_back((char *)arg.c_str());
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(1);
+  }
+  close(in[0]);
+  close(out[1]);
+  *to_child = in[1];
+  *from_child = out[0];
+  return pid;
+}
+
+// Sends the messages in one thread and receives the echo in this one. The
+// child echoes the byte stream, so message i is complete once
+// (i+1)*message_size bytes came back. At most window bytes are in flight,
+// which also keeps the pipes from filling up.
+static RunResult Run(const BenchOptions &options,
+                     const std::vector<std::string> &args) {
+  RunResult result;
+  int to_child, from_child;
+  const pid_t pid = Spawn(args, &to_child, &from_child);
+  if (pid < 0) return result;
+
+  const size_t size = options.message_size;
+  const size_t window = std::max(options.window, size);
+  std::vector<int64_t> sent_at(options.messages);
+  std::mutex mutex;
+  std::condition_variable room;
+  uint64_t received = 0;  // Guarded by mutex.
+  bool receive_done = false;  // Guarded by mutex.
+  std::atomic<bool> send_failed{false};
+
+  const int64_t start = Now();
+  std::thread sender([&]() {
+    std::string message(size, 'x');
+    message.back() = '\n';
+    for (uint64_t i = 0; i < options.messages; ++i) {
+      if (options.rate > 0) {
+        const int64_t due = start + (int64_t)(i * 1e9 / options.rate);
+        struct timespec ts = { (time_t)(due / 1000000000),
+                               (long)(due % 1000000000) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               nullptr) == EINTR) {}
+      }
+      {
+        std::unique_lock<std::mutex> l(mutex);
+        room.wait(l, [&]() {
+          return receive_done || i * size - received + size <= window;
+        });
+        if (receive_done) break;
+      }
+      sent_at[i] = Now();
+      if (!WriteAll(to_child, message.data(), size)) {
+        send_failed = true;
+        break;
+      }
+    }
+    close(to_child);
+  });
+
+  const uint64_t total = options.messages * size;
+  uint64_t got = 0;
+  uint64_t completed = 0;
+  char buf[65536];
+  while (got < total) {
+    const ssize_t r = read(from_child, buf, sizeof(buf));
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    const int64_t now = Now();
+    got += r;
+    for (; completed < options.messages && (completed + 1) * size <= got;
+         ++completed) {
+      result.latency.Record(now - sent_at[completed]);
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    received = got;
+    room.notify_one();
+  }
+  result.seconds = (Now() - start) / 1e9;
+  {
+    // Unblock the sender if the child went away.
+    std::lock_guard<std::mutex> l(mutex);
+    receive_done = true;
+    room.notify_one();
+  }
+  sender.join();
+  close(from_child);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return result;
+  }
+  // bidi-tee does not wait() for its child, so this is bidi-tee alone.
+  result.cpu_seconds = Seconds(usage.ru_utime) + Seconds(usage.ru_stime);
+  result.ok = got == total && !send_failed;
+  return result;
+}
+
+static double Micros(int64_t ns) { return ns / 1e3; }
+
+int main(int argc, char *argv[]) {
+  if (argc == 2 && strcmp(argv[1], kEchoArg) == 0) return RunEcho();
+
+  BenchOptions options;
+  std::string log_dir = "/tmp";
+  std::vector<std::string> configs;
+  int opt;
+  while ((opt = getopt(argc, argv, "hs:n:r:w:d:c:")) != -1) {
+    switch (opt) {
+    case 's': options.message_size = atoll(optarg); break;
+    case 'n': options.messages = atoll(optarg); break;
+    case 'r': options.rate = atof(optarg); break;
+    case 'w': options.window = (size_t)atoll(optarg) << 10; break;
+    case 'd': log_dir = optarg; break;
+    case 'c': configs.push_back(optarg); break;
+    case 'h': return usage(argv[0], 0);
+    default: return usage(argv[0], 1);
+    }
+  }
+  if (optind + 1 != argc) return usage(argv[0], 1);
+  if (options.message_size == 0 || options.messages == 0 ||
+      options.rate < 0) {
+    fprintf(stderr, "Message size and count need to be positive.\n");
+    return usage(argv[0], 1);
+  }
+  const std::string bidi_tee = argv[optind];
+  if (access(bidi_tee.c_str(), X_OK) != 0) {
+    perror(bidi_tee.c_str());
+    return 1;
+  }
+  if (configs.empty()) configs.assign(std::begin(kDefaultConfigs),
+                                      std::end(kDefaultConfigs));
+
+  char self[PATH_MAX];
+  const ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (self_len < 0) {
+    perror("/proc/self/exe");
+    return 1;
+  }
+  self[self_len] = '\0';
+  const std::string log_file = log_dir + "/bidi-tee-bench."
+    + std::to_string(getpid()) + ".log";
+  signal(SIGPIPE, SIG_IGN);
+
+  const double gigabytes = options.messages * options.message_size / 1e9;
+  printf("%llu messages of %zu bytes, %s, window %zu KiB\n",
+         (unsigned long long)options.messages, options.message_size,
+         options.rate > 0
+         ? (std::to_string((long long)options.rate) + " msg/s").c_str()
+         : "unlimited rate",
+         std::max(options.window, options.message_size) >> 10);
+  printf("%-20s %9s %10s %9s %9s %9s %9s %8s %8s\n", "config", "MB/s",
+         "msg/s", "p50 us", "p99 us", "+p50 us", "+p99 us", "cpu s",
+         "cpu s/GB");
+
+  bool have_direct = false;
+  int64_t direct_p50 = 0, direct_p99 = 0;
+  int failures = 0;
+  for (const std::string &config : configs) {
+    std::vector<std::string> args;
+    const bool direct = (config == "direct");
+    if (!direct) {
+      args.push_back(bidi_tee);
+      for (const std::string &word : SplitWords(config)) args.push_back(word);
+      args.push_back(log_file);
+      args.push_back("--");
+    }
+    args.push_back(self);
+    args.push_back(kEchoArg);
+
+    const RunResult r = Run(options, args);
+    if (!direct) unlink(log_file.c_str());
+    if (!r.ok) {
+      printf("%-20s failed\n", config.c_str());
+      ++failures;
+      continue;
+    }
+    const int64_t p50 = r.latency.Percentile(0.5);
+    const int64_t p99 = r.latency.Percentile(0.99);
+    if (direct && !have_direct) {
+      have_direct = true;
+      direct_p50 = p50;
+      direct_p99 = p99;
+    }
+    printf("%-20s %9.1f %10.0f %9.1f %9.1f", config.c_str(),
+           gigabytes * 1e3 / r.seconds, options.messages / r.seconds,
+           Micros(p50), Micros(p99));
+    if (have_direct && !direct) {
+      printf(" %9.1f %9.1f", Micros(p50 - direct_p50),
+             Micros(p99 - direct_p99));
+    } else {
+      printf(" %9s %9s", "-", "-");
+    }
+    // Per GB echoed; each byte passes bidi-tee twice, to the child and back.
+    printf(" %8.3f", r.cpu_seconds);
+    if (direct) printf(" %8s\n", "-");
+    else printf(" %8.2f\n", r.cpu_seconds / gigabytes);
+    fflush(stdout);
+  }
+  return failures ? 1 : 0;
+}
@@ -1,158 +1,764 @@
 #include <fcntl.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <cinttypes>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
-#include <set>
-
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "block-header.h"
+#include "latency-analyzer.h"
+#include "log-comparer.h"
+#include "log-index.h"
+#include "log-reader.h"
+#include "message-framer.h"
+#include "output-buffer.h"
+#include "record-exporter.h"
+#include "record-printer.h"
+#include "record-replayer.h"
+#include "record-search.h"
 
 static int usage(const char *progname, int retval) {
   fprintf(stderr, "Usage: %s [<options>] <bidi-tee-logfile>\n", progname);
+  fprintf(stderr, "       %s --replay[=<speed>] [<options>] "
+          "<bidi-tee-logfile>\n"
+          "                [-- <program> <args...>]\n", progname);
   fprintf(stderr,
           "-h            : this help\n"
           "-c            : toggle print in color (default: on)\n"
           "-ts           : Print timestamp since start of recording.\n"
           "-ta           : Print timestamps as absolute timestamps.\n"
           "-td           : Print delta timestamps relative to last print\n"
+          "-l            : with -t: print timestamp on every line, not only at"
+          " the\n"
+          "                start of each record.\n"
           "-s <select-channel> : comma-separated list of channels to print, e.g. 0,2 prints stdin and stderr\n"
-          "-o <filename> : Output to filename\n");
+          "-o <filename> : Output to filename\n"
+          "-f            : follow: wait for more data at end of file.\n"
+          "-e <pattern>  : only print records containing this string.\n"
+          "-E <regex>    : only print records matching this extended "
+          "regular expression.\n"
+          "                Matched line by line, ^ and $ are at line ends.\n"
+          "-C <records>  : with -e/-E: print this many records of context "
+          "around matches.\n"
+          "-F <framing>[:<channels>] : reassemble records of the channels "
+          "(default:\n"
+          "                0,1) into whole messages. Framing: 'newline',\n"
+          "                'content-length' or 'length32'\n"
+          "-j <threads>  : format files with this many threads (default: "
+          "number of CPUs)\n"
+          "--from <time> : only print records from this time on.\n"
+          "--to <time>   : only print records up to this time.\n"
+          "                Times are [YYYY-MM-DD ]HH:MM:SS[.frac] local time "
+          "or\n"
+          "                +<seconds> since start of recording. Uses the\n"
+          "                index <logfile>.idx if available.\n"
+          "--min-size <bytes> : only print records at least this large.\n"
+          "--max-size <bytes> : only print records at most this large.\n"
+          "--build-index : (re-)build index <logfile>.idx and exit.\n"
+          "--analyze[=<pairing>] : instead of printing, report latency of\n"
+          "                responses on stdout to requests on stdin, and\n"
+          "                throughput. Pairing 'next' (default): next record\n"
+          "                on stdout; 'jsonrpc': JSON-RPC messages by id.\n"
+          "--interval <seconds> : with --analyze: also print bytes/s per\n"
+          "                channel for each interval of this length.\n"
+          "--export <format> : write all records, including empty ones and\n"
+          "                closed markers, as 'jsonl', 'csv' or 'pcapng'.\n"
+          "--compare <baseline-logfile> : instead of printing, report\n"
+          "                where the log differs from the baseline, per\n"
+          "                channel; with -F message by message. Exit code 1\n"
+          "                if it does.\n"
+          "--replay[=<speed>] : write the stdin records (or those of -s)\n"
+          "                to the program, or else the output, with the\n"
+          "                timing they were captured with; <speed> times as\n"
+          "                fast (default: 1; 0: as fast as possible). The\n"
+          "                exit code is that of the program.\n");
   return retval;
 }
 
-// Things to wrap communication around, so that we have a colored
-// output.
-static constexpr const char *kColors[3] = {
-    "\033[1;31m", // bold red
-    "\033[1;34m", // bold blue
-    "",           // regular
+// Parse a time given on the command line into nanoseconds since the
+// epoch. Times without date are on the day of the reference.
+static bool ParseTime(const char *str, int64_t reference_ns, int64_t *out) {
+  if (str[0] == '+') {
+    char *end;
+    const double seconds = strtod(str + 1, &end);
+    if (*end || end == str + 1) return false;
+    *out = reference_ns + (int64_t)(seconds * 1e9);
+    return true;
+  }
+  const time_t reference_seconds = reference_ns / 1000000000;
+  struct tm reference_day;
+  localtime_r(&reference_seconds, &reference_day);
+  struct tm t = reference_day;
+  const char *rest = strptime(str, "%Y-%m-%d %H:%M:%S", &t);
+  if (!rest) {
+    t = reference_day;  // Failed attempt might have modified it.
+    rest = strptime(str, "%H:%M:%S", &t);
+  }
+  if (!rest) return false;
+  int64_t fraction_ns = 0;
+  if (*rest == '.') {
+    int64_t scale = 100000000;
+    for (++rest; *rest >= '0' && *rest <= '9'; ++rest, scale /= 10) {
+      fraction_ns += (*rest - '0') * scale;
+    }
+  }
+  if (*rest) return false;
+  t.tm_isdst = -1;
+  const time_t seconds = mktime(&t);
+  if (seconds == (time_t)-1) return false;
+  *out = (int64_t)seconds * 1000000000 + fraction_ns;
+  return true;
+}
+
+// Go through the whole log and write an index for it.
+static int BuildIndex(const char *filename) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return 1;
+  }
+  MmapLogReader *mmap_reader = MmapLogReader::Create(fd);
+  close(fd);  // Mapping stays valid.
+  if (!mmap_reader) {
+    fprintf(stderr, "%s: need a regular log file to index\n", filename);
+    return 1;
+  }
+  std::unique_ptr<LogReader> reader(mmap_reader);
+  const std::string index_filename = IndexFilename(filename);
+  std::unique_ptr<LogIndexWriter> index(
+    LogIndexWriter::Create(index_filename, kDefaultIndexEveryRecords,
+                           kDefaultIndexEveryNs));
+  if (!index) {
+    perror(index_filename.c_str());
+    return 1;
+  }
+  RecordHeader header;
+  const char *payload;
+  while (reader->Next(&header, &payload)) {
+    index->AddRecord(header.timestamp_ns, mmap_reader->record_position());
+  }
+  if (!reader->error().empty()) {
+    fprintf(stderr, "%s\n", reader->error().c_str());
+    return 1;
+  }
+  return 0;
+}
+
+// Pieces of the log that are formatted in parallel.
+static constexpr size_t kParallelChunkSize = 4 << 20;
+
+struct PrintedChunk {
+  std::string text;
+  std::unique_ptr<OutputBuffer> out;
+  std::unique_ptr<RecordPrinter> printer;
+  std::string error;
+  bool reached_end = false;  // Saw records after the time range.
+  SkippedCounts skipped;
 };
 
-static constexpr char kSuffix[] = "\033[0m";
+static std::unique_ptr<PrintedChunk> PrintChunk(const MmapLogReader *reader,
+                                                size_t begin, size_t end,
+                                                const PrintOptions *options,
+                                                int64_t start_timestamp) {
+  std::unique_ptr<PrintedChunk> chunk(new PrintedChunk());
+  chunk->out.reset(new OutputBuffer(&chunk->text));
+  chunk->printer.reset(new RecordPrinter(*options, start_timestamp,
+                                         chunk->out.get()));
+  chunk->printer->DeferFirstRecordStart();
+  std::unique_ptr<MmapLogReader> view(reader->CreateView(begin, end));
+  RecordHeader header;
+  const char *payload;
+  while (view->Next(&header, &payload)) {
+    chunk->printer->Print(header, payload);
+  }
+  chunk->reached_end = view->past_filter_end();
+  chunk->out->Flush();
+  chunk->error = view->error();
+  chunk->skipped = view->skipped();
+  return chunk;
+}
+
+// Record boundaries to split the log at, from begin on. Uses the index if
+// there is one, otherwise walks the record headers.
+static std::vector<size_t> ChooseSplitPoints(
+  const MmapLogReader &reader, const std::vector<IndexEntry> &index,
+  size_t begin) {
+  if (index.empty()) return reader.SplitPoints(begin, kParallelChunkSize);
+  std::vector<size_t> result = { begin };
+  for (const IndexEntry &entry : index) {
+    if (entry.offset >= reader.size()) break;
+    if (entry.offset >= result.back() + kParallelChunkSize) {
+      result.push_back(entry.offset);
+    }
+  }
+  return result;
+}
+
+// Format chunks of the log on several threads, then output them in order.
+// Returns error if there was one.
+static std::string PrintParallel(const MmapLogReader &reader,
+                                 const std::vector<size_t> &split_points,
+                                 const PrintOptions &options,
+                                 int64_t start_timestamp, int threads,
+                                 RecordPrinter *printer, OutputBuffer *out,
+                                 SkippedCounts *skipped) {
+  std::deque<std::future<std::unique_ptr<PrintedChunk>>> in_flight;
+  size_t next = 0;
+  while (next < split_points.size() || !in_flight.empty()) {
+    // Keep a few ahead, but bound memory used for output not written yet.
+    while (next < split_points.size() &&
+           in_flight.size() < (size_t)(2 * threads)) {
+      const size_t begin = split_points[next++];
+      const size_t end = next < split_points.size()
+        ? split_points[next] : reader.size();
+      in_flight.push_back(std::async(std::launch::async, PrintChunk,
+                                     &reader, begin, end, &options,
+                                     start_timestamp));
+    }
+    std::unique_ptr<PrintedChunk> chunk = in_flight.front().get();
+    in_flight.pop_front();
+    skipped->Add(chunk->skipped);
+    if (chunk->printer->printed_any()) {
+      printer->PrintRecordStart(chunk->printer->first_timestamp());
+      out->Append(chunk->text.data(), chunk->text.size());
+      printer->ContinueFrom(*chunk->printer);
+    }
+    if (!chunk->error.empty()) return chunk->error;
+    if (chunk->reached_end || out->failed()) break;
+  }
+  return "";  // Pending futures wait in their destructor.
+}
+
+// Pass the current and all following records up to the end of the time
+// range to handle; as whole messages if there is a framer.
+static void ProcessRecords(LogReader *reader, const RecordFilter &filter,
+                           RecordFramer *framer, const OutputBuffer &out,
+                           bool have_record, RecordHeader header,
+                           const char *payload,
+                           const RecordFramer::Emit &handle) {
+  int64_t last_timestamp = header.timestamp_ns;
+  for (/**/; have_record; have_record = reader->Next(&header, &payload)) {
+    if (filter.PastEnd(header)) break;
+    last_timestamp = header.timestamp_ns;
+    if (framer) {
+      framer->Process(header, payload, handle);
+    } else {
+      handle(header, payload);
+    }
+    if (out.failed()) return;
+  }
+  if (framer) framer->Finish(last_timestamp, handle);
+}
+
+// The log is incomplete by design if it was captured with sampling; say so,
+// so that nobody takes the output for all there was.
+static void ReportSkipped(const SkippedCounts &skipped,
+                          const LogFileInfo &info) {
+  if (!skipped.any()) return;
+  fprintf(stderr, "Not in the log because of capture sampling:\n");
+  for (int channel = 0; channel < 16; ++channel) {
+    if (!skipped.reads[channel]) continue;
+    const auto name = info.channel_names.find(channel);
+    fprintf(stderr, "  channel %d%s%s%s: %" PRIu64 " bytes of %" PRIu64
+            " reads\n", channel,
+            name != info.channel_names.end() ? " (" : "",
+            name != info.channel_names.end() ? name->second.c_str() : "",
+            name != info.channel_names.end() ? ")" : "",
+            skipped.bytes[channel], skipped.reads[channel]);
+  }
+}
+
+// Compare a log to a baseline capture, reading both along in the order of
+// time since their start. Returns 0 if the same, 1 if not, 2 on errors.
+static int CompareLogs(const char *baseline_filename, const char *filename,
+                       uint16_t channels, Framing framing,
+                       uint16_t framed_channels, OutputBuffer *out) {
+  const char *const filenames[2] = { baseline_filename, filename };
+  std::unique_ptr<LogReader> readers[2];
+  std::unique_ptr<RecordFramer> framers[2];
+  RecordFilter read_filter;  // Closed markers end messages in the framer.
+  read_filter.channels = channels;
+  for (int side = 0; side < 2; ++side) {
+    readers[side] = OpenLogReader(filenames[side]);
+    if (!readers[side]) {
+      fprintf(stderr, "%s: %s\n", filenames[side], strerror(errno));
+      return 2;
+    }
+    readers[side]->SetFilter(&read_filter);
+    if (framing != Framing::kNone) {
+      framers[side].reset(new RecordFramer(framing, framed_channels));
+    }
+  }
+
+  CompareOptions compare_options;
+  if (framing != Framing::kNone) {
+    compare_options.message_channels = framed_channels;
+  }
+  std::map<int, std::string> channel_names = readers[1]->info().channel_names;
+  channel_names.insert(readers[0]->info().channel_names.begin(),
+                       readers[0]->info().channel_names.end());
+  LogComparer comparer(compare_options, channel_names, baseline_filename,
+                       filename, out);
+
+  RecordHeader headers[2];
+  const char *payloads[2];
+  bool have_record[2];
+  int64_t start_timestamp[2] = { 0, 0 };
+  for (int side = 0; side < 2; ++side) {
+    have_record[side] = readers[side]->Next(&headers[side], &payloads[side]);
+    if (have_record[side]) start_timestamp[side] = headers[side].timestamp_ns;
+    else comparer.Finish(side);
+  }
+  while ((have_record[0] || have_record[1]) && !out->failed()) {
+    int side = !have_record[0] ? 1 : !have_record[1] ? 0
+      : (headers[1].timestamp_ns - start_timestamp[1] <
+         headers[0].timestamp_ns - start_timestamp[0]);
+    // One capture may be slower; keep their channels level.
+    if (have_record[!side] && comparer.Ahead(side) && !comparer.Ahead(!side)) {
+      side = !side;
+    }
+    const RecordFramer::Emit handle =
+      [&](const RecordHeader &header, const char *payload) {
+        comparer.Process(side, header, payload,
+                         header.timestamp_ns - start_timestamp[side]);
+      };
+    const int64_t last_timestamp = headers[side].timestamp_ns;
+    if (framers[side]) {
+      framers[side]->Process(headers[side], payloads[side], handle);
+    } else {
+      handle(headers[side], payloads[side]);
+    }
+    have_record[side] = readers[side]->Next(&headers[side], &payloads[side]);
+    if (!have_record[side]) {
+      if (framers[side]) framers[side]->Finish(last_timestamp, handle);
+      comparer.Finish(side);
+    }
+  }
+  comparer.Report();
+  out->Flush();
+
+  for (int side = 0; side < 2; ++side) {
+    ReportSkipped(readers[side]->skipped(), readers[side]->info());
+    if (!readers[side]->error().empty()) {
+      fprintf(stderr, "%s: %s\n", filenames[side],
+              readers[side]->error().c_str());
+      return 2;
+    }
+  }
+  return comparer.identical() ? 0 : 1;
+}
 
-void write_colored(FILE *out, int channel, const char *buf, size_t size) {
-  if (channel < 3) {
-    fwrite(kColors[channel], 1, strlen(kColors[channel]), out);
+// Start the program with a pipe to its stdin. Returns its pid, or -1.
+static pid_t StartProgram(char **program, int *to_program) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
   }
-  // TODO: apply color line by line as less is not be able to do multiline
-  fwrite(buf, 1, size, out);
-  fwrite(kSuffix, 1, strlen(kSuffix), out);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    execvp(program[0], program);
+    fprintf(stderr, "Failed to execute %s: %s\n", program[0], strerror(errno));
+    _exit(1);
+  }
+  close(fds[0]);
+  *to_program = fds[1];
+  return pid;
 }
 
+// Write the current and all following records up to the end of the time
+// range to the program's stdin, or out_fd if there is no program, at their
+// time since start_timestamp. Returns the exit code of the program.
+static int ReplayRecords(LogReader *reader, const RecordFilter &filter,
+                         bool have_record, RecordHeader header,
+                         const char *payload, int64_t start_timestamp,
+                         double speed, char **program, int out_fd) {
+  int to_program = out_fd;
+  pid_t pid = -1;
+  if (program) {
+    pid = StartProgram(program, &to_program);
+    if (pid < 0) return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);  // Show as error if the program stops reading.
+
+  RecordReplayer replayer(to_program, start_timestamp, speed);
+  uint16_t closed = 0;
+  for (/**/; have_record; have_record = reader->Next(&header, &payload)) {
+    if (filter.PastEnd(header)) break;
+    if (!filter.Accepts(header)) continue;
+    if (header.channel_closed) {
+      // Closed at the time it was in the capture.
+      closed |= 1 << header.channel;
+      if (closed == filter.channels) {
+        replayer.WaitFor(header);
+        break;
+      }
+      continue;
+    }
+    if (header.block_size == 0) continue;
+    if (!replayer.Replay(header, payload)) {
+      perror("Replay stopped");
+      break;
+    }
+  }
+  if (program) close(to_program);
+  replayer.Report(stderr);
+  ReportSkipped(reader->skipped(), reader->info());
+  int result = 0;
+  if (!reader->error().empty()) {
+    fprintf(stderr, "%s\n", reader->error().c_str());
+    result = 1;
+  }
+  if (pid > 0) {
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+      perror("waitpid");
+      return 1;
+    }
+    result = WIFEXITED(status) ? WEXITSTATUS(status)
+                               : 128 + WTERMSIG(status);
+  }
+  return result;
+}
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     return usage(argv[0], 2);
   }
 
-  FILE *out = stdout;
-  std::set<int> selected_channels;
-  enum class TSPrint { kNone, kStartFile, kDelta, kAbsolute };
-  TSPrint print_timestamp = TSPrint::kNone;
-  bool print_colored = true;
+  int out_fd = STDOUT_FILENO;
+  PrintOptions options;
+  const char *from_time = nullptr;
+  const char *to_time = nullptr;
+  bool build_index = false;
+  bool follow = false;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  const char *literal_pattern = nullptr;
+  const char *regex_pattern = nullptr;
+  int search_context = 0;
+  bool analyze = false;
+  AnalyzerOptions analyzer_options;
+  Framing framing = Framing::kNone;
+  uint16_t framed_channels = 0x03;
+  bool exporting = false;
+  ExportFormat export_format = ExportFormat::kJsonl;
+  const char *compare_baseline = nullptr;
+  bool replay = false;
+  double replay_speed = 1;
+
+  enum LongOptions {
+    kFrom = 256, kTo, kBuildIndex, kMinSize, kMaxSize, kAnalyze, kInterval,
+    kExport, kCompare, kReplay
+  };
+  static const struct option long_options[] = {
+    { "from",        required_argument, nullptr, kFrom },
+    { "to",          required_argument, nullptr, kTo },
+    { "build-index", no_argument,       nullptr, kBuildIndex },
+    { "min-size",    required_argument, nullptr, kMinSize },
+    { "max-size",    required_argument, nullptr, kMaxSize },
+    { "analyze",     optional_argument, nullptr, kAnalyze },
+    { "interval",    required_argument, nullptr, kInterval },
+    { "export",      required_argument, nullptr, kExport },
+    { "compare",     required_argument, nullptr, kCompare },
+    { "replay",      optional_argument, nullptr, kReplay },
+    { nullptr, 0, nullptr, 0 },
+  };
 
   int opt;
-  while ((opt = getopt(argc, argv, "ht:co:s:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "ht:co:s:flj:e:E:C:F:", long_options,
+                            nullptr)) != -1) {
     switch (opt) {
     case 'h': return usage(argv[0], 0);
     case 't': switch (optarg[0]) {
-      case 's': print_timestamp = TSPrint::kStartFile; break;
-      case 'a': print_timestamp = TSPrint::kAbsolute; break;
-      case 'd': print_timestamp = TSPrint::kDelta; break;
+      case 's': options.print_timestamp = TSPrint::kStartFile; break;
+      case 'a': options.print_timestamp = TSPrint::kAbsolute; break;
+      case 'd': options.print_timestamp = TSPrint::kDelta; break;
       default:
         fprintf(stderr, "-t requires a letter to qualify timestamp printing\n");
         return usage(argv[0], 2);
       }
       break;
-    case 'c': print_colored = !print_colored; break;
-    case 'o': out = fopen(optarg, "wb"); break;
-    case 's': {
-      int s[4];   // In case there will be an extra channel.
-      int count = sscanf(optarg, "%d,%d,%d,%d", &s[0], &s[1], &s[2], &s[3]);
-      for (int i = 0; i < count; ++i) selected_channels.insert(s[i]);
+    case 'c': options.print_colored = !options.print_colored; break;
+    case 'o': out_fd = open(optarg, O_WRONLY|O_CREAT|O_TRUNC, 0644); break;
+    case 's':
+      if (!ParseChannelList(optarg, &options.filter.channels)) {
+        fprintf(stderr, "-s requires a list of channels 0..15\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    case 'f': follow = true; break;
+    case 'l': options.timestamp_every_line = true; break;
+    case 'j': threads = std::max(1, atoi(optarg)); break;
+    case 'e': literal_pattern = optarg; break;
+    case 'E': regex_pattern = optarg; break;
+    case 'C': search_context = atoi(optarg); break;
+    case 'F': {
+      const char *channels = strchr(optarg, ':');
+      const std::string name(optarg,
+                             channels ? channels - optarg : strlen(optarg));
+      if (!ParseFramingName(name.c_str(), &framing)) {
+        fprintf(stderr, "-F: unknown framing '%s'\n", name.c_str());
+        return usage(argv[0], 2);
+      }
+      if (channels && !ParseChannelList(channels + 1, &framed_channels)) {
+        fprintf(stderr, "-F: expected list of channels 0..15\n");
+        return usage(argv[0], 2);
+      }
+      break;
     }
-      // ΤODO: case 'f' for 'follow'
+    case kFrom: from_time = optarg; break;
+    case kTo: to_time = optarg; break;
+    case kBuildIndex: build_index = true; break;
+    case kMinSize: options.filter.min_size = atoi(optarg); break;
+    case kMaxSize: options.filter.max_size = atoi(optarg); break;
+    case kAnalyze:
+      analyze = true;
+      if (optarg && !ParsePairingName(optarg, &analyzer_options.pairing)) {
+        fprintf(stderr, "--analyze: pairing is one of next or jsonrpc\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    case kInterval:
+      analyzer_options.interval_ns = (int64_t)(atof(optarg) * 1e9);
+      break;
+    case kExport:
+      exporting = true;
+      if (!ParseExportFormatName(optarg, &export_format)) {
+        fprintf(stderr, "--export: format is one of jsonl, csv or pcapng\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    case kCompare: compare_baseline = optarg; break;
+    case kReplay:
+      replay = true;
+      if (optarg) replay_speed = atof(optarg);
+      break;
+    default:
+      return usage(argv[0], 2);
     }
   }
 
-  if (!out) {
+  if (optind >= argc) {
+    return usage(argv[0], 2);
+  }
+
+  if (out_fd < 0) {
     perror("Couldn't open output file");
     return 1;
   }
 
-  if (selected_channels.empty()) {
-    selected_channels = {0, 1, 2};
+  // Closed markers and empty records have nothing to print, but are part
+  // of an export, and tell when to close in a replay, which by default is
+  // of what went to the program's stdin.
+  if (replay && options.filter.channels == 0xffff) {
+    options.filter.channels = 1 << 0;
+  }
+  if (!exporting && !replay) {
+    options.filter.closed = RecordFilter::Closed::kExclude;
+    options.filter.min_size = std::max(options.filter.min_size, 1u);
+  }
+
+  std::unique_ptr<PayloadMatcher> matcher;
+  if (literal_pattern && regex_pattern) {
+    fprintf(stderr, "Only one of -e or -E please\n");
+    return usage(argv[0], 2);
+  } else if (literal_pattern) {
+    matcher.reset(PayloadMatcher::CreateLiteral(literal_pattern));
+  } else if (regex_pattern) {
+    std::string error;
+    matcher.reset(PayloadMatcher::CreateRegex(regex_pattern, &error));
+    if (!matcher) {
+      fprintf(stderr, "Invalid regular expression: %s\n", error.c_str());
+      return usage(argv[0], 2);
+    }
   }
 
   const char *in_filename = argv[optind];
-  FILE *instream = fopen(in_filename, "r");
-  if (!instream) {
+  if (build_index) {
+    return BuildIndex(in_filename);
+  }
+
+  if (compare_baseline) {
+    OutputBuffer out(out_fd);
+    return CompareLogs(compare_baseline, in_filename, options.filter.channels,
+                       framing, framed_channels, &out);
+  }
+
+  std::unique_ptr<LogReader> reader = OpenLogReader(in_filename, follow);
+  if (!reader) {
     perror("Couldn't open input");
     return 1;
   }
+  OutputBuffer out(out_fd);
+  if (follow) {
+    // Whatever we have should be visible before waiting for more.
+    static_cast<FollowLogReader *>(reader.get())->SetIdleCallback(
+      [&out]() { out.Flush(); });
+  }
 
-  char copy_buf[65535];
-  BlockHeader header;
+  RecordHeader header;
+  const char *copy_buf;
   int64_t start_timestamp = -1;
-  bool last_was_newline = true;
-  char delta_timestamp_prefix = ' ';
-
-  while (fread(&header, sizeof(header), 1, instream)) {
-    if (start_timestamp < 0) start_timestamp = header.timestamp_ns;
-    if (header.block_size == 0) continue;
 
-    if (!fread(copy_buf, header.block_size, 1, instream)) {
-      fprintf(stderr, "Unexpected end of file reading %d bytes\n",
-              header.block_size);
-      return 1;
+  bool have_record = reader->Next(&header, &copy_buf);
+  if (have_record) {
+    start_timestamp = header.timestamp_ns;
+    const int64_t reference = reader->info().version >= 2
+      ? reader->info().start_wallclock_ns : start_timestamp;
+    RecordFilter &filter = options.filter;
+    if ((from_time && !ParseTime(from_time, reference, &filter.from_ns)) ||
+        (to_time && !ParseTime(to_time, reference, &filter.to_ns))) {
+      fprintf(stderr, "Invalid time given in --from or --to\n");
+      return usage(argv[0], 2);
     }
+  }
+  // From here on, the reader does not even look at payloads we don't need.
+  // Sizes only apply to the messages, which need all the pieces and the
+  // end of a channel to be reassembled.
+  RecordFilter read_filter = options.filter;
+  std::unique_ptr<RecordFramer> framer;
+  if (framing != Framing::kNone) {
+    framer.reset(new RecordFramer(framing, framed_channels));
+    read_filter.min_size = 0;
+    read_filter.max_size = UINT32_MAX;
+    read_filter.closed = RecordFilter::Closed::kAny;
+  }
+  reader->SetFilter(&read_filter);
 
-    if (selected_channels.count(header.channel) == 0)
-      continue;  // Not interested in printing this channel. Skip.
-
-    if (header.channel_closed)
-      continue;
+  // With an index, we can skip right to the start of the time range.
+  MmapLogReader *mmap_reader = dynamic_cast<MmapLogReader *>(reader.get());
+  std::vector<IndexEntry> index;
+  if (have_record && mmap_reader &&
+      ReadLogIndex(IndexFilename(in_filename), &index) && from_time) {
+    const uint64_t offset = FindIndexOffset(index, options.filter.from_ns);
+    if (offset > mmap_reader->position() && offset < mmap_reader->size()) {
+      mmap_reader->Seek(offset);
+      have_record = reader->Next(&header, &copy_buf);
+    }
+  }
 
-    if (print_timestamp != TSPrint::kNone && !last_was_newline)
-      fprintf(out, "\n");  // make sure timestamps start in a new line.
+  if (replay) {
+    // With a time range, it starts right away at its beginning.
+    return ReplayRecords(reader.get(), options.filter, have_record, header,
+                         copy_buf, from_time ? options.filter.from_ns
+                                             : start_timestamp,
+                         replay_speed, optind + 1 < argc ? argv + optind + 1
+                                                         : nullptr,
+                         out_fd);
+  }
 
-    const int64_t since_start = header.timestamp_ns - start_timestamp;
-    switch (print_timestamp) {
-    case TSPrint::kNone: break;
-    case TSPrint::kStartFile:
-      fprintf(out, "%6ld.%06ldms: ",
-              since_start / 1000000, since_start % 1000000);
-      break;
-    case TSPrint::kDelta:
-      fprintf(out, "%c%5ld.%06ldms: ", delta_timestamp_prefix,
-              since_start / 1000000, since_start % 1000000);
-      delta_timestamp_prefix = '+';
-      start_timestamp = header.timestamp_ns;
-      break;
-    case TSPrint::kAbsolute: {
-      const time_t seconds = header.timestamp_ns / 1000000000;
-      struct tm prdate;
-      localtime_r(&seconds, &prdate);
-      char buffer[32];
-      strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &prdate);
-      fprintf(out, "[%s.%09ld]: ", buffer, header.timestamp_ns % 1000000000);
-      break;
+  if (analyze) {
+    LatencyAnalyzer analyzer(analyzer_options, reader->info().channel_names,
+                             start_timestamp, &out);
+    ProcessRecords(reader.get(), options.filter, framer.get(), out,
+                   have_record, header, copy_buf,
+                   [&](const RecordHeader &header, const char *payload) {
+                     if (options.filter.Accepts(header)) {
+                       analyzer.Process(header, payload);
+                     }
+                   });
+    analyzer.Report();
+    out.Flush();
+    ReportSkipped(reader->skipped(), reader->info());
+    if (!reader->error().empty()) {
+      fprintf(stderr, "%s\n", reader->error().c_str());
+      return 1;
     }
+    return 0;
+  }
+
+  if (exporting) {
+    // Only the records matching a search, without context.
+    RecordExporter exporter(export_format, reader->info().channel_names,
+                            &out);
+    ProcessRecords(reader.get(), options.filter, framer.get(), out,
+                   have_record, header, copy_buf,
+                   [&](const RecordHeader &header, const char *payload) {
+                     if (options.filter.Accepts(header) &&
+                         (!matcher ||
+                          matcher->Matches(payload, header.block_size))) {
+                       exporter.Export(header, payload);
+                     }
+                   });
+    out.Flush();
+    ReportSkipped(reader->skipped(), reader->info());
+    if (!reader->error().empty()) {
+      fprintf(stderr, "%s\n", reader->error().c_str());
+      return 1;
     }
+    return 0;
+  }
 
-    if (print_colored) {
-      write_colored(out, header.channel, copy_buf, header.block_size);
-    } else {
-      fwrite(copy_buf, 1, header.block_size, out);
+  RecordPrinter printer(options, start_timestamp, &out);
+  // Searching needs to know what came before and messages can span
+  // chunks, so these are done sequentially.
+  if (have_record && mmap_reader && threads > 1 && !matcher && !framer) {
+    const std::vector<size_t> split_points = ChooseSplitPoints(
+      *mmap_reader, index, mmap_reader->record_position());
+    SkippedCounts skipped = reader->skipped();
+    const std::string error = PrintParallel(*mmap_reader, split_points,
+                                            options, start_timestamp,
+                                            threads, &printer, &out,
+                                            &skipped);
+    out.Flush();
+    ReportSkipped(skipped, reader->info());
+    if (!error.empty()) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
     }
-    last_was_newline = copy_buf[header.block_size - 1] == '\n';
+    return 0;
+  }
+
+  std::unique_ptr<RecordSearch> search;
+  if (matcher) {
+    search.reset(new RecordSearch(std::move(matcher), search_context,
+                                  &printer));
+  }
+
+  ProcessRecords(reader.get(), options.filter, framer.get(), out,
+                 have_record, header, copy_buf,
+                 [&](const RecordHeader &header, const char *payload) {
+                   if (search) {
+                     if (printer.Selected(header)) {
+                       // Unless reassembled or decompressed, payloads are
+                       // in the mapped file and need not be copied.
+                       search->Process(header, payload,
+                                       mmap_reader &&
+                                       payload >= mmap_reader->data() &&
+                                       payload < mmap_reader->data() +
+                                       mmap_reader->size());
+                     }
+                   } else {
+                     printer.Print(header, payload);
+                   }
+                 });
+  out.Flush();
+  ReportSkipped(reader->skipped(), reader->info());
+  if (!reader->error().empty()) {
+    fprintf(stderr, "%s\n", reader->error().c_str());
+    return 1;
   }
   return 0;
 }
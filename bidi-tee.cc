@@ -1,104 +1,377 @@
 #include <fcntl.h>
-#include <sys/select.h>
+#include <signal.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 #include <unistd.h>
 
-#include <algorithm>
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstring>
 #include <cstdint>
-#include <time.h>
-#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "block-header.h"
-
-static int usage(const char *progname) {
-  fprintf(stderr, "Usage: %s <output-logfile> -- "
+#include "capture-sampler.h"
+#include "channel-copier.h"
+#include "event-loop.h"
+#include "log-broadcast.h"
+#include "log-compression.h"
+#include "log-format.h"
+#include "log-index.h"
+#include "log-rotation.h"
+#include "log-sink.h"
+#include "log-writer.h"
+#include "message-framer.h"
+#include "record-filter.h"
+#include "telemetry.h"
+#include "terminal.h"
+
+static int usage(const char *progname, int retval) {
+  fprintf(stderr, "Usage: %s [<options>] <output-logfile> -- "
           "</path/to/program> <program-options...>\n", progname);
-  return 2;
+  fprintf(stderr,
+          "-h            : this help\n"
+          "-z            : zero-copy forwarding with splice()/tee() where "
+          "possible\n"
+          "-p            : run program on a pseudo-terminal for its stdin and "
+          "stdout\n"
+          "-a <policy>   : write log asynchronously in a separate thread.\n"
+          "                Policy if queue is full: 'block', 'drop' or "
+          "'spill'\n"
+          "-b <KiB>      : size of the asynchronous queue (default: 4096)\n"
+          "-e <loop>     : event loop: 'select', 'epoll' (default) or "
+          "'uring'\n"
+          "-c <KiB>      : coalesce log records in a buffer of this size\n"
+          "-w <ms>       : with -c: flush buffered records after this time "
+          "(default: 1)\n"
+          "-f <version>  : log format version 1 or 2 (default: 2)\n"
+          "-i <n>[:<ms>] : write time index <logfile>.idx with an entry "
+          "every\n"
+          "                <n> records and/or <ms> milliseconds "
+          "(0: unused)\n"
+          "-Z <codec>[:<level>] : compress log in frames of -c size "
+          "(default: 256).\n"
+          "                Codec: 'zlib'\n"
+          "-r <MiB>[:<seconds>] : rotate log: write parts <logfile>.0, "
+          "<logfile>.1, ...\n"
+          "                of at most this size and/or age (0: unused)\n"
+          "-k <parts>    : with -r: only keep this many of the newest parts\n"
+          "-R <MiB>      : flight recorder: only keep about the last MiB in "
+          "a\n"
+          "                preallocated ring file\n"
+          "-F <framing>[:<channels>] : log whole messages instead of reads on"
+          " the\n"
+          "                channels (default: 0,1). Framing: 'newline',\n"
+          "                'content-length' or 'length32'\n"
+          "-s <sampling>[:<channels>] : only log part of the reads on the "
+          "channels\n"
+          "                (default: all); still forwards everything. "
+          "Comma separated\n"
+          "                1/<n>: one in n reads, head=<bytes>: first bytes "
+          "of each,\n"
+          "                rate=<KiB/s>: limit of logged bytes per second\n"
+          "-t <clock>    : timestamp clock: 'monotonic' (default), 'coarse'"
+          " or 'tsc'\n"
+          "-x <fd>:<in|out>[:<name>] : also capture inherited fd >= 3. 'out' "
+          "is\n"
+          "                written by the program, 'in' read by it. Can be "
+          "repeated.\n"
+          "-S <path>[:<KiB>] : broadcast the records live to subscribers of "
+          "this\n"
+          "                Unix-domain socket, e.g. bidi-tee-print -f <path>."
+          "\n"
+          "                New subscribers catch up from a ring of this size"
+          "\n"
+          "                (default: 4096)\n"
+          "-m            : count what bidi-tee itself does; summary at exit "
+          "and on\n"
+          "                SIGUSR1\n"
+          "-M [<host>:]<port> : like -m, and serve the counters for "
+          "Prometheus\n"
+          "                over HTTP (default host: localhost)\n"
+          "Instead of a file, the log can be streamed to a collector at\n"
+          "tcp://<host>:<port>, unix:<path> or "
+          "udp://<host>:<port>[/<size>].\n");
+  return retval;
 }
 
-using timestamp_t = int64_t;
-
-static timestamp_t GetTimeNanoseconds() {
-  struct timespec t;
-  clock_gettime(CLOCK_MONOTONIC, &t);
-  const timestamp_t uncorrected =  (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
-
-  // since CLOCK_MONOTONIC is not based on start of epoch (but typically
-  // since machine was booted), let's rebase that.
-  // First time we're called, determine the offset to the actual time. The
-  // absolute time we only have in microsecond resolution, but good enough.
-  static timestamp_t monotone_offset = [uncorrected]() -> timestamp_t {
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return (tv.tv_sec * 1000000000 + tv.tv_usec * 1000) - uncorrected;
-  }();
-  return uncorrected + monotone_offset;
-}
+// An additional file descriptor passed through to the program.
+struct ExtraChannel {
+  int fd;
+  bool to_child;     // 'in': program reads it.
+  std::string name;
+  int pipe_fds[2];
+};
 
-static void reliable_write(int fd, char *buffer, ssize_t size) {
-  while (size > 0) {
-    int w = write(fd, buffer, size);
-    if (w < 0) return;  // Uhm.
-    size -= w;
-    buffer += w;
+// Parse <fd>:<in|out>[:<name>].
+static bool ParseExtraChannel(const char *spec, ExtraChannel *extra) {
+  char *end;
+  const long fd = strtol(spec, &end, 10);
+  if (end == spec || *end != ':' || fd < 3) return false;
+  const char *direction = end + 1;
+  const char *name = strchr(direction, ':');
+  const std::string dir(direction,
+                        name ? name - direction : strlen(direction));
+  if (dir == "in") {
+    extra->to_child = true;
+  } else if (dir == "out") {
+    extra->to_child = false;
+  } else {
+    return false;
   }
+  extra->fd = (int)fd;
+  extra->name = name ? name + 1 : "fd" + std::to_string(fd);
+  return true;
 }
 
-class ChannelCopier {
-public:
-  ChannelCopier(int channel, int read_fd, int write_fd)
-    : read_fd_(read_fd), write_fd_(write_fd) {
-    memset(&header_, 0x00, sizeof(header_));
-    header_.channel = channel;
-    block_[0].iov_base = &header_;
-    block_[0].iov_len = sizeof(header_);
-  }
-
-  int readfd() const { return read_fd_; }
-  bool valid() const { return !header_.channel_closed; }
-  void AddToFdset(fd_set *s) const {
-    if (valid()) {
-      FD_SET(read_fd_, s);
-    } else {
-      FD_CLR(read_fd_, s);
+int main(int argc, char *argv[]) {
+  bool zero_copy = false;
+  bool use_pty = false;
+  bool async_log = false;
+  AsyncLogWriter::FullPolicy full_policy = AsyncLogWriter::FullPolicy::kBlock;
+  size_t async_queue_size = 4096 << 10;
+  const char *event_loop_name = "epoll";
+  size_t coalesce_buffer_size = 0;
+  double flush_window_ms = 1.0;
+  int format_version = 2;
+  bool write_index = false;
+  int index_every_records = 0;
+  double index_every_ms = 0;
+  Codec codec = Codec::kNone;
+  int compression_level = 0;
+  std::vector<ExtraChannel> extra_channels;
+  const char *clock_name = "monotonic";
+  ClockSource clock_source = ClockSource::kMonotonic;
+  Framing framing = Framing::kNone;
+  uint64_t rotate_bytes = 0;
+  double rotate_seconds = 0;
+  int keep_parts = 0;
+  uint64_t ring_bytes = 0;
+  std::string broadcast_path;
+  size_t broadcast_ring_size = 4 << 20;
+  uint16_t framed_channels = 0x03;
+  SamplingOptions sampling;
+  uint16_t sampled_channels = 0xffff;
+  bool telemetry = false;
+  std::string telemetry_address;
+
+  int opt;
+  // Options only before the logfile; everything after belongs to program.
+  while ((opt = getopt(argc, argv,
+                       "+hzpma:b:e:c:w:f:i:Z:F:s:t:x:r:k:R:S:M:")) != -1) {
+    switch (opt) {
+    case 'h': return usage(argv[0], 0);
+    case 'z': zero_copy = true; break;
+    case 'p': use_pty = true; break;
+    case 'm': telemetry = true; break;
+    case 'M':
+      telemetry = true;
+      telemetry_address = optarg;
+      break;
+    case 'a':
+      async_log = true;
+      if (strcmp(optarg, "block") == 0) {
+        full_policy = AsyncLogWriter::FullPolicy::kBlock;
+      } else if (strcmp(optarg, "drop") == 0) {
+        full_policy = AsyncLogWriter::FullPolicy::kDrop;
+      } else if (strcmp(optarg, "spill") == 0) {
+        full_policy = AsyncLogWriter::FullPolicy::kSpill;
+      } else {
+        fprintf(stderr, "-a requires one of block, drop or spill\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    case 'b': async_queue_size = (size_t)atoi(optarg) << 10; break;
+    case 'e': event_loop_name = optarg; break;
+    case 'c': coalesce_buffer_size = (size_t)atoi(optarg) << 10; break;
+    case 'w': flush_window_ms = atof(optarg); break;
+    case 'f':
+      format_version = atoi(optarg);
+      if (format_version < 1 || format_version > 2) {
+        fprintf(stderr, "-f: only format versions 1 and 2 are supported\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    case 'i': {
+      write_index = true;
+      index_every_records = atoi(optarg);
+      const char *ms = strchr(optarg, ':');
+      if (ms) index_every_ms = atof(ms + 1);
+      if (index_every_records <= 0 && index_every_ms <= 0) {
+        fprintf(stderr, "-i: need number of records or milliseconds\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    }
+    case 'Z': {
+      const char *level = strchr(optarg, ':');
+      const std::string name(optarg, level ? level - optarg : strlen(optarg));
+      if (!ParseCodecName(name.c_str(), &codec)) {
+        fprintf(stderr, "-Z: unknown codec '%s'\n", name.c_str());
+        return usage(argv[0], 2);
+      }
+      if (level) compression_level = atoi(level + 1);
+      break;
+    }
+    case 'r': {
+      rotate_bytes = (uint64_t)(atof(optarg) * (1 << 20));
+      const char *seconds = strchr(optarg, ':');
+      if (seconds) rotate_seconds = atof(seconds + 1);
+      if (rotate_bytes == 0 && rotate_seconds <= 0) {
+        fprintf(stderr, "-r: need size or time\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    }
+    case 'k': keep_parts = atoi(optarg); break;
+    case 'S': {
+      // Paths might contain colons, sizes are just digits.
+      const char *size = strrchr(optarg, ':');
+      if (size && (!size[1] || strspn(size + 1, "0123456789") !=
+                   strlen(size + 1))) {
+        size = nullptr;
+      }
+      broadcast_path.assign(optarg, size ? size - optarg : strlen(optarg));
+      if (size) broadcast_ring_size = (size_t)atoi(size + 1) << 10;
+      if (broadcast_path.empty()) {
+        fprintf(stderr, "-S: needs the path of the socket\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    }
+    case 'R':
+      ring_bytes = (uint64_t)(atof(optarg) * (1 << 20));
+      if (ring_bytes < kMinRingSize) {
+        fprintf(stderr, "-R: ring file needs at least %zu MiB\n",
+                kMinRingSize >> 20);
+        return usage(argv[0], 2);
+      }
+      break;
+    case 'F': {
+      const char *channels = strchr(optarg, ':');
+      const std::string name(optarg,
+                             channels ? channels - optarg : strlen(optarg));
+      if (!ParseFramingName(name.c_str(), &framing)) {
+        fprintf(stderr, "-F: unknown framing '%s'\n", name.c_str());
+        return usage(argv[0], 2);
+      }
+      if (channels && !ParseChannelList(channels + 1, &framed_channels)) {
+        fprintf(stderr, "-F: expected list of channels 0..15\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    }
+    case 's': {
+      const char *channels = strchr(optarg, ':');
+      const std::string spec(optarg,
+                             channels ? channels - optarg : strlen(optarg));
+      if (!ParseSamplingOptions(spec.c_str(), &sampling)) {
+        fprintf(stderr, "-s: expected 1/<n>, head=<bytes> and/or "
+                "rate=<KiB/s>\n");
+        return usage(argv[0], 2);
+      }
+      if (channels && !ParseChannelList(channels + 1, &sampled_channels)) {
+        fprintf(stderr, "-s: expected list of channels 0..15\n");
+        return usage(argv[0], 2);
+      }
+      break;
+    }
+    case 't':
+      clock_name = optarg;
+      if (!ParseClockSourceName(clock_name, &clock_source)) {
+        fprintf(stderr, "-t: unknown clock '%s'\n", optarg);
+        return usage(argv[0], 2);
+      }
+      break;
+    case 'x': {
+      ExtraChannel extra;
+      if (!ParseExtraChannel(optarg, &extra)) {
+        fprintf(stderr, "-x: expected <fd>:<in|out>[:<name>] with fd >= 3\n");
+        return usage(argv[0], 2);
+      }
+      for (const ExtraChannel &other : extra_channels) {
+        if (other.fd == extra.fd) {
+          fprintf(stderr, "-x: fd %d given twice\n", extra.fd);
+          return usage(argv[0], 2);
+        }
+      }
+      // Channel numbers are four bits; 0..2 are the standard streams.
+      if (extra_channels.size() >= 13) {
+        fprintf(stderr, "-x: at most 13 additional channels\n");
+        return usage(argv[0], 2);
+      }
+      extra_channels.push_back(extra);
+      break;
+    }
+    default:
+      return usage(argv[0], 2);
     }
   }
 
-  void CopyUsingBuffer(timestamp_t timestamp, int tee_fd,
-                       char *buf, size_t size) {
-    int r = read(read_fd_, buf, size);
-    block_[1].iov_base = buf;
-    block_[1].iov_len = r > 0 ? r : 0;
-    reliable_write(write_fd_, buf, r);
-    header_.channel_closed = (r <= 0);
-    header_.timestamp_ns = timestamp;
-    header_.block_size = block_[1].iov_len;
-    writev(tee_fd, block_, 2);
+  if (argc - optind < 3) {
+    return usage(argv[0], 2);
   }
 
-private:
-  const int read_fd_;
-  const int write_fd_;
-  BlockHeader header_;
-  iovec block_[2];
-};
+  if (codec != Codec::kNone) {
+    if (format_version < 2) {
+      fprintf(stderr, "-Z: compression needs log format version 2\n");
+      return usage(argv[0], 2);
+    }
+    // Frames are as large as the coalescing buffer.
+    if (!coalesce_buffer_size) coalesce_buffer_size = 256 << 10;
+  }
 
-int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    return usage(argv[0]);
+  if (sampling.active()) {
+    // What is left out is accounted for in extension records.
+    if (format_version < 2) {
+      fprintf(stderr, "-s: sampling needs log format version 2\n");
+      return usage(argv[0], 2);
+    }
+    if (framing != Framing::kNone && (sampled_channels & framed_channels)) {
+      fprintf(stderr, "-s: sampled channels can't be framed with -F\n");
+      return usage(argv[0], 2);
+    }
+  }
+
+  if (!SetClockSource(clock_source)) {
+    fprintf(stderr, "-t: clock '%s' not available on this machine\n",
+            clock_name);
+    return 1;
   }
 
-  const char *out_filename = argv[1];
+  const bool rotate = rotate_bytes || rotate_seconds > 0;
+  if (ring_bytes && (rotate || write_index)) {
+    fprintf(stderr, "-R: a ring file can't be rotated or indexed\n");
+    return usage(argv[0], 2);
+  }
+  if (keep_parts < 0 || (keep_parts && !rotate)) {
+    fprintf(stderr, "-k: only makes sense with -r\n");
+    return usage(argv[0], 2);
+  }
+
+  std::unique_ptr<EventLoop> event_loop = CreateEventLoop(event_loop_name);
+  if (!event_loop) {
+    fprintf(stderr, "Unknown event loop '%s'\n", event_loop_name);
+    return usage(argv[0], 2);
+  }
+
+  const char *out_filename = argv[optind];
+  const bool network_sink = IsNetworkAddress(out_filename);
+  if (network_sink && (rotate || ring_bytes || write_index)) {
+    fprintf(stderr, "-r/-R/-i: only for log files, not for a collector\n");
+    return usage(argv[0], 2);
+  }
+  if (network_sink && !async_log) {
+    // Forwarding should never wait for the network.
+    async_log = true;
+    full_policy = AsyncLogWriter::FullPolicy::kDrop;
+  }
 
-  if (strcmp(argv[2], "--") != 0) {
-    // Right now, we don't actually have options yet, but to be ready
-    // for options, let's enforce -- already now.
+  if (strcmp(argv[optind + 1], "--") != 0) {
     fprintf(stderr, "Expected -- before name of program to start\n");
     return 1;
   }
@@ -106,19 +379,74 @@ int main(int argc, char *argv[]) {
   static constexpr int kReadSide = 0;
   static constexpr int kWriteSide = 1;
 
-  const int start_of_program = 3;
+  const int start_of_program = optind + 2;
+
+  // Our own end of an extra fd is the one inherited under the same number.
+  // An 'out' fd we did not inherit still gets logged, just not forwarded.
+  // Occupying all the numbers first makes sure no pipe ends on one of them.
+  for (const ExtraChannel &extra : extra_channels) {
+    if (fcntl(extra.fd, F_GETFD) >= 0) continue;
+    if (extra.to_child) {
+      fprintf(stderr, "-x: fd %d to pass to program is not open\n",
+              extra.fd);
+      return 1;
+    }
+    const int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0 || dup2(devnull, extra.fd) < 0) {
+      perror("/dev/null");
+      return 1;
+    }
+    if (devnull != extra.fd) close(devnull);
+  }
 
   // Pipes in two directions
   int parent_to_child_stdin[2];
   int child_to_parent_stdout[2];
   int child_to_parent_stderr[2];
 
-  if (pipe(parent_to_child_stdin) < 0 ||
-      pipe(child_to_parent_stdout) < 0 ||
-      pipe(child_to_parent_stderr) < 0) {
+  if (use_pty) {
+    // Both directions go through the master; with separate fds for each,
+    // the end of our stdin doesn't close the program's stdout.
+    int master, slave;
+    if (!OpenPseudoTerminal(&master, &slave)) {
+      perror("Couldn't open pseudo-terminal");
+      return 1;
+    }
+    parent_to_child_stdin[kReadSide] = slave;
+    parent_to_child_stdin[kWriteSide] = fcntl(master, F_DUPFD_CLOEXEC, 0);
+    child_to_parent_stdout[kReadSide] = master;
+    child_to_parent_stdout[kWriteSide] = fcntl(slave, F_DUPFD_CLOEXEC, 0);
+    if (parent_to_child_stdin[kWriteSide] < 0 ||
+        child_to_parent_stdout[kWriteSide] < 0) {
+      perror("Couldn't open pseudo-terminal");
+      return 1;
+    }
+  } else if (pipe(parent_to_child_stdin) < 0 ||
+             pipe(child_to_parent_stdout) < 0) {
     perror("Couldn't open pipes\n");
     return 1;
   }
+  // stderr stays a pipe, so it is still a separate channel.
+  if (pipe(child_to_parent_stderr) < 0) {
+    perror("Couldn't open pipes\n");
+    return 1;
+  }
+
+  // Close-on-exec, so the program only sees the end dup2()-ed to the fd.
+  for (ExtraChannel &extra : extra_channels) {
+    if (pipe2(extra.pipe_fds, O_CLOEXEC) < 0) {
+      perror("Couldn't open pipes\n");
+      return 1;
+    }
+  }
+
+  // Counters are per thread, so this has to happen before any is started.
+  // The report signal is only taken by the reporter thread.
+  sigset_t original_signal_mask;
+  if (telemetry) {
+    EnableTelemetry();
+    BlockTelemetrySignal(&original_signal_mask);
+  }
 
   const int pid = fork();
   if (pid < 0) {
@@ -135,6 +463,13 @@ int main(int argc, char *argv[]) {
     dup2(parent_to_child_stdin[kReadSide], STDIN_FILENO);
     dup2(child_to_parent_stdout[kWriteSide], STDOUT_FILENO);
     dup2(child_to_parent_stderr[kWriteSide], STDERR_FILENO);
+    for (const ExtraChannel &extra : extra_channels) {
+      dup2(extra.pipe_fds[extra.to_child ? kReadSide : kWriteSide], extra.fd);
+    }
+    if (use_pty && !MakeControllingTerminal()) {
+      perror("Couldn't make pseudo-terminal the controlling terminal");
+    }
+    if (telemetry) sigprocmask(SIG_SETMASK, &original_signal_mask, nullptr);
 
     execv(argv[start_of_program], argv + start_of_program);
 
@@ -149,40 +484,197 @@ int main(int argc, char *argv[]) {
   }
 
   // Parent
+  // A reader that went away shows as EPIPE when forwarding, which closes
+  // that channel and is reported at the end; it doesn't end all of them.
+  signal(SIGPIPE, SIG_IGN);
+  const char pty_eof = use_pty ? EofCharacter(parent_to_child_stdin[kReadSide])
+                               : 0;
+  if (use_pty) PassThroughTerminal(child_to_parent_stdout[kReadSide]);
   close(parent_to_child_stdin[kReadSide]);
   close(child_to_parent_stdout[kWriteSide]);
   close(child_to_parent_stderr[kWriteSide]);
+  for (const ExtraChannel &extra : extra_channels) {
+    close(extra.pipe_fds[extra.to_child ? kReadSide : kWriteSide]);
+  }
 
-  const int outfd = open(out_filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
-  if (outfd < 0) {
+  LogFileInfo log_info;
+  log_info.version = format_version;
+  log_info.clock_source = clock_source;
+  // Records are timestamped with our clock; the header maps it to the
+  // wall clock once.
+  timestamp_t start_clock;
+  GetClockAnchor(&log_info.start_wallclock_ns, &start_clock);
+  log_info.channel_names = { {0, "stdin"}, {1, "stdout"}, {2, "stderr"} };
+  for (size_t i = 0; i < extra_channels.size(); ++i) {
+    log_info.channel_names[3 + i] = extra_channels[i].name;
+  }
+  const LogEncoder encoder(log_info, start_clock);
+
+  // Passing on the EOF of the program's stderr closes ours; keep a copy
+  // for what the log writers and the telemetry report when they finish.
+  const int saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+  std::unique_ptr<TelemetryReporter> reporter;
+  if (telemetry) {
+    reporter.reset(TelemetryReporter::Create(
+      saved_stderr >= 0 ? saved_stderr : STDERR_FILENO, telemetry_address,
+      log_info.channel_names));
+    if (!reporter) return 1;
+  }
+
+  // Writer for the log, or a part of it, in filename written by sink.
+  auto create_file_log = [&](LogSink *sink,
+                             const std::string &filename) -> FileLogWriter * {
+    std::unique_ptr<FileLogWriter> file_log(
+      new FileLogWriter(std::unique_ptr<LogSink>(sink), encoder,
+                        coalesce_buffer_size,
+                        (int64_t)(flush_window_ms * 1000000)));
+    if (write_index) {
+      const std::string index_filename = IndexFilename(filename.c_str());
+      LogIndexWriter *index = LogIndexWriter::Create(
+        index_filename, index_every_records,
+        (int64_t)(index_every_ms * 1000000));
+      if (!index) {
+        perror(index_filename.c_str());
+        return nullptr;
+      }
+      file_log->SetIndex(std::unique_ptr<LogIndexWriter>(index));
+    }
+    if (codec != Codec::kNone) {
+      Compressor *compressor = Compressor::Create(codec, compression_level);
+      if (!compressor) {
+        fprintf(stderr, "Could not initialize compression\n");
+        return nullptr;
+      }
+      file_log->SetCompressor(std::unique_ptr<Compressor>(compressor));
+    }
+    return file_log.release();
+  };
+
+  std::unique_ptr<LogWriter> log;
+  if (ring_bytes) {
+    RingLayout ring;
+    const int ring_fd = CreateRingFile(out_filename, ring_bytes, &ring);
+    if (ring_fd < 0) {
+      perror("Couldn't create ring file");
+      return 1;
+    }
+    // Each part takes the next slot and writes through its own fd, which
+    // shares the file position set up by BeginRingSlot().
+    log.reset(RotatingLogWriter::Create(
+      ring.capacity(), 0,
+      [&create_file_log, ring, ring_fd](uint64_t part) -> FileLogWriter * {
+        if (!BeginRingSlot(ring_fd, ring, part)) return nullptr;
+        const int fd = dup(ring_fd);
+        return fd < 0 ? nullptr : create_file_log(new FdSink(fd), "");
+      },
+      [ring, ring_fd](uint64_t part, uint64_t bytes) {
+        SetRingSlotUsed(ring_fd, ring, part, bytes);
+      }));
+  } else if (rotate) {
+    log.reset(RotatingLogWriter::Create(
+      rotate_bytes, (int64_t)(rotate_seconds * 1e9),
+      [&create_file_log, out_filename](uint64_t part) -> FileLogWriter * {
+        const std::string filename = RotatedFilename(out_filename, part);
+        const int fd = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        return fd < 0 ? nullptr : create_file_log(new FdSink(fd), filename);
+      },
+      nullptr,
+      [out_filename, keep_parts](uint64_t part) {
+        // The next part exists already, so this makes keep_parts.
+        if (!keep_parts || part + 1 < (uint64_t)keep_parts) return;
+        const std::string expired = RotatedFilename(out_filename,
+                                                    part + 1 - keep_parts);
+        unlink(expired.c_str());
+        unlink(IndexFilename(expired.c_str()).c_str());
+      }));
+  } else if (network_sink) {
+    LogSink *sink = CreateNetworkSink(out_filename);
+    if (!sink) return 1;
+    // Datagrams are filled with as many records as fit.
+    if (sink->max_write_size() && !coalesce_buffer_size) {
+      coalesce_buffer_size = 64 << 10;
+    }
+    log.reset(create_file_log(sink, out_filename));
+  } else {
+    const int outfd = open(out_filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (outfd >= 0) {
+      log.reset(create_file_log(new FdSink(outfd), out_filename));
+    }
+  }
+  if (!log) {
     perror("Couldn't open output file");
     return 1;
   }
-
-  char copy_buf[65535];
-
-  ChannelCopier stdin_cp(0, STDIN_FILENO, parent_to_child_stdin[kWriteSide]);
-  ChannelCopier stdout_cp(1, child_to_parent_stdout[kReadSide], STDOUT_FILENO);
-  ChannelCopier stderr_cp(2, child_to_parent_stderr[kReadSide], STDERR_FILENO);
-
-  fd_set rd_fds;
-  FD_ZERO(&rd_fds);
-
-  const int max_fd = std::max(stdout_cp.readfd(), stderr_cp.readfd());
-
-  while (stdin_cp.valid() || stdout_cp.valid() || stderr_cp.valid()) {
-    for (const ChannelCopier &channel : { stdin_cp, stdout_cp, stderr_cp }) {
-      channel.AddToFdset(&rd_fds);
+  if (framing != Framing::kNone) {
+    log.reset(new FramingLogWriter(std::move(log), framing, framed_channels));
+  }
+  if (async_log) {
+    log.reset(new AsyncLogWriter(std::move(log), async_queue_size,
+                                 full_policy));
+  }
+  if (!broadcast_path.empty()) {
+    // On the forwarding path, so subscribers don't wait for the log writer.
+    LogWriter *broadcast = BroadcastLogWriter::Create(
+      std::move(log), broadcast_path, encoder, broadcast_ring_size);
+    if (!broadcast) {
+      perror(broadcast_path.c_str());
+      return 1;
     }
+    log.reset(broadcast);
+  }
 
-    int sret = select(max_fd+1, &rd_fds, NULL, NULL, NULL);
-    if (sret < 0) return 0;
-
-    const timestamp_t timestamp = GetTimeNanoseconds();
-    for (ChannelCopier *channel : { &stdin_cp, &stdout_cp, &stderr_cp }) {
-      if (FD_ISSET(channel->readfd(), &rd_fds)) {
-        channel->CopyUsingBuffer(timestamp, outfd, copy_buf, sizeof(copy_buf));
-      }
+  ChannelCopier stdin_cp(0, STDIN_FILENO, parent_to_child_stdin[kWriteSide],
+                         zero_copy);
+  if (use_pty) stdin_cp.SetEofCharacter(pty_eof);
+  ChannelCopier stdout_cp(1, child_to_parent_stdout[kReadSide], STDOUT_FILENO,
+                          zero_copy);
+  ChannelCopier stderr_cp(2, child_to_parent_stderr[kReadSide], STDERR_FILENO,
+                          zero_copy);
+
+  std::vector<std::unique_ptr<ChannelCopier>> extra_cp;
+  std::vector<ChannelCopier *> channels = { &stdin_cp, &stdout_cp, &stderr_cp };
+  for (size_t i = 0; i < extra_channels.size(); ++i) {
+    const ExtraChannel &extra = extra_channels[i];
+    if (extra.to_child) {
+      extra_cp.emplace_back(new ChannelCopier(3 + i, extra.fd,
+                                              extra.pipe_fds[kWriteSide],
+                                              zero_copy));
+    } else {
+      extra_cp.emplace_back(new ChannelCopier(3 + i, extra.pipe_fds[kReadSide],
+                                              extra.fd, zero_copy));
     }
+    channels.push_back(extra_cp.back().get());
+  }
+  // What a slow reader does not take right away waits in the backlog of
+  // its channel. On a pseudo-terminal, the master is also where stdout is
+  // read from, which then is non-blocking as well.
+  stdin_cp.SetNonBlocking(false);
+  stdout_cp.SetNonBlocking(true);
+  stderr_cp.SetNonBlocking(true);
+  for (size_t i = 0; i < extra_channels.size(); ++i) {
+    extra_cp[i]->SetNonBlocking(!extra_channels[i].to_child);
+  }
+  // What comes from the program is through pipes we made, which can grow
+  // for bulk output.
+  stdout_cp.AllowGrowingPipe();
+  stderr_cp.AllowGrowingPipe();
+  for (size_t i = 0; i < extra_channels.size(); ++i) {
+    if (!extra_channels[i].to_child) extra_cp[i]->AllowGrowingPipe();
+  }
+  for (ChannelCopier *channel : channels) {
+    if (sampling.active() && ((sampled_channels >> channel->channel()) & 1)) {
+      channel->SetSampling(sampling);
+    }
+  }
+
+  event_loop->Run(channels, log.get());
+  if (saved_stderr >= 0) dup2(saved_stderr, STDERR_FILENO);
+  for (const ChannelCopier *channel : channels) {
+    if (!channel->forward_error()) continue;
+    fprintf(stderr, "bidi-tee: %s: %" PRIu64 " bytes not forwarded: %s\n",
+            log_info.channel_names[channel->channel()].c_str(),
+            channel->not_forwarded(), strerror(channel->forward_error()));
   }
+  log.reset();
+  if (reporter) reporter->PrintSummary();
 }
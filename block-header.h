@@ -3,6 +3,7 @@
 
 #include <cstdint>
 
+// Header of a record in the version 1 log format.
 struct BlockHeader {
   int64_t timestamp_ns;
   uint64_t channel : 4;
@@ -12,4 +13,14 @@ struct BlockHeader {
 };
 static_assert(sizeof(BlockHeader) == 16, "Block header unexpected size");
 
+// A record header as it is passed around in memory, independent of the
+// version of the file format it is read from or written to.
+struct RecordHeader {
+  int64_t timestamp_ns;
+  uint32_t block_size;
+  uint8_t channel;
+  bool channel_closed;
+  bool extension;  // Payload is metadata, see log-format.h; version 2 only.
+};
+
 #endif // BLOCK_HEADER_H
@@ -0,0 +1,101 @@
+#include "buffer-pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "telemetry.h"
+
+BufferPool::~BufferPool() {
+  for (std::vector<char *> &buffers : free_) {
+    for (char *buffer : buffers) delete [] buffer;
+  }
+}
+
+size_t BufferPool::Capacity(size_t size) {
+  size_t result = kMinSize;
+  while (result < size) result <<= 1;
+  return result;
+}
+
+int BufferPool::SizeIndex(size_t capacity) {
+  for (int i = 0; i < kSizes; ++i) {
+    if ((kMinSize << i) == capacity) return i;
+  }
+  return -1;
+}
+
+char *BufferPool::Get(size_t size) {
+  const size_t capacity = Capacity(size);
+  const int index = SizeIndex(capacity);
+  if (index >= 0 && !free_[index].empty()) {
+    char *result = free_[index].back();
+    free_[index].pop_back();
+    free_bytes_ -= capacity;
+    return result;
+  }
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  if (telemetry) telemetry->buffer_allocations.Add(1);
+  return new char[capacity];
+}
+
+void BufferPool::Put(char *buffer, size_t capacity) {
+  const int index = SizeIndex(capacity);
+  if (index < 0 || free_bytes_ + capacity > max_free_bytes_) {
+    delete [] buffer;
+    return;
+  }
+  free_[index].push_back(buffer);
+  free_bytes_ += capacity;
+}
+
+void OutputBacklog::Append(const char *data, size_t len) {
+  size_ += len;
+  while (len > 0) {
+    if (pieces_.empty() || pieces_.back().end == pieces_.back().capacity) {
+      pieces_.push_back({ pool_->Get(kPieceSize), kPieceSize, 0, 0 });
+    }
+    Piece &last = pieces_.back();
+    const size_t n = std::min(len, last.capacity - last.end);
+    memcpy(last.buffer + last.end, data, n);
+    last.end += n;
+    data += n;
+    len -= n;
+  }
+}
+
+void OutputBacklog::Adopt(char *buffer, size_t capacity,
+                          size_t begin, size_t end) {
+  pieces_.push_back({ buffer, capacity, begin, end });
+  size_ += end - begin;
+}
+
+int OutputBacklog::Peek(struct iovec *iov, int max) const {
+  int count = 0;
+  for (const Piece &piece : pieces_) {
+    if (count == max) break;
+    iov[count].iov_base = piece.buffer + piece.begin;
+    iov[count].iov_len = piece.end - piece.begin;
+    ++count;
+  }
+  return count;
+}
+
+void OutputBacklog::Consume(size_t n) {
+  size_ -= n;
+  while (n > 0) {
+    Piece &first = pieces_.front();
+    const size_t taken = std::min(n, first.end - first.begin);
+    first.begin += taken;
+    n -= taken;
+    if (first.begin == first.end) {
+      pool_->Put(first.buffer, first.capacity);
+      pieces_.pop_front();
+    }
+  }
+}
+
+void OutputBacklog::Clear() {
+  for (const Piece &piece : pieces_) pool_->Put(piece.buffer, piece.capacity);
+  pieces_.clear();
+  size_ = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+// Buffers in power of two sizes, kept for re-use instead of going back to
+// the allocator each time; once warmed up, there are no allocations. The
+// unused ones kept are bounded in total size. Not thread-safe; for use by
+// the event loop.
+class BufferPool {
+public:
+  static constexpr size_t kMinSize = 4 << 10;
+  static constexpr int kSizes = 9;  // Kept: up to kMinSize << (kSizes-1).
+
+  explicit BufferPool(size_t max_free_bytes)
+    : max_free_bytes_(max_free_bytes) {}
+  ~BufferPool();
+
+  // Size of the buffer Get() returns for the size asked for: the next
+  // power of two, at least kMinSize.
+  static size_t Capacity(size_t size);
+
+  char *Get(size_t size);
+  void Put(char *buffer, size_t capacity);
+
+private:
+  static int SizeIndex(size_t capacity);  // -1 if not kept.
+
+  const size_t max_free_bytes_;
+  size_t free_bytes_ = 0;
+  std::vector<char *> free_[kSizes];
+};
+
+// Bytes waiting to be written, in order, in buffers from a pool.
+class OutputBacklog {
+public:
+  static constexpr size_t kPieceSize = 64 << 10;  // Of copies.
+
+  explicit OutputBacklog(BufferPool *pool) : pool_(pool) {}
+  ~OutputBacklog() { Clear(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void Append(const char *data, size_t len);
+
+  // Take over a buffer of the pool, of which bytes begin..end are still
+  // to be written, instead of copying them.
+  void Adopt(char *buffer, size_t capacity, size_t begin, size_t end);
+
+  // Fill up to max iovecs with what comes first, for writev(). Returns
+  // the number filled.
+  int Peek(struct iovec *iov, int max) const;
+
+  // Remove n bytes from the start, after they are written.
+  void Consume(size_t n);
+
+  void Clear();
+
+private:
+  struct Piece {
+    char *buffer;
+    size_t capacity;
+    size_t begin;
+    size_t end;
+  };
+  BufferPool *const pool_;
+  std::deque<Piece> pieces_;
+  size_t size_ = 0;
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,58 @@
+#include "capture-sampler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+bool ParseSamplingOptions(const char *spec, SamplingOptions *options) {
+  SamplingOptions result;
+  while (*spec) {
+    const char *comma = strchr(spec, ',');
+    const std::string item(spec, comma ? comma - spec : strlen(spec));
+    spec = comma ? comma + 1 : spec + item.size();
+    char *end;
+    if (item.compare(0, 2, "1/") == 0) {
+      const long every = strtol(item.c_str() + 2, &end, 10);
+      if (*end || every < 1 || every > 1000000000) return false;
+      result.every = (int)every;
+    } else if (item.compare(0, 5, "head=") == 0) {
+      const long long head = strtoll(item.c_str() + 5, &end, 10);
+      if (*end || head < 1) return false;
+      result.head = (size_t)head;
+    } else if (item.compare(0, 5, "rate=") == 0) {
+      const double rate = strtod(item.c_str() + 5, &end);
+      if (*end || rate * 1024 < 1) return false;
+      result.bytes_per_second = (uint64_t)(rate * 1024);
+    } else {
+      return false;
+    }
+  }
+  if (!result.active()) return false;
+  *options = result;
+  return true;
+}
+
+CaptureSampler::CaptureSampler(const SamplingOptions &options)
+  : options_(options), tokens_(options.bytes_per_second) {
+}
+
+size_t CaptureSampler::Sample(timestamp_t timestamp, size_t len) {
+  if (countdown_ > 0) {
+    --countdown_;
+    return 0;
+  }
+  countdown_ = options_.every - 1;
+  if (options_.head) len = std::min(len, options_.head);
+  if (options_.bytes_per_second) {
+    if (last_refill_ >= 0 && timestamp > last_refill_) {
+      tokens_ = std::min<double>(
+        tokens_ + (timestamp - last_refill_) * 1e-9 *
+        options_.bytes_per_second, options_.bytes_per_second);
+    }
+    last_refill_ = timestamp;
+    len = std::min(len, (size_t)tokens_);
+    tokens_ -= len;
+  }
+  return len;
+}
@@ -0,0 +1,40 @@
+#ifndef CAPTURE_SAMPLER_H
+#define CAPTURE_SAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "clock.h"
+
+// Which part of the data read from a busy channel is logged, to bound the
+// cost of capturing it. Everything is still forwarded.
+struct SamplingOptions {
+  int every = 1;                  // Log one in this many reads.
+  size_t head = 0;                // Only log the first bytes of a read.
+  uint64_t bytes_per_second = 0;  // Limit of logged bytes per second.
+
+  bool active() const { return every > 1 || head || bytes_per_second; }
+};
+
+// Parse a comma separated list of 1/<n>, head=<bytes> and rate=<KiB/s>,
+// e.g. "1/100,head=64". Returns false if not understood.
+bool ParseSamplingOptions(const char *spec, SamplingOptions *options);
+
+// Decides for each read of a channel how much of it to log. The rate is
+// a token bucket holding up to a second worth of bytes.
+class CaptureSampler {
+public:
+  explicit CaptureSampler(const SamplingOptions &options);
+
+  // Of a read of len bytes at timestamp, how many from the start to log;
+  // 0 to leave it out entirely.
+  size_t Sample(timestamp_t timestamp, size_t len);
+
+private:
+  const SamplingOptions options_;
+  int countdown_ = 0;     // Reads to leave out until the next logged one.
+  double tokens_;         // Bytes that can be logged right now.
+  timestamp_t last_refill_ = -1;
+};
+
+#endif // CAPTURE_SAMPLER_H
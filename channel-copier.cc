@@ -0,0 +1,365 @@
+#include "channel-copier.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "telemetry.h"
+
+void reliable_write(int fd, const char *buffer, ssize_t size) {
+  while (size > 0) {
+    const ssize_t w = write(fd, buffer, size);
+    if (w < 0) return;  // Uhm.
+    if (w < size) {
+      ThreadTelemetry *telemetry = GetThreadTelemetry();
+      if (telemetry) telemetry->short_writes.Add(1);
+    }
+    size -= w;
+    buffer += w;
+  }
+}
+
+static bool IsPipe(int fd) {
+  struct stat s;
+  return fstat(fd, &s) == 0 && S_ISFIFO(s.st_mode);
+}
+
+ChannelCopier::ChannelCopier(int channel, int read_fd, int write_fd,
+                             bool zero_copy)
+  : read_fd_(read_fd), write_fd_(write_fd),
+    // tee() only works between two pipes.
+    zero_copy_(zero_copy && IsPipe(read_fd) && IsPipe(write_fd)),
+    // Enough to keep what a full backlog and a read in flight use.
+    pool_(kBacklogWatermark + 2 * kMaxReadSize),
+    backlog_(&pool_) {
+  memset(&header_, 0x00, sizeof(header_));
+  header_.channel = channel;
+  skipped_header_ = header_;
+  skipped_header_.extension = true;
+}
+
+bool ChannelCopier::SetNonBlocking(bool shared) {
+  struct stat s;
+  if (fstat(write_fd_, &s) < 0) return false;
+  if (!S_ISFIFO(s.st_mode) && !S_ISCHR(s.st_mode)) return false;
+  if (!shared) {
+    const int flags = fcntl(write_fd_, F_GETFL);
+    if (flags < 0 || fcntl(write_fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+      return false;
+    }
+    nonblocking_ = true;
+    return true;
+  }
+  // Opening the file behind the fd again gives one of our own. Only use it
+  // if it is indeed the same; not e.g. a new pseudo-terminal from ptmx.
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", write_fd_);
+  const int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat reopened;
+  if (fstat(fd, &reopened) < 0 || reopened.st_dev != s.st_dev ||
+      reopened.st_ino != s.st_ino || reopened.st_rdev != s.st_rdev ||
+      dup2(fd, write_fd_) < 0) {
+    close(fd);
+    return false;
+  }
+  close(fd);
+  nonblocking_ = true;
+  return true;
+}
+
+void ChannelCopier::SetSampling(const SamplingOptions &options) {
+  sampler_.reset(new CaptureSampler(options));
+  zero_copy_ = false;  // Need to see the data to log only part of it.
+}
+
+void ChannelCopier::Copy(LogWriter *log) {
+  const int direct_fd = log->direct_fd();
+  // With a backlog, new data has to queue up behind it.
+  if (zero_copy_ && backlog_.empty() && direct_fd >= 0 &&
+      CopyUsingSplice(direct_fd, log->encoder(),
+                      std::min(kMaxReadSize, log->max_block_size()))) {
+    return;
+  }
+  CopyUsingBuffer(log);
+}
+
+void ChannelCopier::Flush(LogWriter *log) {
+  while (!backlog_.empty()) {
+    struct iovec iov[16];
+    const ssize_t w = writev(write_fd_, iov, backlog_.Peek(iov, 16));
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return;
+      ForwardFailed(errno, 0);
+      EndInput(log);
+      break;
+    }
+    backlog_.Consume(w);
+  }
+  if (!valid()) EndOutput();
+}
+
+// Write as much as the write fd takes right now, or, if it is blocking,
+// all of it.
+ssize_t ChannelCopier::WriteSome(const char *data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    const ssize_t w = write(write_fd_, data + done, len - done);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+      return -1;
+    }
+    if (w < (ssize_t)(len - done)) {
+      ThreadTelemetry *telemetry = GetThreadTelemetry();
+      if (telemetry) telemetry->short_writes.Add(1);
+    }
+    done += w;
+    if (nonblocking_) break;
+  }
+  return done;
+}
+
+// Returns how much of data is done with: written, or not to be forwarded
+// anymore. The rest is for the backlog.
+size_t ChannelCopier::WriteNow(const char *data, size_t len) {
+  if (forward_error_) {
+    not_forwarded_ += len;
+    return len;
+  }
+  if (!backlog_.empty()) return 0;
+  const ssize_t w = WriteSome(data, len);
+  if (w < 0) {
+    ForwardFailed(errno, len);
+    return len;
+  }
+  return w;
+}
+
+void ChannelCopier::Forward(const char *data, size_t len) {
+  const size_t done = WriteNow(data, len);
+  if (done == len) return;
+  const size_t before = backlog_.size();
+  backlog_.Append(data + done, len - done);
+  CountPause(before);
+}
+
+// Like Forward(), but a buffer from the pool with what is left goes into
+// the backlog as it is. Returns true if it did.
+bool ChannelCopier::ForwardBuffer(char *buffer, size_t capacity, size_t len) {
+  const size_t done = WriteNow(buffer, len);
+  if (done == len) return false;
+  const size_t before = backlog_.size();
+  backlog_.Adopt(buffer, capacity, done, len);
+  CountPause(before);
+  return true;
+}
+
+void ChannelCopier::CountPause(size_t backlog_before) {
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  if (telemetry && backlog_before <= kBacklogWatermark &&
+      backlog_.size() > kBacklogWatermark) {
+    telemetry->backlog_pauses.Add(1);
+  }
+}
+
+void ChannelCopier::ForwardFailed(int error, size_t lost) {
+  if (!forward_error_) forward_error_ = error;
+  not_forwarded_ += lost + backlog_.size();
+  backlog_.Clear();
+}
+
+// Input is done: the write fd is closed once everything is written, to
+// pass on the EOF, e.g. so that child sees end of stdin.
+void ChannelCopier::EndOutput() {
+  if (output_closed_) return;
+  if (eof_char_ >= 0 && !forward_error_) {
+    // A terminal passes on a partial line at the first EOF character; it
+    // only means end of input at the start of a line.
+    const char eof[2] = { (char)eof_char_, (char)eof_char_ };
+    eof_char_ = -1;
+    Forward(eof, partial_line_ ? 2 : 1);
+  }
+  if (!backlog_.empty()) return;
+  close(write_fd_);
+  output_closed_ = true;
+}
+
+void ChannelCopier::ReleaseInput() {
+  if (!forward_error_ || valid() || input_released_) return;
+  close(read_fd_);
+  input_released_ = true;
+}
+
+// After a failed forward, close the channel as if the read returned EOF.
+void ChannelCopier::EndInput(LogWriter *log) {
+  if (!valid()) return;
+  AppendToLog(log, PrepareHeader(GetTimeNanoseconds(), 0), "");
+}
+
+void ChannelCopier::AppendToLog(LogWriter *log, const RecordHeader *header,
+                                const char *buf) {
+  if (!header) return;
+  const char *skipped_payload;
+  const RecordHeader *skipped = skipped_record(&skipped_payload);
+  if (skipped) log->Append(*skipped, skipped_payload);
+  log->Append(*header, buf);
+}
+
+const RecordHeader *ChannelCopier::PrepareHeader(timestamp_t timestamp,
+                                                ssize_t r, const char *data) {
+  skipped_header_.block_size = 0;
+  if (r > 0 && data) partial_line_ = data[r - 1] != '\n';
+  if (r > 0) {
+    AdaptReadSize(r);
+    ThreadTelemetry *telemetry = GetThreadTelemetry();
+    if (telemetry) {
+      telemetry->reads[header_.channel].Add(1);
+      telemetry->bytes_read[header_.channel].Add(r);
+      telemetry->read_size.Record(r);
+    }
+  }
+  size_t logged = r > 0 ? r : 0;
+  if (r > 0 && sampler_) {
+    logged = sampler_->Sample(timestamp, r);
+    if (!logged) {
+      skipped_bytes_ += r;
+      skipped_reads_++;
+      skipped_timestamp_ = timestamp;
+      return nullptr;
+    }
+  }
+  // What was left out since the previous record goes right before this one.
+  if (skipped_reads_) {
+    skipped_header_.timestamp_ns = skipped_timestamp_;
+    skipped_header_.block_size = EncodeSkipped(skipped_bytes_, skipped_reads_,
+                                               skipped_payload_);
+    skipped_bytes_ = skipped_reads_ = 0;
+  }
+  if (r > 0 && logged < (size_t)r) {
+    // The rest follows this record, so goes before the next one.
+    skipped_bytes_ += r - logged;
+    skipped_reads_++;
+    skipped_timestamp_ = timestamp;
+  }
+  if (r <= 0 && !header_.channel_closed) {
+    EndOutput();
+  }
+  header_.channel_closed = (r <= 0);
+  header_.timestamp_ns = timestamp;
+  header_.block_size = logged;
+  return &header_;
+}
+
+void ChannelCopier::AllowGrowingPipe() {
+  pipe_size_ = fcntl(read_fd_, F_GETPIPE_SZ);
+}
+
+// Interactive traffic, reads returning a few bytes at a time, is read with
+// small buffers; bulk traffic with large ones.
+void ChannelCopier::AdaptReadSize(size_t r) {
+  if (pipe_size_ > 0 && r >= (size_t)pipe_size_ &&
+      (size_t)pipe_size_ < kMaxReadSize) {
+    // Read all of a full pipe: the writer is ahead of us, and could give us
+    // more for each read. If the pipe can't grow, don't try again.
+    const int grown = fcntl(read_fd_, F_SETPIPE_SZ, (int)kMaxReadSize);
+    pipe_size_ = (grown > pipe_size_) ? grown : -1;
+  }
+  if (r >= read_size_) {
+    small_reads_ = 0;
+    if (read_size_ < kMaxReadSize) read_size_ *= 2;
+  } else if (r <= read_size_ / 4 && read_size_ > kMinReadSize) {
+    // Only after a while, so that a pause in a bulk transfer does not
+    // bring it down.
+    if (++small_reads_ >= 8) {
+      read_size_ /= 2;
+      small_reads_ = 0;
+    }
+  } else {
+    small_reads_ = 0;
+  }
+}
+
+void ChannelCopier::CopyUsingBuffer(LogWriter *log) {
+  const size_t size = read_size(log);
+  const size_t capacity = BufferPool::Capacity(size);
+  char *const buf = pool_.Get(size);
+  int r = read(read_fd_, buf, size);
+  // Not readable after all; can happen if the fd is also written to
+  // without blocking, as the master of a pseudo-terminal.
+  if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+    pool_.Put(buf, capacity);
+    return;
+  }
+  const timestamp_t timestamp = GetTimeNanoseconds();
+  // While in the backlog, the buffer stays as it is for logging.
+  const bool in_backlog = r > 0 && ForwardBuffer(buf, capacity, r);
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  const timestamp_t forwarded = telemetry ? GetTimeNanoseconds() : 0;
+  const RecordHeader *header = PrepareHeader(timestamp, r, buf);
+  if (telemetry && r > 0) telemetry->forward_ns.Record(forwarded - timestamp);
+  AppendToLog(log, header, buf);
+  if (telemetry && header) {
+    telemetry->log_append_ns.Record(GetTimeNanoseconds() - forwarded);
+  }
+  if (!in_backlog) pool_.Put(buf, capacity);
+  if (forward_error_) EndInput(log);
+}
+
+// Duplicate the input pipe content into the output pipe with tee(), then
+// move the same bytes to the log with splice(); the data never has to
+// go through userspace. Returns false if nothing was consumed and the
+// caller should use CopyUsingBuffer() instead.
+bool ChannelCopier::CopyUsingSplice(int tee_fd, const LogEncoder *encoder,
+                                    size_t size) {
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  const timestamp_t start = telemetry ? GetTimeNanoseconds() : 0;
+  ssize_t len;
+  do {
+    len = tee(read_fd_, write_fd_, size, nonblocking_ ? SPLICE_F_NONBLOCK : 0);
+  } while (len < 0 && errno == EINTR);
+  const timestamp_t timestamp = GetTimeNanoseconds();
+  if (len < 0) {
+    // EINVAL: not supported here, so don't even try next time. Other
+    // errors, such as EPIPE, or EAGAIN if the output is full, are dealt
+    // with in the buffer path.
+    if (errno == EINVAL) zero_copy_ = false;
+    return false;
+  }
+  if (telemetry && len > 0) telemetry->forward_ns.Record(timestamp - start);
+  PrepareHeader(timestamp, len);
+  char encoded[kMaxRecordHeaderSize];
+  reliable_write(tee_fd, encoded, encoder->EncodeHeader(header_, encoded));
+
+  // The forwarded bytes are still in the input pipe; consume them into
+  // the log.
+  while (len > 0) {
+    const ssize_t s = splice(read_fd_, nullptr, tee_fd, nullptr, len,
+                             SPLICE_F_MOVE);
+    if (s > 0) {
+      len -= s;
+      continue;
+    }
+    if (s < 0 && errno == EINTR) continue;
+
+    // Log file does not support splice. Finish this block the
+    // old-fashioned way and don't use zero-copy anymore.
+    zero_copy_ = false;
+    char *const buf = pool_.Get(size);
+    while (len > 0) {
+      const ssize_t r = read(read_fd_, buf, std::min((size_t)len, size));
+      if (r <= 0) break;
+      reliable_write(tee_fd, buf, r);
+      len -= r;
+    }
+    pool_.Put(buf, BufferPool::Capacity(size));
+  }
+  return true;
+}
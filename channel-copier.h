@@ -0,0 +1,158 @@
+#ifndef CHANNEL_COPIER_H
+#define CHANNEL_COPIER_H
+
+#include <sys/select.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+#include "block-header.h"
+#include "buffer-pool.h"
+#include "capture-sampler.h"
+#include "clock.h"
+#include "log-format.h"
+#include "log-writer.h"
+
+// Forwards data from the read fd to the write fd, and logs it as channel.
+//
+// With a non-blocking write fd, what it does not take right away waits in
+// a backlog of the channel, so that a slow reader on one channel does not
+// hold up the others. Only this channel stops being read while its
+// backlog is above kBacklogWatermark.
+//
+// Reads go into buffers from a pool of the channel, which return to it
+// once forwarded and logged; a buffer not forwarded right away becomes
+// part of the backlog as it is. Read sizes follow the traffic: small
+// while reads return little, doubling up to kMaxReadSize while they fill
+// the buffer.
+class ChannelCopier {
+public:
+  static constexpr size_t kBacklogWatermark = 1 << 20;
+  static constexpr size_t kMinReadSize = BufferPool::kMinSize;
+  static constexpr size_t kMaxReadSize = 256 << 10;
+
+  ChannelCopier(int channel, int read_fd, int write_fd, bool zero_copy);
+
+  int channel() const { return header_.channel; }
+  int readfd() const { return read_fd_; }
+  int writefd() const { return write_fd_; }
+  bool valid() const { return !header_.channel_closed; }  // Input is open.
+  bool wants_read() const {
+    return valid() && backlog_.size() <= kBacklogWatermark;
+  }
+  bool wants_write() const { return !backlog_.empty(); }
+  bool done() const { return !valid() && backlog_.empty(); }
+  void AddToFdsets(fd_set *read_fds, fd_set *write_fds) const {
+    if (wants_read()) FD_SET(read_fd_, read_fds);
+    if (wants_write()) FD_SET(write_fd_, write_fds);
+  }
+
+  // Make writes to the write fd return rather than wait. O_NONBLOCK is
+  // a property of the open file, so if the fd is shared with other
+  // processes, e.g. our stdout, it is opened anew rather than changing
+  // it for all of them. Returns false if it has to stay blocking: regular
+  // files (which never block for long), sockets.
+  bool SetNonBlocking(bool shared);
+
+  // With bulk traffic, make the read fd, a pipe of our own, larger with
+  // F_SETPIPE_SZ, so that each read can fetch more.
+  void AllowGrowingPipe();
+
+  // Forward whatever is available on the read fd and log it, timestamped
+  // right after reading. Reads into a buffer unless zero-copy is
+  // possible.
+  void Copy(LogWriter *log);
+
+  // Write what we can of the backlog, once the write fd is writable.
+  void Flush(LogWriter *log);
+
+  // At the end of input, write this character before closing the write
+  // fd, e.g. the EOF character of a terminal, which doesn't see a close.
+  void SetEofCharacter(char c) { eof_char_ = c; }
+
+  // Only log a sample of what is read; everything is still forwarded, but
+  // no zero-copy. What is left out is logged as skipped records.
+  void SetSampling(const SamplingOptions &options);
+
+  // For event loops doing the I/O themselves: buffers to read into,
+  // and how much to read next, which is at most what the log can take in
+  // one record.
+  BufferPool *pool() { return &pool_; }
+  size_t read_size(const LogWriter *log) const {
+    return std::min(read_size_, log->max_block_size());
+  }
+
+  // Prepare the log header for a block with the return value of read();
+  // <= 0 closes the channel. The data read, if given, tells where a line
+  // ends for SetEofCharacter().
+  // With sampling, only the first block_size bytes are to be logged, or
+  // nothing if it returns nullptr.
+  const RecordHeader *PrepareHeader(timestamp_t timestamp, ssize_t r,
+                                    const char *data = nullptr);
+
+  // The skipped record to log right before the header PrepareHeader()
+  // returned, or nullptr if nothing was left out since the last one.
+  const RecordHeader *skipped_record(const char **payload) const {
+    *payload = skipped_payload_;
+    return skipped_header_.block_size ? &skipped_header_ : nullptr;
+  }
+
+  // Writing to the write fd failed with error, e.g. EPIPE, losing lost
+  // bytes. Nothing more is forwarded; the channel is to be closed like
+  // at EOF.
+  void ForwardFailed(int error, size_t lost);
+
+  // Once the channel is closed for a failed forward and the event loop
+  // doesn't watch the read fd anymore: close it, so that whoever writes
+  // to it sees the same error, e.g. a broken pipe.
+  void ReleaseInput();
+  int forward_error() const { return forward_error_; }  // 0 if none.
+  uint64_t not_forwarded() const { return not_forwarded_; }
+
+private:
+  void CopyUsingBuffer(LogWriter *log);
+  bool CopyUsingSplice(int tee_fd, const LogEncoder *encoder, size_t size);
+  void AdaptReadSize(size_t r);
+  void Forward(const char *data, size_t len);
+  bool ForwardBuffer(char *buffer, size_t capacity, size_t len);
+  size_t WriteNow(const char *data, size_t len);
+  ssize_t WriteSome(const char *data, size_t len);  // -1 on error.
+  void CountPause(size_t backlog_before);
+  void EndOutput();
+  void EndInput(LogWriter *log);
+  void AppendToLog(LogWriter *log, const RecordHeader *header,
+                   const char *buf);
+
+  const int read_fd_;
+  const int write_fd_;
+  bool zero_copy_;
+  bool nonblocking_ = false;
+  int eof_char_ = -1;
+  bool partial_line_ = false;  // Last byte forwarded was not a newline.
+  RecordHeader header_;
+
+  BufferPool pool_;
+  size_t read_size_ = kMinReadSize;
+  int small_reads_ = 0;  // In a row, using little of the read size.
+  int pipe_size_ = -1;   // Of the read fd, if it may grow.
+
+  OutputBacklog backlog_;
+  bool output_closed_ = false;
+  bool input_released_ = false;
+  int forward_error_ = 0;
+  uint64_t not_forwarded_ = 0;
+
+  std::unique_ptr<CaptureSampler> sampler_;
+  uint64_t skipped_bytes_ = 0;   // Since the last logged record.
+  uint64_t skipped_reads_ = 0;
+  timestamp_t skipped_timestamp_ = 0;  // Of the last read left out.
+  RecordHeader skipped_header_;
+  char skipped_payload_[kMaxSkippedRecordSize];
+};
+
+// Write all of the buffer, unless there is an error.
+void reliable_write(int fd, const char *buffer, ssize_t size);
+
+#endif // CHANNEL_COPIER_H
@@ -0,0 +1,118 @@
+#include "clock.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <cpuid.h>
+#  include <x86intrin.h>
+#  define HAVE_TSC 1
+#endif
+
+static ClockSource clock_source = ClockSource::kMonotonic;
+
+static int64_t ReadClock(clockid_t id) {
+  struct timespec t;
+  clock_gettime(id, &t);
+  return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#ifdef HAVE_TSC
+// TSC ticks are converted to CLOCK_MONOTONIC nanoseconds as
+//   base_ns + ((tsc - base_tsc) * tsc_mult) >> kTscShift
+static constexpr int kTscShift = 32;
+static uint64_t tsc_base;
+static int64_t tsc_base_ns;
+static uint64_t tsc_mult;
+
+// Only a TSC that ticks with constant rate in all power states and is
+// synchronized between cores can be used as a clock.
+static bool HasInvariantTsc() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return edx & (1 << 8);
+}
+
+// Measure the TSC frequency against CLOCK_MONOTONIC for a few milliseconds.
+static bool CalibrateTsc() {
+  if (!HasInvariantTsc()) return false;
+  const int64_t start_ns = ReadClock(CLOCK_MONOTONIC);
+  const uint64_t start_tsc = __rdtsc();
+  usleep(20000);
+  const int64_t end_ns = ReadClock(CLOCK_MONOTONIC);
+  const uint64_t end_tsc = __rdtsc();
+  if (end_tsc <= start_tsc || end_ns <= start_ns) return false;
+  tsc_mult = (uint64_t)((((unsigned __int128)(end_ns - start_ns))
+                         << kTscShift) / (end_tsc - start_tsc));
+  tsc_base = end_tsc;
+  tsc_base_ns = end_ns;
+  return true;
+}
+
+static int64_t ReadTsc() {
+  const uint64_t ticks = __rdtsc() - tsc_base;
+  return tsc_base_ns +
+    (int64_t)(((unsigned __int128)ticks * tsc_mult) >> kTscShift);
+}
+#endif
+
+bool ParseClockSourceName(const char *name, ClockSource *source) {
+  if (strcmp(name, "monotonic") == 0) {
+    *source = ClockSource::kMonotonic;
+  } else if (strcmp(name, "coarse") == 0) {
+    *source = ClockSource::kMonotonicCoarse;
+  } else if (strcmp(name, "tsc") == 0) {
+    *source = ClockSource::kTsc;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool SetClockSource(ClockSource source) {
+  switch (source) {
+  case ClockSource::kMonotonic:
+  case ClockSource::kMonotonicCoarse:
+    break;
+  case ClockSource::kTsc:
+#ifdef HAVE_TSC
+    if (!CalibrateTsc()) return false;
+    break;
+#else
+    return false;
+#endif
+  default:
+    return false;
+  }
+  clock_source = source;
+  return true;
+}
+
+ClockSource GetClockSource() { return clock_source; }
+
+timestamp_t GetTimeNanoseconds() {
+  switch (clock_source) {
+  case ClockSource::kMonotonicCoarse:
+    return ReadClock(CLOCK_MONOTONIC_COARSE);
+#ifdef HAVE_TSC
+  case ClockSource::kTsc:
+    return ReadTsc();
+#endif
+  default:
+    return ReadClock(CLOCK_MONOTONIC);
+  }
+}
+
+void GetClockAnchor(int64_t *wallclock_ns, timestamp_t *clock_ns) {
+  // Take the wall clock in the middle of two readings of our clock to
+  // halve the error.
+  const timestamp_t before = GetTimeNanoseconds();
+  *wallclock_ns = ReadClock(CLOCK_REALTIME);
+  const timestamp_t after = GetTimeNanoseconds();
+  *clock_ns = before + (after - before) / 2;
+}
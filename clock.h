@@ -0,0 +1,33 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <cstdint>
+
+using timestamp_t = int64_t;
+
+// Where timestamps come from. Stored in the log file header.
+enum class ClockSource : uint16_t {
+  kMonotonic = 0,        // CLOCK_MONOTONIC
+  kMonotonicCoarse = 1,  // CLOCK_MONOTONIC_COARSE: cheaper, ~1-4ms steps.
+  kTsc = 2,              // Invariant TSC, calibrated against CLOCK_MONOTONIC.
+};
+
+// Parse "monotonic", "coarse" or "tsc". Returns false if unknown.
+bool ParseClockSourceName(const char *name, ClockSource *source);
+
+// Choose the clock GetTimeNanoseconds() reads; must be called before any
+// timestamp is taken. Returns false if the source is not available on this
+// machine, e.g. no invariant TSC.
+bool SetClockSource(ClockSource source);
+ClockSource GetClockSource();
+
+// Current time in nanoseconds of the chosen clock. Monotonic, so it does
+// not jump if the wall clock is adjusted while we are running, but not
+// related to the epoch; see GetClockAnchor() for that.
+timestamp_t GetTimeNanoseconds();
+
+// Wall clock in nanoseconds since the epoch and what GetTimeNanoseconds()
+// returns at the same moment.
+void GetClockAnchor(int64_t *wallclock_ns, timestamp_t *clock_ns);
+
+#endif // CLOCK_H
@@ -0,0 +1,187 @@
+#include "event-loop.h"
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "telemetry.h"
+
+int LogFlushTimeoutMs(const LogWriter *log) {
+  const timestamp_t deadline = log->flush_deadline();
+  if (deadline < 0) return -1;
+  const timestamp_t remaining = deadline - GetTimeNanoseconds();
+  if (remaining <= 0) return 0;
+  return (remaining + 999999) / 1000000;
+}
+
+namespace {
+// The original loop. Portable, but rebuilds the fd_sets for every wakeup.
+class SelectEventLoop : public EventLoop {
+public:
+  void Run(const std::vector<ChannelCopier *> &channels,
+           LogWriter *log) override {
+    ThreadTelemetry *const telemetry = GetThreadTelemetry();
+
+    fd_set rd_fds, wr_fds;
+
+    int max_fd = 0;
+    for (const ChannelCopier *channel : channels) {
+      max_fd = std::max({ max_fd, channel->readfd(), channel->writefd() });
+    }
+
+    for (;;) {
+      FD_ZERO(&rd_fds);
+      FD_ZERO(&wr_fds);
+      bool any_active = false;
+      for (const ChannelCopier *channel : channels) {
+        channel->AddToFdsets(&rd_fds, &wr_fds);
+        any_active |= !channel->done();
+      }
+      if (!any_active) return;
+
+      const int timeout_ms = LogFlushTimeoutMs(log);
+      struct timeval timeout;
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_usec = (timeout_ms % 1000) * 1000;
+      int sret = select(max_fd+1, &rd_fds, &wr_fds, NULL,
+                        timeout_ms < 0 ? NULL : &timeout);
+      if (sret < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      if (telemetry) telemetry->wakeups.Add(1);
+
+      log->FlushIfDue(GetTimeNanoseconds());
+      for (ChannelCopier *channel : channels) {
+        if (channel->wants_write() && FD_ISSET(channel->writefd(), &wr_fds)) {
+          channel->Flush(log);
+        }
+        if (channel->wants_read() && FD_ISSET(channel->readfd(), &rd_fds)) {
+          channel->Copy(log);
+        }
+        channel->ReleaseInput();
+      }
+    }
+  }
+};
+
+// Registers the file descriptors once; a wakeup is a single epoll_wait().
+// Only when a channel starts or stops waiting for its read or write fd,
+// the registration changes.
+class EpollEventLoop : public EventLoop {
+public:
+  EpollEventLoop() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~EpollEventLoop() override { close(epoll_fd_); }
+
+  void Run(const std::vector<ChannelCopier *> &channels,
+           LogWriter *log) override {
+    ThreadTelemetry *const telemetry = GetThreadTelemetry();
+
+    std::vector<Watched> watched(channels.size());
+    for (size_t i = 0; i < channels.size(); ++i) {
+      Update(i, channels[i], &watched[i]);
+    }
+
+    struct epoll_event events[16];
+    for (;;) {
+      bool any_active = false, any_always_ready = false;
+      for (size_t i = 0; i < channels.size(); ++i) {
+        any_active |= !channels[i]->done();
+        any_always_ready |= watched[i].always_ready &&
+          channels[i]->wants_read();
+      }
+      if (!any_active) return;
+
+      const int n = epoll_wait(epoll_fd_, events, 16,
+                               any_always_ready ? 0 : LogFlushTimeoutMs(log));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      if (telemetry) telemetry->wakeups.Add(1);
+
+      log->FlushIfDue(GetTimeNanoseconds());
+      for (int i = 0; i < n; ++i) {
+        const size_t idx = events[i].data.u64 >> 1;
+        ChannelCopier *channel = channels[idx];
+        if (events[i].data.u64 & 1) {
+          if (channel->wants_write()) channel->Flush(log);
+        } else if (channel->wants_read()) {
+          channel->Copy(log);
+        }
+      }
+      for (size_t i = 0; i < channels.size(); ++i) {
+        if (watched[i].always_ready && channels[i]->wants_read()) {
+          channels[i]->Copy(log);
+        }
+        Update(i, channels[i], &watched[i]);
+      }
+    }
+  }
+
+private:
+  // What is registered for a channel.
+  struct Watched {
+    bool reading = false;
+    bool writing = false;
+    bool always_ready = false;  // Regular files can't be watched, but are.
+  };
+
+  // Register the read fd of channel idx as 2*idx, the write fd as 2*idx+1
+  // according to what it waits for right now.
+  void Update(size_t idx, ChannelCopier *channel, Watched *w) {
+    const bool read = channel->wants_read() && !w->always_ready;
+    if (read != w->reading) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u64 = 2 * idx;
+      if (epoll_ctl(epoll_fd_, read ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                    channel->readfd(), &ev) < 0 && read) {
+        if (errno != EPERM) perror("epoll_ctl");
+        w->always_ready = true;  // Then just read it whenever we can.
+      } else {
+        w->reading = read;
+      }
+    }
+    if (!w->reading) channel->ReleaseInput();
+    const bool write = channel->wants_write();
+    if (write != w->writing) {
+      struct epoll_event ev;
+      ev.events = EPOLLOUT;
+      ev.data.u64 = 2 * idx + 1;
+      if (epoll_ctl(epoll_fd_, write ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                    channel->writefd(), &ev) < 0 && write) {
+        perror("epoll_ctl");
+      }
+      w->writing = write;
+    }
+  }
+
+  const int epoll_fd_;
+};
+}  // namespace
+
+std::unique_ptr<EventLoop> CreateSelectEventLoop() {
+  return std::unique_ptr<EventLoop>(new SelectEventLoop());
+}
+
+std::unique_ptr<EventLoop> CreateEpollEventLoop() {
+  return std::unique_ptr<EventLoop>(new EpollEventLoop());
+}
+
+std::unique_ptr<EventLoop> CreateEventLoop(const char *name) {
+  if (strcmp(name, "select") == 0) return CreateSelectEventLoop();
+  if (strcmp(name, "epoll") == 0) return CreateEpollEventLoop();
+  if (strcmp(name, "uring") == 0) {
+    std::unique_ptr<EventLoop> result = CreateUringEventLoop();
+    if (result) return result;
+    fprintf(stderr, "bidi-tee: io_uring not available, using epoll\n");
+    return CreateEpollEventLoop();
+  }
+  return nullptr;
+}
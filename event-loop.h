@@ -0,0 +1,34 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <memory>
+#include <vector>
+
+#include "channel-copier.h"
+#include "log-writer.h"
+
+// Waits for data on the channels, forwards and logs it.
+class EventLoop {
+public:
+  virtual ~EventLoop() {}
+
+  // Run until all channels are closed.
+  virtual void Run(const std::vector<ChannelCopier *> &channels,
+                   LogWriter *log) = 0;
+};
+
+// Milliseconds an event loop can wait before the log needs to be flushed;
+// -1 for no limit.
+int LogFlushTimeoutMs(const LogWriter *log);
+
+// Create event loop by name, one of "select", "epoll" or "uring".
+// Returns nullptr if the name is not known. If io_uring is not supported
+// by the kernel, falls back to epoll.
+std::unique_ptr<EventLoop> CreateEventLoop(const char *name);
+
+// Individual backends.
+std::unique_ptr<EventLoop> CreateSelectEventLoop();
+std::unique_ptr<EventLoop> CreateEpollEventLoop();
+std::unique_ptr<EventLoop> CreateUringEventLoop();  // nullptr if unsupported
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,52 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cstring>
+
+Histogram::Histogram() {
+  memset(counts_, 0, sizeof(counts_));
+}
+
+// Values below kSubBuckets are their own index. Above, the shift e is chosen
+// so that value >> e has kSubBucketBits + 1 bits, of which the top one is
+// implied by e.
+int Histogram::BucketIndex(uint64_t value) {
+  const int msb = 63 - __builtin_clzll(value | 1);
+  const int e = std::max(0, msb - kSubBucketBits);
+  return e * kSubBuckets + (int)(value >> e);
+}
+
+uint64_t Histogram::BucketLowest(int index) {
+  const int e = std::max(0, index / kSubBuckets - 1);
+  return (uint64_t)(index - e * kSubBuckets) << e;
+}
+
+uint64_t Histogram::BucketWidth(int index) {
+  return 1ULL << std::max(0, index / kSubBuckets - 1);
+}
+
+void Histogram::Record(int64_t value) {
+  if (value < 0) value = 0;
+  counts_[BucketIndex(value)]++;
+  if (count_ == 0 || value < min_) min_ = value;
+  if (value > max_) max_ = value;
+  sum_ += value;
+  count_++;
+}
+
+int64_t Histogram::Percentile(double fraction) const {
+  if (count_ == 0) return 0;
+  if (fraction <= 0) return min_;
+  if (fraction >= 1) return max_;
+  const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(fraction * count_
+                                                         + 0.5));
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      const int64_t middle = BucketLowest(i) + BucketWidth(i) / 2;
+      return std::min(std::max(middle, min_), max_);
+    }
+  }
+  return max_;
+}
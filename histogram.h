@@ -0,0 +1,43 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Histogram of non-negative values in constant memory, in the style of
+// HdrHistogram: each power of two is split into 128 linear buckets, so every
+// value is represented with a relative error of less than 1%, from
+// nanoseconds to centuries.
+class Histogram {
+public:
+  Histogram();
+
+  void Record(int64_t value);
+
+  uint64_t count() const { return count_; }
+  int64_t min() const { return count_ ? min_ : 0; }
+  int64_t max() const { return max_; }
+  double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+  // Value below which the given fraction (0..1) of recorded values are.
+  // Exact for min and max, otherwise the middle of the bucket.
+  int64_t Percentile(double fraction) const;
+
+private:
+  static constexpr int kSubBucketBits = 7;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kBuckets = (64 - kSubBucketBits) * kSubBuckets
+    + kSubBuckets;
+
+  static int BucketIndex(uint64_t value);
+  static uint64_t BucketLowest(int index);
+  static uint64_t BucketWidth(int index);
+
+  uint64_t counts_[kBuckets];
+  uint64_t count_ = 0;
+  int64_t min_ = 0;
+  int64_t max_ = 0;
+  double sum_ = 0;
+};
+
+#endif // HISTOGRAM_H
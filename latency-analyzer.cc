@@ -0,0 +1,305 @@
+#include "latency-analyzer.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+// Don't let a client that never gets answers make us grow without bounds.
+static constexpr size_t kMaxPendingRequests = 100000;
+static constexpr size_t kMaxIdLength = 64;
+static constexpr size_t kMaxKeyLength = 16;
+
+bool ParsePairingName(const char *name, Pairing *pairing) {
+  if (strcmp(name, "next") == 0) {
+    *pairing = Pairing::kNext;
+  } else if (strcmp(name, "jsonrpc") == 0) {
+    *pairing = Pairing::kJsonRpcId;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Incrementally follows the JSON objects in a channel, regardless of how
+// they are cut into records, and reports the top-level "id" and whether
+// there is a "method" of each. Does not allocate once the buffers for
+// key and id have grown.
+class JsonRpcScanner {
+public:
+  // Called at the end of a message with an id; start and end are the
+  // timestamps of the records the message started and ended in.
+  using Callback = std::function<void(bool is_request, const std::string &id,
+                                      int64_t start, int64_t end)>;
+
+  explicit JsonRpcScanner(Callback callback) : callback_(callback) {}
+
+  void Feed(const char *data, size_t len, int64_t timestamp);
+
+private:
+  enum class IdValue { kNone, kExpected, kString, kBare };
+
+  const Callback callback_;
+  int depth_ = 0;
+  bool in_string_ = false;
+  bool escape_ = false;
+  bool key_pending_ = false;  // String at depth 1 ended; ':' makes it a key.
+  std::string key_;
+  IdValue id_value_ = IdValue::kNone;
+  std::string id_;
+  bool has_id_ = false;
+  bool has_method_ = false;
+  int64_t start_ = 0;
+};
+
+void JsonRpcScanner::Feed(const char *data, size_t len, int64_t timestamp) {
+  for (const char *end = data + len; data < end; ++data) {
+    const char c = *data;
+    if (in_string_) {
+      if (escape_) {
+        escape_ = false;
+      } else if (c == '\\') {
+        escape_ = true;
+      } else if (c == '"') {
+        in_string_ = false;
+        if (id_value_ == IdValue::kString) {
+          id_.push_back('"');
+          id_value_ = IdValue::kNone;
+          has_id_ = true;
+        } else if (depth_ == 1) {
+          key_pending_ = true;
+        }
+        continue;
+      }
+      if (id_value_ == IdValue::kString) {
+        if (id_.size() < kMaxIdLength) id_.push_back(c);
+      } else if (depth_ == 1 && key_.size() < kMaxKeyLength) {
+        key_.push_back(c);
+      }
+      continue;
+    }
+
+    if (id_value_ == IdValue::kBare) {
+      if (c != ',' && c != '}' && c != ']' && !isspace((unsigned char)c)) {
+        if (id_.size() < kMaxIdLength) id_.push_back(c);
+        continue;
+      }
+      id_value_ = IdValue::kNone;
+      has_id_ = true;
+    }
+
+    switch (c) {
+    case '"':
+      in_string_ = true;
+      if (id_value_ == IdValue::kExpected) {
+        id_value_ = IdValue::kString;
+        id_.assign(1, '"');  // Keep the quotes: "1" is not the same id as 1.
+      } else if (depth_ == 1) {
+        key_.clear();
+      }
+      key_pending_ = false;
+      break;
+    case ':':
+      if (key_pending_) {
+        if (key_ == "id") {
+          id_value_ = IdValue::kExpected;
+        } else if (key_ == "method") {
+          has_method_ = true;
+        }
+      }
+      key_pending_ = false;
+      break;
+    case '{': case '[':
+      if (depth_ == 0) {
+        start_ = timestamp;
+        has_id_ = has_method_ = false;
+        id_.clear();
+      }
+      if (id_value_ == IdValue::kExpected) id_value_ = IdValue::kNone;
+      ++depth_;
+      key_pending_ = false;
+      break;
+    case '}': case ']':
+      if (depth_ > 0 && --depth_ == 0 && has_id_) {
+        callback_(has_method_, id_, start_, timestamp);
+      }
+      key_pending_ = false;
+      break;
+    case ' ': case '\t': case '\r': case '\n':
+      break;
+    default:
+      if (id_value_ == IdValue::kExpected) {
+        id_value_ = IdValue::kBare;
+        id_.assign(1, c);
+      }
+      key_pending_ = false;
+      break;
+    }
+  }
+}
+
+LatencyAnalyzer::LatencyAnalyzer(const AnalyzerOptions &options,
+                                 const std::map<int, std::string> &names,
+                                 int64_t start_timestamp, OutputBuffer *out)
+  : options_(options), channel_names_(names),
+    start_timestamp_(start_timestamp), out_(out),
+    interval_start_(start_timestamp) {
+  if (channel_names_.empty()) {
+    channel_names_ = { {0, "stdin"}, {1, "stdout"}, {2, "stderr"} };
+  }
+  if (options_.pairing == Pairing::kJsonRpcId) {
+    request_scanner_.reset(new JsonRpcScanner(
+      [this](bool is_request, const std::string &id, int64_t, int64_t end) {
+        if (is_request) AddRequest(id, end);
+      }));
+    response_scanner_.reset(new JsonRpcScanner(
+      [this](bool is_request, const std::string &id, int64_t start, int64_t) {
+        if (!is_request) AddResponse(id, start);
+      }));
+  }
+}
+
+LatencyAnalyzer::~LatencyAnalyzer() {}
+
+const std::string &LatencyAnalyzer::ChannelName(int channel) {
+  std::string &name = channel_names_[channel];
+  if (name.empty()) name = "channel " + std::to_string(channel);
+  return name;
+}
+
+void LatencyAnalyzer::AddRequest(const std::string &id, int64_t timestamp) {
+  if (pending_.size() >= kMaxPendingRequests && !pending_.count(id)) {
+    ++untracked_requests_;
+    return;
+  }
+  pending_[id] = timestamp;
+}
+
+void LatencyAnalyzer::AddResponse(const std::string &id, int64_t timestamp) {
+  auto found = pending_.find(id);
+  if (found == pending_.end()) {
+    ++unmatched_responses_;
+    return;
+  }
+  latency_.Record(timestamp - found->second);
+  pending_.erase(found);
+}
+
+void LatencyAnalyzer::Process(const RecordHeader &header,
+                              const char *payload) {
+  const int64_t ts = header.timestamp_ns;
+  if (first_timestamp_ < 0) first_timestamp_ = ts;
+  last_timestamp_ = ts;
+  if (options_.interval_ns > 0) PrintIntervals(ts);
+
+  ChannelStats &stats = stats_[header.channel & 0x0f];
+  if (header.block_size == 0) return;
+  stats.records++;
+  stats.bytes += header.block_size;
+  stats.interval_bytes += header.block_size;
+
+  const bool is_request = (header.channel == options_.request_channel);
+  const bool is_response = (header.channel == options_.response_channel);
+  switch (options_.pairing) {
+  case Pairing::kNext:
+    if (is_request) {
+      last_request_ = ts;
+    } else if (is_response && last_request_ >= 0) {
+      latency_.Record(ts - last_request_);
+      last_request_ = -1;
+    }
+    break;
+  case Pairing::kJsonRpcId:
+    if (is_request) request_scanner_->Feed(payload, header.block_size, ts);
+    if (is_response) response_scanner_->Feed(payload, header.block_size, ts);
+    break;
+  }
+}
+
+void LatencyAnalyzer::PrintIntervals(int64_t up_to) {
+  char line[64];
+  while (up_to >= interval_start_ + options_.interval_ns) {
+    if (!interval_header_printed_) {
+      out_->Append("         time");
+      for (const auto &name : channel_names_) {
+        snprintf(line, sizeof(line), " %14s", name.second.c_str());
+        out_->Append(line);
+      }
+      out_->Append("  (bytes/s)\n");
+      interval_header_printed_ = true;
+    }
+    snprintf(line, sizeof(line), "%12.3fs",
+             (interval_start_ - start_timestamp_) / 1e9);
+    out_->Append(line);
+    for (const auto &name : channel_names_) {
+      ChannelStats &stats = stats_[name.first & 0x0f];
+      snprintf(line, sizeof(line), " %14.0f",
+               stats.interval_bytes * 1e9 / options_.interval_ns);
+      out_->Append(line);
+      stats.interval_bytes = 0;
+    }
+    out_->Append('\n');
+    interval_start_ += options_.interval_ns;
+  }
+}
+
+static void AppendMs(OutputBuffer *out, int64_t ns) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), " %12.3fms", ns / 1e6);
+  out->Append(buf);
+}
+
+void LatencyAnalyzer::Report() {
+  char line[256];
+  if (options_.interval_ns > 0 && last_timestamp_ >= interval_start_) {
+    PrintIntervals(interval_start_ + options_.interval_ns);  // Last partial.
+  }
+  if (interval_header_printed_) out_->Append('\n');
+
+  const uint64_t unanswered = options_.pairing == Pairing::kNext
+    ? (last_request_ >= 0 ? 1 : 0) : pending_.size();
+  snprintf(line, sizeof(line), "Latency %s -> %s (%s): %llu pairs, "
+           "%llu unanswered\n",
+           ChannelName(options_.request_channel).c_str(),
+           ChannelName(options_.response_channel).c_str(),
+           options_.pairing == Pairing::kNext ? "next response" : "by id",
+           (unsigned long long)latency_.count(),
+           (unsigned long long)unanswered);
+  out_->Append(line);
+  if (options_.pairing == Pairing::kJsonRpcId &&
+      (untracked_requests_ || unmatched_responses_)) {
+    snprintf(line, sizeof(line), "  %llu requests not tracked (too many "
+             "pending), %llu responses without request\n",
+             (unsigned long long)untracked_requests_,
+             (unsigned long long)unmatched_responses_);
+    out_->Append(line);
+  }
+  if (latency_.count()) {
+    out_->Append("             min            p50            p90"
+                 "            p99          p99.9            max"
+                 "           mean\n");
+    AppendMs(out_, latency_.min());
+    AppendMs(out_, latency_.Percentile(0.5));
+    AppendMs(out_, latency_.Percentile(0.9));
+    AppendMs(out_, latency_.Percentile(0.99));
+    AppendMs(out_, latency_.Percentile(0.999));
+    AppendMs(out_, latency_.max());
+    AppendMs(out_, (int64_t)latency_.mean());
+    out_->Append('\n');
+  }
+
+  const int64_t duration = last_timestamp_ - first_timestamp_;
+  snprintf(line, sizeof(line), "\nThroughput over %.3fs:\n"
+           "  %-14s %12s %14s %14s\n", duration / 1e9,
+           "channel", "records", "bytes", "bytes/s");
+  out_->Append(line);
+  for (int i = 0; i < 16; ++i) {
+    const ChannelStats &stats = stats_[i];
+    if (!stats.records) continue;
+    snprintf(line, sizeof(line), "  %-14s %12llu %14llu %14.0f\n",
+             ChannelName(i).c_str(), (unsigned long long)stats.records,
+             (unsigned long long)stats.bytes,
+             duration > 0 ? stats.bytes * 1e9 / duration : 0.0);
+    out_->Append(line);
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef LATENCY_ANALYZER_H
+#define LATENCY_ANALYZER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "block-header.h"
+#include "histogram.h"
+#include "output-buffer.h"
+
+// How requests and responses are paired up.
+enum class Pairing {
+  kNext,       // The next response after request writes answers them.
+  kJsonRpcId,  // JSON-RPC messages with the same "id".
+};
+
+// Parse "next" or "jsonrpc". Returns false if unknown.
+bool ParsePairingName(const char *name, Pairing *pairing);
+
+struct AnalyzerOptions {
+  Pairing pairing = Pairing::kNext;
+  int request_channel = 0;
+  int response_channel = 1;
+  int64_t interval_ns = 0;  // If set, print bytes/second per interval.
+};
+
+class JsonRpcScanner;
+
+// Measures request/response latency and throughput in a single pass over
+// the records, in memory independent of the length of the log; only the
+// requests waiting for a response by id are remembered (up to a limit).
+//
+// With Pairing::kNext, the latency is the time from the last request
+// channel record to the first response channel record after it. With
+// Pairing::kJsonRpcId, it is the time from the end of a request message
+// (one with "method" and "id") to the start of the response with that id.
+class LatencyAnalyzer {
+public:
+  LatencyAnalyzer(const AnalyzerOptions &options,
+                  const std::map<int, std::string> &channel_names,
+                  int64_t start_timestamp, OutputBuffer *out);
+  ~LatencyAnalyzer();
+
+  void Process(const RecordHeader &header, const char *payload);
+
+  // Print the summary of everything processed.
+  void Report();
+
+private:
+  struct ChannelStats {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t interval_bytes = 0;
+  };
+
+  const std::string &ChannelName(int channel);
+  void AddRequest(const std::string &id, int64_t timestamp);
+  void AddResponse(const std::string &id, int64_t timestamp);
+  void PrintIntervals(int64_t up_to);
+
+  const AnalyzerOptions options_;
+  std::map<int, std::string> channel_names_;
+  const int64_t start_timestamp_;
+  OutputBuffer *const out_;
+
+  ChannelStats stats_[16];
+  int64_t first_timestamp_ = -1;
+  int64_t last_timestamp_ = -1;
+  Histogram latency_;
+
+  // Pairing::kNext
+  int64_t last_request_ = -1;  // Waiting for a response if >= 0.
+
+  // Pairing::kJsonRpcId
+  std::unique_ptr<JsonRpcScanner> request_scanner_;
+  std::unique_ptr<JsonRpcScanner> response_scanner_;
+  std::unordered_map<std::string, int64_t> pending_;
+  uint64_t untracked_requests_ = 0;
+  uint64_t unmatched_responses_ = 0;
+
+  int64_t interval_start_ = -1;
+  bool interval_header_printed_ = false;
+};
+
+#endif // LATENCY_ANALYZER_H
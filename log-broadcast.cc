@@ -0,0 +1,279 @@
+#include "log-broadcast.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+static constexpr size_t kMinBroadcastRing = 1 << 20;
+// Most bytes sent to one subscriber before looking at the others.
+static constexpr size_t kMaxSendChunk = 256 << 10;
+// At exit, how long to wait for subscribers to take the rest.
+static constexpr int kFinalDrainMs = 1000;
+
+static size_t RoundUpPowerOfTwo(size_t v) {
+  size_t result = 1;
+  while (result < v) result <<= 1;
+  return result;
+}
+
+// Listening socket at path. A socket file left behind by a process that is
+// gone is replaced, one that still accepts connections is not.
+static int ListenAt(const std::string &path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        0);
+  if (fd < 0) return -1;
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 && errno == EADDRINUSE) {
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool in_use = probe >= 0 &&
+      connect(probe, (sockaddr *)&addr, sizeof(addr)) == 0;
+    if (probe >= 0) close(probe);
+    if (in_use) {
+      close(fd);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  if (listen(fd, 16) < 0) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+BroadcastLogWriter *BroadcastLogWriter::Create(
+  std::unique_ptr<LogWriter> delegate, const std::string &path,
+  const LogEncoder &encoder, size_t ring_size) {
+  const int listen_fd = ListenAt(path);
+  if (listen_fd < 0) return nullptr;
+  const int wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeup_fd < 0) {
+    const int err = errno;
+    close(listen_fd);
+    unlink(path.c_str());
+    errno = err;
+    return nullptr;
+  }
+  return new BroadcastLogWriter(std::move(delegate), path, encoder,
+                                ring_size, listen_fd, wakeup_fd);
+}
+
+BroadcastLogWriter::BroadcastLogWriter(std::unique_ptr<LogWriter> delegate,
+                                       const std::string &path,
+                                       const LogEncoder &encoder,
+                                       size_t ring_size, int listen_fd,
+                                       int wakeup_fd)
+  : delegate_(std::move(delegate)), path_(path), encoder_(encoder),
+    file_header_(encoder_.FileHeader()),
+    capacity_(RoundUpPowerOfTwo(std::max(ring_size, kMinBroadcastRing))),
+    ring_(new char[capacity_]), listen_fd_(listen_fd), wakeup_fd_(wakeup_fd) {
+  for (std::atomic<uint64_t> &checkpoint : checkpoints_) checkpoint = 0;
+  thread_ = std::thread(&BroadcastLogWriter::Run, this);
+}
+
+BroadcastLogWriter::~BroadcastLogWriter() {
+  exit_requested_ = true;
+  Wake();
+  thread_.join();
+  close(listen_fd_);
+  close(wakeup_fd_);
+  unlink(path_.c_str());
+  delete [] ring_;
+}
+
+size_t BroadcastLogWriter::max_block_size() const {
+  return std::min(delegate_->max_block_size(), capacity_ / 4);
+}
+
+void BroadcastLogWriter::CopyToRing(uint64_t pos, const char *data,
+                                    size_t len) {
+  const size_t offset = pos & (capacity_ - 1);
+  const size_t first = std::min(len, capacity_ - offset);
+  memcpy(ring_ + offset, data, first);
+  memcpy(ring_, data + first, len - first);
+}
+
+void BroadcastLogWriter::Append(const RecordHeader &header,
+                                const char *data) {
+  char encoded[kMaxRecordHeaderSize];
+  const size_t header_len = encoder_.EncodeHeader(header, encoded);
+  const uint64_t pos = head_.load(std::memory_order_relaxed);
+  const uint64_t segment = pos / (capacity_ / kCheckpoints);
+  if (segment != last_segment_) {
+    checkpoints_[segment % kCheckpoints].store(pos, std::memory_order_relaxed);
+    last_segment_ = segment;
+  }
+  const uint64_t end = pos + header_len + header.block_size;
+  writing_.store(end);
+  std::atomic_thread_fence(std::memory_order_release);
+  CopyToRing(pos, encoded, header_len);
+  CopyToRing(pos + header_len, data, header.block_size);
+  head_.store(end);
+  if (server_waiting_.load() && server_waiting_.exchange(false)) Wake();
+
+  delegate_->Append(header, data);
+}
+
+void BroadcastLogWriter::Wake() {
+  const uint64_t one = 1;
+  while (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+// Subscribers stay this far behind the head, so that what is being sent
+// is not overwritten in the meantime by the next record, which is at most
+// max_block_size() plus its header.
+static uint64_t SafeLag(size_t capacity) {
+  return capacity - capacity / 4 - kMaxRecordHeaderSize;
+}
+
+uint64_t BroadcastLogWriter::CatchUpPosition() const {
+  const uint64_t head = head_.load();
+  if (head <= SafeLag(capacity_)) return 0;  // Everything is still there.
+  const uint64_t oldest = head - SafeLag(capacity_);
+  uint64_t result = head;
+  for (const std::atomic<uint64_t> &checkpoint : checkpoints_) {
+    const uint64_t pos = checkpoint.load(std::memory_order_relaxed);
+    if (pos >= oldest && pos < result) result = pos;
+  }
+  return result;
+}
+
+bool BroadcastLogWriter::Send(Subscriber *subscriber) {
+  while (subscriber->header_sent < file_header_.size()) {
+    const ssize_t w = send(subscriber->fd,
+                           file_header_.data() + subscriber->header_sent,
+                           file_header_.size() - subscriber->header_sent,
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      subscriber->blocked = true;
+      return true;
+    }
+    if (w <= 0) return false;
+    subscriber->header_sent += w;
+  }
+  for (size_t sent = 0; sent < kMaxSendChunk; /**/) {
+    const uint64_t head = head_.load();
+    const uint64_t pos = subscriber->pos;
+    if (pos == head) return true;
+    if (head - pos > SafeLag(capacity_)) return false;  // Too slow.
+    const size_t offset = pos & (capacity_ - 1);
+    const size_t len = std::min<uint64_t>(head - pos, capacity_ - offset);
+    const ssize_t w = send(subscriber->fd, ring_ + offset, len,
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      subscriber->blocked = true;
+      return true;
+    }
+    if (w <= 0) return false;
+    // If the producer started overwriting it while sending, what went out
+    // is garbage.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (writing_.load() > pos + capacity_) return false;
+    subscriber->pos += w;
+    sent += w;
+  }
+  return true;
+}
+
+void BroadcastLogWriter::Run() {
+  std::vector<Subscriber> subscribers;
+  std::vector<pollfd> fds;
+  while (!exit_requested_) {
+    for (size_t i = 0; i < subscribers.size(); /**/) {
+      Subscriber &s = subscribers[i];
+      if (!s.blocked && !Send(&s)) {
+        close(s.fd);
+        subscribers.erase(subscribers.begin() + i);
+        continue;
+      }
+      ++i;
+    }
+
+    fds.clear();
+    fds.push_back({ listen_fd_, POLLIN, 0 });
+    fds.push_back({ wakeup_fd_, POLLIN, 0 });
+    for (const Subscriber &s : subscribers) {
+      // Subscribers don't send anything, so readable means they are gone.
+      fds.push_back({ s.fd, (short)(POLLIN | (s.blocked ? POLLOUT : 0)), 0 });
+    }
+    // Only sleep if the producer knows to wake us for new records.
+    server_waiting_ = true;
+    bool behind = false;
+    for (const Subscriber &s : subscribers) {
+      behind |= !s.blocked && s.pos != head_.load();
+    }
+    if (poll(fds.data(), fds.size(), behind ? 0 : -1) < 0 && errno != EINTR) {
+      break;
+    }
+    server_waiting_ = false;
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      while (read(wakeup_fd_, &count, sizeof(count)) < 0 && errno == EINTR) {}
+    }
+    for (size_t i = subscribers.size(); i-- > 0; /**/) {
+      const short revents = fds[2 + i].revents;
+      if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        close(subscribers[i].fd);
+        subscribers.erase(subscribers.begin() + i);
+      } else if (revents & POLLOUT) {
+        subscribers[i].blocked = false;
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept4(listen_fd_, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        subscribers.push_back({ fd, 0, CatchUpPosition(), false });
+      }
+    }
+  }
+
+  // Give subscribers a moment to get the rest, then end their stream.
+  const auto deadline = std::chrono::steady_clock::now()
+    + std::chrono::milliseconds(kFinalDrainMs);
+  while (!subscribers.empty()) {
+    fds.clear();
+    for (size_t i = 0; i < subscribers.size(); /**/) {
+      Subscriber &s = subscribers[i];
+      s.blocked = false;
+      if (!Send(&s) || (!s.blocked && s.pos == head_.load())) {
+        close(s.fd);
+        subscribers.erase(subscribers.begin() + i);
+        continue;
+      }
+      fds.push_back({ s.fd, POLLOUT, 0 });
+      ++i;
+    }
+    const int remaining_ms = std::chrono::duration_cast<
+      std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now())
+      .count();
+    if (remaining_ms <= 0) break;
+    if (!fds.empty()) poll(fds.data(), fds.size(), remaining_ms);
+  }
+  for (const Subscriber &s : subscribers) close(s.fd);
+}
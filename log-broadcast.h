@@ -0,0 +1,88 @@
+#ifndef LOG_BROADCAST_H
+#define LOG_BROADCAST_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "log-format.h"
+#include "log-writer.h"
+
+// Passes records on to the delegate and also makes them available to any
+// number of subscribers connecting to a Unix-domain socket, e.g.
+// bidi-tee-print following the session live.
+//
+// Each record is encoded once into an in-memory ring; a separate thread
+// sends to all subscribers straight out of the ring. A new subscriber gets
+// the file header and then catches up from the oldest record still in the
+// ring. Subscribers too slow to keep up are disconnected, the forwarding
+// path never waits for them.
+class BroadcastLogWriter : public LogWriter {
+public:
+  // Listen at path; returns nullptr with errno set on failure. An existing
+  // socket is replaced unless it is still in use.
+  static BroadcastLogWriter *Create(std::unique_ptr<LogWriter> delegate,
+                                    const std::string &path,
+                                    const LogEncoder &encoder,
+                                    size_t ring_size);
+  ~BroadcastLogWriter() override;  // Removes the socket.
+
+  void Append(const RecordHeader &header, const char *data) override;
+  size_t max_block_size() const override;
+  void Flush() override { delegate_->Flush(); }
+  timestamp_t flush_deadline() const override {
+    return delegate_->flush_deadline();
+  }
+
+private:
+  // Bytes of a subscriber's stream sent so far.
+  struct Subscriber {
+    int fd;
+    size_t header_sent;
+    uint64_t pos;  // Next byte in the ring.
+    bool blocked;  // Socket buffer full, waiting for POLLOUT.
+  };
+
+  // New records are remembered as the place to catch up from once per
+  // segment of the ring.
+  static constexpr int kCheckpoints = 64;
+
+  BroadcastLogWriter(std::unique_ptr<LogWriter> delegate,
+                     const std::string &path, const LogEncoder &encoder,
+                     size_t ring_size, int listen_fd, int wakeup_fd);
+
+  void CopyToRing(uint64_t pos, const char *data, size_t len);
+  uint64_t CatchUpPosition() const;
+
+  // Server thread.
+  void Run();
+  void Accept();
+  bool Send(Subscriber *subscriber);  // False if it is to be dropped.
+  void Wake();
+
+  std::unique_ptr<LogWriter> delegate_;
+  const std::string path_;
+  const LogEncoder encoder_;
+  const std::string file_header_;
+  const size_t capacity_;  // Power of two.
+  char *const ring_;
+  const int listen_fd_;
+  const int wakeup_fd_;  // eventfd
+
+  // Absolute stream position; index into ring & mask. Written by producer.
+  std::atomic<uint64_t> head_{0};
+  // End of the record being copied into the ring; up to there, bytes may
+  // be overwritten right now. Stored before the copy starts.
+  std::atomic<uint64_t> writing_{0};
+  std::atomic<uint64_t> checkpoints_[kCheckpoints];
+  uint64_t last_segment_ = 0;
+
+  std::atomic<bool> server_waiting_{false};
+  std::atomic<bool> exit_requested_{false};
+  std::thread thread_;
+};
+
+#endif // LOG_BROADCAST_H
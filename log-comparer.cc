@@ -0,0 +1,462 @@
+#include "log-comparer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
+
+#include "histogram.h"
+
+// Bytes covered by the rolling hash; a match has to be at least that long.
+static constexpr size_t kAnchorSize = 32;
+
+// Of all positions, only those with a hash matching this mask are looked
+// up, about one in 16. As this is decided by the content, both streams
+// pick the same ones in matching parts.
+static constexpr uint64_t kAnchorMask = 0xf;
+
+static constexpr uint64_t kHashBase = 0x100000001b3ull;
+static constexpr size_t kPreviewSize = 48;
+
+// Of the lookahead, how much one side may be ahead before what is there
+// is taken as different anyway.
+static constexpr size_t kMaxAheadFactor = 16;
+
+namespace {
+// Rabin-Karp hash of the kAnchorSize bytes at a position, moved along one
+// byte at a time.
+class RollingHash {
+public:
+  explicit RollingHash(const char *data) {
+    for (size_t i = 0; i < kAnchorSize; ++i) {
+      value_ = value_ * kHashBase + (uint8_t)data[i];
+      if (i) out_factor_ *= kHashBase;
+    }
+  }
+
+  void Roll(char out, char in) {
+    value_ = (value_ - (uint8_t)out * out_factor_) * kHashBase + (uint8_t)in;
+  }
+
+  uint64_t value() const { return value_; }
+  bool anchor() const { return ((value_ >> 40) & kAnchorMask) == 0; }
+
+private:
+  uint64_t value_ = 0;
+  uint64_t out_factor_ = 1;  // kHashBase^(kAnchorSize-1)
+};
+}  // namespace
+
+// FNV-1a
+static uint64_t HashMessage(const char *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Escaped start of the data; with ... if there is more.
+static void AppendPreview(OutputBuffer *out, char marker,
+                          const char *data, size_t len, bool more) {
+  char line[kPreviewSize * 4 + 16];
+  size_t pos = snprintf(line, sizeof(line), "  %c \"", marker);
+  for (size_t i = 0; i < std::min(len, kPreviewSize); ++i) {
+    const unsigned char c = data[i];
+    if (c == '\n') {
+      pos += snprintf(line + pos, sizeof(line) - pos, "\\n");
+    } else if (c == '\r') {
+      pos += snprintf(line + pos, sizeof(line) - pos, "\\r");
+    } else if (c == '"' || c == '\\') {
+      pos += snprintf(line + pos, sizeof(line) - pos, "\\%c", c);
+    } else if (c < 0x20 || c >= 0x7f) {
+      pos += snprintf(line + pos, sizeof(line) - pos, "\\x%02x", c);
+    } else {
+      line[pos++] = c;
+    }
+  }
+  snprintf(line + pos, sizeof(line) - pos, "\"%s\n",
+           more || len > kPreviewSize ? "..." : "");
+  out->Append(line);
+}
+
+class ChannelComparer {
+public:
+  ChannelComparer(const std::string &name, bool messages,
+                  const CompareOptions &options, OutputBuffer *out)
+    : name_(name), messages_(messages), options_(options), out_(out) {}
+
+  void Add(int side, const char *data, size_t len, int64_t time);
+  void End(int side) {
+    sides_[side].ended = true;
+    Compare();
+  }
+
+  void Report();
+  bool identical() const { return divergences_ == 0; }
+
+  // If that side has enough to compare, but the other one has not yet.
+  bool ahead(int side) const {
+    return available(side) >= lookahead() && available(!side) < lookahead()
+      && !sides_[!side].ended;
+  }
+
+private:
+  struct Message {
+    uint64_t hash;
+    size_t len;
+    int64_t time;
+    std::string preview;
+  };
+  struct Chunk {  // Where a record starts in the byte stream.
+    uint64_t offset;
+    int64_t time;
+  };
+  struct Side {
+    std::deque<Message> messages;
+    std::string bytes;
+    size_t start = 0;       // Of what is not compared yet in bytes.
+    std::deque<Chunk> chunks;
+    uint64_t position = 0;  // Message or byte at the front.
+    uint64_t total = 0;
+    bool ended = false;
+
+    const char *data() const { return bytes.data() + start; }
+    int64_t TimeAt(uint64_t offset) const;
+  };
+
+  size_t lookahead() const {
+    return messages_ ? options_.lookahead_messages : options_.lookahead_bytes;
+  }
+  size_t available(int side) const {
+    const Side &s = sides_[side];
+    return messages_ ? s.messages.size() : s.bytes.size() - s.start;
+  }
+  void Compare();
+  size_t CommonPrefix(size_t n) const;
+  bool FindBytes(size_t la, size_t lb, size_t *i, size_t *j) const;
+  bool FindMessages(size_t la, size_t lb, size_t *i, size_t *j) const;
+  void Matched(size_t n);
+  void Diverged(size_t n0, size_t n1, bool in_sync_again);
+  void Consume(int side, size_t n);
+  void RecordDelta(int64_t delta);
+
+  const std::string name_;
+  const bool messages_;
+  const CompareOptions &options_;
+  OutputBuffer *const out_;
+  Side sides_[2];
+
+  uint64_t matched_ = 0;
+  uint64_t divergences_ = 0;
+  uint64_t differing_[2] = { 0, 0 };
+  Histogram delta_;  // Absolute time difference of what matched.
+  double delta_sum_ = 0;
+  int64_t delta_min_ = 0;
+  int64_t delta_max_ = 0;
+};
+
+int64_t ChannelComparer::Side::TimeAt(uint64_t offset) const {
+  auto after = std::upper_bound(chunks.begin(), chunks.end(), offset,
+                                [](uint64_t o, const Chunk &c) {
+                                  return o < c.offset;
+                                });
+  if (after == chunks.begin()) return chunks.empty() ? 0 : after->time;
+  return (after - 1)->time;
+}
+
+void ChannelComparer::Add(int side, const char *data, size_t len,
+                          int64_t time) {
+  Side &s = sides_[side];
+  if (messages_) {
+    s.messages.push_back({ HashMessage(data, len), len, time,
+                           std::string(data, std::min(len, kPreviewSize)) });
+    s.total++;
+  } else {
+    s.chunks.push_back({ s.total, time });
+    s.bytes.append(data, len);
+    s.total += len;
+  }
+  Compare();
+}
+
+void ChannelComparer::Compare() {
+  const size_t lookahead = this->lookahead();
+  for (;;) {
+    const size_t na = available(0), nb = available(1);
+    const size_t same = CommonPrefix(std::min(na, nb));
+    if (same > 0) {
+      Matched(same);
+      continue;
+    }
+    if (na == 0 && nb == 0) return;
+
+    // Wait for enough of both to look for where they match again, unless
+    // one got too far ahead.
+    const bool force = na > kMaxAheadFactor * lookahead ||
+      nb > kMaxAheadFactor * lookahead;
+    if (!force && ((na < lookahead && !sides_[0].ended) ||
+                   (nb < lookahead && !sides_[1].ended))) {
+      return;
+    }
+    const size_t la = std::min(na, lookahead), lb = std::min(nb, lookahead);
+    size_t i, j;
+    if (messages_ ? FindMessages(la, lb, &i, &j) : FindBytes(la, lb, &i, &j)) {
+      Diverged(i, j, true);
+    } else {
+      Diverged(la, lb, false);
+    }
+  }
+}
+
+size_t ChannelComparer::CommonPrefix(size_t n) const {
+  size_t i = 0;
+  if (messages_) {
+    const std::deque<Message> &a = sides_[0].messages, &b = sides_[1].messages;
+    while (i < n && a[i].hash == b[i].hash && a[i].len == b[i].len) ++i;
+    return i;
+  }
+  const char *a = sides_[0].data(), *b = sides_[1].data();
+  constexpr size_t kBlock = 64;
+  while (i + kBlock <= n && memcmp(a + i, b + i, kBlock) == 0) i += kBlock;
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
+}
+
+// Earliest place (smallest i + j) where a[i..] and b[j..] start with the
+// same bytes, looking at anchors in the first la and lb bytes.
+bool ChannelComparer::FindBytes(size_t la, size_t lb,
+                                size_t *i, size_t *j) const {
+  if (la < kAnchorSize || lb < kAnchorSize) return false;
+  const char *a = sides_[0].data(), *b = sides_[1].data();
+  std::unordered_map<uint64_t, size_t> anchors;  // First position in b.
+  RollingHash hash_b(b);
+  for (size_t k = 0; /**/; ++k) {
+    if (hash_b.anchor()) anchors.emplace(hash_b.value(), k);
+    if (k + kAnchorSize >= lb) break;
+    hash_b.Roll(b[k], b[k + kAnchorSize]);
+  }
+  size_t best = SIZE_MAX;
+  RollingHash hash_a(a);
+  for (size_t k = 0; k < best; ++k) {
+    if (hash_a.anchor()) {
+      const auto found = anchors.find(hash_a.value());
+      if (found != anchors.end() && k + found->second < best &&
+          memcmp(a + k, b + found->second, kAnchorSize) == 0) {
+        best = k + found->second;
+        *i = k;
+        *j = found->second;
+      }
+    }
+    if (k + kAnchorSize >= la) break;
+    hash_a.Roll(a[k], a[k + kAnchorSize]);
+  }
+  if (best == SIZE_MAX) return false;
+  // The anchor is somewhere in the matching part; go back to its start.
+  while (*i > 0 && *j > 0 && a[*i - 1] == b[*j - 1]) {
+    --*i;
+    --*j;
+  }
+  return true;
+}
+
+bool ChannelComparer::FindMessages(size_t la, size_t lb,
+                                   size_t *i, size_t *j) const {
+  const std::deque<Message> &a = sides_[0].messages, &b = sides_[1].messages;
+  std::unordered_map<uint64_t, size_t> first;  // Position in b by hash.
+  for (size_t k = 0; k < lb; ++k) first.emplace(b[k].hash, k);
+  size_t best = SIZE_MAX;
+  for (size_t k = 0; k < la && k < best; ++k) {
+    const auto found = first.find(a[k].hash);
+    if (found != first.end() && k + found->second < best &&
+        a[k].len == b[found->second].len) {
+      best = k + found->second;
+      *i = k;
+      *j = found->second;
+    }
+  }
+  return best != SIZE_MAX;
+}
+
+void ChannelComparer::RecordDelta(int64_t delta) {
+  if (delta_.count() == 0 || delta < delta_min_) delta_min_ = delta;
+  if (delta_.count() == 0 || delta > delta_max_) delta_max_ = delta;
+  delta_.Record(delta < 0 ? -delta : delta);
+  delta_sum_ += delta;
+}
+
+void ChannelComparer::Matched(size_t n) {
+  Side &a = sides_[0], &b = sides_[1];
+  if (messages_) {
+    for (size_t i = 0; i < n; ++i) {
+      RecordDelta(b.messages[i].time - a.messages[i].time);
+    }
+  } else {
+    // Each record of the first capture against the time the second one
+    // had the same byte.
+    for (const Chunk &chunk : a.chunks) {
+      if (chunk.offset >= a.position + n) break;
+      if (chunk.offset < a.position) continue;
+      RecordDelta(b.TimeAt(b.position + (chunk.offset - a.position)) -
+                  chunk.time);
+    }
+  }
+  matched_ += n;
+  Consume(0, n);
+  Consume(1, n);
+}
+
+void ChannelComparer::Consume(int side, size_t n) {
+  Side &s = sides_[side];
+  s.position += n;
+  if (messages_) {
+    s.messages.erase(s.messages.begin(), s.messages.begin() + n);
+    return;
+  }
+  s.start += n;
+  // Keep the record the front is in, for its time.
+  while (s.chunks.size() > 1 && s.chunks[1].offset <= s.position) {
+    s.chunks.pop_front();
+  }
+  if (s.start > (64 << 10) && s.start > s.bytes.size() / 2) {
+    s.bytes.erase(0, s.start);
+    s.start = 0;
+  }
+}
+
+void ChannelComparer::Diverged(size_t n0, size_t n1, bool in_sync_again) {
+  ++divergences_;
+  differing_[0] += n0;
+  differing_[1] += n1;
+  if (divergences_ <= (uint64_t)options_.max_reported) {
+    const char *unit = messages_ ? "message" : "byte";
+    char times[2][32];
+    for (int side = 0; side < 2; ++side) {
+      const Side &s = sides_[side];
+      if (side ? n1 == 0 : n0 == 0) {
+        snprintf(times[side], sizeof(times[side]), "%s",
+                 s.ended ? "end" : "-");
+      } else {
+        const int64_t time = messages_ ? s.messages.front().time
+                                       : s.TimeAt(s.position);
+        snprintf(times[side], sizeof(times[side]), "+%.6fs", time / 1e9);
+      }
+    }
+    char line[512];
+    snprintf(line, sizeof(line),
+             "%s: at %s %llu (%s) / %llu (%s): %zu / %zu %ss differ%s\n",
+             name_.c_str(), unit,
+             (unsigned long long)sides_[0].position, times[0],
+             (unsigned long long)sides_[1].position, times[1],
+             n0, n1, unit,
+             in_sync_again ? "" : ", no match within the lookahead");
+    out_->Append(line);
+    for (int side = 0; side < 2; ++side) {
+      const size_t n = side ? n1 : n0;
+      if (n == 0) continue;
+      const Side &s = sides_[side];
+      if (messages_) {
+        const Message &first = s.messages.front();
+        AppendPreview(out_, side ? '>' : '<', first.preview.data(),
+                      first.preview.size(),
+                      n > 1 || first.len > first.preview.size());
+      } else {
+        AppendPreview(out_, side ? '>' : '<', s.data(), n, false);
+      }
+    }
+  } else if (divergences_ == (uint64_t)options_.max_reported + 1) {
+    out_->Append(name_.c_str());
+    out_->Append(": more divergences, not shown\n");
+  }
+  Consume(0, n0);
+  Consume(1, n1);
+}
+
+void ChannelComparer::Report() {
+  const char *unit = messages_ ? "messages" : "bytes";
+  char line[512];
+  snprintf(line, sizeof(line), "%-10s %llu / %llu %s, %llu matched, "
+           "%llu divergences (%llu / %llu %s)\n", name_.c_str(),
+           (unsigned long long)sides_[0].total,
+           (unsigned long long)sides_[1].total, unit,
+           (unsigned long long)matched_, (unsigned long long)divergences_,
+           (unsigned long long)differing_[0],
+           (unsigned long long)differing_[1], unit);
+  out_->Append(line);
+  if (delta_.count() == 0) return;
+  snprintf(line, sizeof(line), "%-10s time > minus < of %llu matched %s: "
+           "mean %+.3fms, min %+.3fms, max %+.3fms\n", "",
+           (unsigned long long)delta_.count(),
+           messages_ ? "messages" : "records",
+           delta_sum_ / delta_.count() / 1e6, delta_min_ / 1e6,
+           delta_max_ / 1e6);
+  out_->Append(line);
+  snprintf(line, sizeof(line), "%-10s absolute: p50 %.3fms, p90 %.3fms, "
+           "p99 %.3fms\n", "", delta_.Percentile(0.5) / 1e6,
+           delta_.Percentile(0.9) / 1e6, delta_.Percentile(0.99) / 1e6);
+  out_->Append(line);
+}
+
+LogComparer::LogComparer(const CompareOptions &options,
+                         const std::map<int, std::string> &channel_names,
+                         const std::string &name0, const std::string &name1,
+                         OutputBuffer *out)
+  : options_(options), channel_names_(channel_names), out_(out) {
+  out_->Append("< ");
+  out_->Append(name0.c_str());
+  out_->Append("\n> ");
+  out_->Append(name1.c_str());
+  out_->Append("\n");
+}
+
+LogComparer::~LogComparer() {}
+
+ChannelComparer *LogComparer::GetChannel(int channel) {
+  if (!channels_[channel]) {
+    const auto name = channel_names_.find(channel);
+    channels_[channel].reset(new ChannelComparer(
+      name != channel_names_.end() ? name->second : std::to_string(channel),
+      (options_.message_channels >> channel) & 1, options_, out_));
+    for (int side = 0; side < 2; ++side) {
+      if (finished_[side]) channels_[channel]->End(side);
+    }
+  }
+  return channels_[channel].get();
+}
+
+void LogComparer::Process(int side, const RecordHeader &header,
+                          const char *payload, int64_t since_start) {
+  if (header.block_size == 0 || header.channel >= 16) return;
+  GetChannel(header.channel)->Add(side, payload, header.block_size,
+                                  since_start);
+}
+
+void LogComparer::Finish(int side) {
+  finished_[side] = true;
+  for (std::unique_ptr<ChannelComparer> &channel : channels_) {
+    if (channel) channel->End(side);
+  }
+}
+
+void LogComparer::Report() {
+  out_->Append('\n');
+  for (std::unique_ptr<ChannelComparer> &channel : channels_) {
+    if (channel) channel->Report();
+  }
+  out_->Append(identical() ? "Identical\n" : "Different\n");
+}
+
+bool LogComparer::Ahead(int side) const {
+  for (const std::unique_ptr<ChannelComparer> &channel : channels_) {
+    if (channel && channel->ahead(side)) return true;
+  }
+  return false;
+}
+
+bool LogComparer::identical() const {
+  for (const std::unique_ptr<ChannelComparer> &channel : channels_) {
+    if (channel && !channel->identical()) return false;
+  }
+  return true;
+}
@@ -0,0 +1,70 @@
+#ifndef LOG_COMPARER_H
+#define LOG_COMPARER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "block-header.h"
+#include "output-buffer.h"
+
+struct CompareOptions {
+  uint16_t message_channels = 0;  // Compared message by message (framed).
+  int max_reported = 10;          // Divergences printed per channel.
+  size_t lookahead_bytes = 256 << 10;  // To find where streams match again.
+  size_t lookahead_messages = 4096;
+};
+
+class ChannelComparer;
+
+// Compares two captures, e.g. of a good and a bad build, channel by
+// channel: the messages of framed channels, the byte stream of the others,
+// regardless of how it was cut into records. Where they diverge, it looks
+// ahead in both for where they match again, using a rolling hash of the
+// bytes or a hash of each message, and reports what is in between. Of
+// what matches, the difference in time since the start of each capture is
+// measured.
+//
+// Memory is bounded by the lookahead; the records of both captures are to
+// be fed in about the order of their time since start, and not more of a
+// capture that is Ahead(). If one capture still gets ahead in a channel by
+// many times the lookahead, that is taken as a divergence.
+class LogComparer {
+public:
+  // Side 0 and 1 are the two captures, with these names in the report.
+  LogComparer(const CompareOptions &options,
+              const std::map<int, std::string> &channel_names,
+              const std::string &name0, const std::string &name1,
+              OutputBuffer *out);
+  ~LogComparer();
+
+  // The next record of a capture, with its time since the capture started.
+  // In message channels, each record is a message.
+  void Process(int side, const RecordHeader &header, const char *payload,
+               int64_t since_start);
+
+  // No more records of that capture.
+  void Finish(int side);
+
+  // If in a channel, that capture has enough to compare but the other one
+  // has not yet; better read the other one first.
+  bool Ahead(int side) const;
+
+  // Print the summary of each channel.
+  void Report();
+
+  bool identical() const;
+
+private:
+  ChannelComparer *GetChannel(int channel);
+
+  const CompareOptions options_;
+  const std::map<int, std::string> channel_names_;
+  OutputBuffer *const out_;
+  std::unique_ptr<ChannelComparer> channels_[16];
+  bool finished_[2] = { false, false };
+};
+
+#endif // LOG_COMPARER_H
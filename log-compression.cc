@@ -0,0 +1,90 @@
+#include "log-compression.h"
+
+#include <zlib.h>
+
+#include <cstring>
+
+bool ParseCodecName(const char *name, Codec *codec) {
+  if (strcmp(name, "zlib") == 0) {
+    *codec = Codec::kZlib;
+    return true;
+  }
+  return false;
+}
+
+namespace {
+class ZlibCompressor : public Compressor {
+public:
+  explicit ZlibCompressor(int level) {
+    memset(&stream_, 0, sizeof(stream_));
+    ok_ = deflateInit(&stream_, level ? level : Z_DEFAULT_COMPRESSION) == Z_OK;
+  }
+  ~ZlibCompressor() override { if (ok_) deflateEnd(&stream_); }
+
+  bool ok() const { return ok_; }
+  Codec codec() const override { return Codec::kZlib; }
+
+  void Compress(const iovec *chunks, int count, std::string *out) override {
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) total += chunks[i].iov_len;
+    out->resize(deflateBound(&stream_, total));
+    deflateReset(&stream_);
+    stream_.next_out = (Bytef *)&(*out)[0];
+    stream_.avail_out = out->size();
+    for (int i = 0; i < count; ++i) {
+      stream_.next_in = (Bytef *)chunks[i].iov_base;
+      stream_.avail_in = chunks[i].iov_len;
+      deflate(&stream_, i == count - 1 ? Z_FINISH : Z_NO_FLUSH);
+    }
+    out->resize(stream_.total_out);
+  }
+
+private:
+  z_stream stream_;
+  bool ok_;
+};
+
+class ZlibDecompressor : public Decompressor {
+public:
+  ZlibDecompressor() {
+    memset(&stream_, 0, sizeof(stream_));
+    ok_ = inflateInit(&stream_) == Z_OK;
+  }
+  ~ZlibDecompressor() override { if (ok_) inflateEnd(&stream_); }
+
+  bool ok() const { return ok_; }
+
+  bool Decompress(const char *data, size_t len,
+                  char *out, size_t out_len) override {
+    inflateReset(&stream_);
+    stream_.next_in = (Bytef *)data;
+    stream_.avail_in = len;
+    stream_.next_out = (Bytef *)out;
+    stream_.avail_out = out_len;
+    return inflate(&stream_, Z_FINISH) == Z_STREAM_END &&
+      stream_.total_out == out_len;
+  }
+
+private:
+  z_stream stream_;
+  bool ok_;
+};
+}  // namespace
+
+Compressor *Compressor::Create(Codec codec, int level) {
+  if (codec == Codec::kZlib) {
+    ZlibCompressor *result = new ZlibCompressor(level);
+    if (result->ok()) return result;
+    delete result;
+  }
+  return nullptr;
+}
+
+Decompressor *Decompressor::Create(Codec codec) {
+  if (codec == Codec::kZlib) {
+    ZlibDecompressor *result = new ZlibDecompressor();
+    if (result->ok()) return result;
+    delete result;
+  }
+  return nullptr;
+}
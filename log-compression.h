@@ -0,0 +1,38 @@
+#ifndef LOG_COMPRESSION_H
+#define LOG_COMPRESSION_H
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <string>
+
+#include "log-format.h"
+
+// Name as given on the command line, e.g. "zlib". Returns false if unknown.
+bool ParseCodecName(const char *name, Codec *codec);
+
+// Compresses frames of records; each frame is independent of the others.
+class Compressor {
+public:
+  // Returns nullptr if codec is not supported. Level 0 is codec default.
+  static Compressor *Create(Codec codec, int level = 0);
+  virtual ~Compressor() {}
+
+  virtual Codec codec() const = 0;
+
+  // Compress the concatenation of the chunks into out.
+  virtual void Compress(const iovec *chunks, int count, std::string *out) = 0;
+};
+
+class Decompressor {
+public:
+  // Returns nullptr if codec is not supported.
+  static Decompressor *Create(Codec codec);
+  virtual ~Decompressor() {}
+
+  // Decompress a frame that has to result in exactly out_len bytes.
+  virtual bool Decompress(const char *data, size_t len,
+                          char *out, size_t out_len) = 0;
+};
+
+#endif // LOG_COMPRESSION_H
@@ -0,0 +1,168 @@
+#include "log-format.h"
+
+#include <algorithm>
+#include <cstring>
+
+static void PutLE(std::string *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out->push_back((char)(value & 0xff));
+    value >>= 8;
+  }
+}
+
+static uint64_t GetLE(const char *data, int bytes) {
+  uint64_t result = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    result = (result << 8) | (uint8_t)data[i];
+  }
+  return result;
+}
+
+size_t PutVarint(char *out, uint64_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (char)value;
+  return len;
+}
+
+size_t GetVarint(const char *data, size_t len, uint64_t *value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < len && i < 10; ++i) {
+    result |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+    if ((data[i] & 0x80) == 0) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (v >> 63); }
+static int64_t UnZigZag(uint64_t v) { return (v >> 1) ^ -(int64_t)(v & 1); }
+
+LogEncoder::LogEncoder(const LogFileInfo &info, int64_t origin)
+  : info_(info), origin_(origin) {
+}
+
+size_t LogEncoder::max_block_size() const {
+  return version() == 1 ? 65535 : 0xffffffff;
+}
+
+std::string LogEncoder::FileHeader() const {
+  std::string result;
+  if (version() == 1) return result;
+  result.append(kLogMagic, sizeof(kLogMagic));
+  PutLE(&result, version(), 2);
+  PutLE(&result, (uint16_t)info_.clock_source, 2);
+  PutLE(&result, 0, 4);  // header size, filled in below.
+  PutLE(&result, info_.start_wallclock_ns, 8);
+  PutLE(&result, info_.channel_names.size(), 1);
+  for (const auto &name : info_.channel_names) {
+    const size_t len = std::min<size_t>(name.second.size(), 255);
+    PutLE(&result, name.first, 1);
+    PutLE(&result, len, 1);
+    result.append(name.second, 0, len);
+  }
+  const uint32_t size = result.size();
+  for (int i = 0; i < 4; ++i) result[12 + i] = (char)(size >> (8 * i));
+  return result;
+}
+
+size_t LogEncoder::EncodeHeader(const RecordHeader &header, char *out) const {
+  if (version() == 1) {
+    BlockHeader v1;
+    memset(&v1, 0, sizeof(v1));
+    v1.timestamp_ns = WallclockNs(header.timestamp_ns);
+    v1.channel = header.channel;
+    v1.channel_closed = header.channel_closed;
+    v1.block_size = header.block_size;
+    memcpy(out, &v1, sizeof(v1));
+    return sizeof(v1);
+  }
+  const uint64_t tag = ((uint64_t)header.block_size << 6)
+    | (header.extension ? 0x20 : 0) | (header.channel_closed ? 0x10 : 0)
+    | (header.channel & 0x0f);
+  size_t len = PutVarint(out, tag);
+  len += PutVarint(out + len, ZigZag(header.timestamp_ns - origin_));
+  return len;
+}
+
+size_t EncodeSkipped(uint64_t bytes, uint64_t reads, char *out) {
+  size_t len = PutVarint(out, (uint64_t)ExtensionType::kSkipped);
+  len += PutVarint(out + len, bytes);
+  len += PutVarint(out + len, reads);
+  return len;
+}
+
+bool DecodeSkipped(const char *payload, size_t len, uint64_t *bytes,
+                   uint64_t *reads) {
+  uint64_t type;
+  size_t pos = GetVarint(payload, len, &type);
+  if (!pos || type != (uint64_t)ExtensionType::kSkipped) return false;
+  size_t field_len = GetVarint(payload + pos, len - pos, bytes);
+  if (!field_len) return false;
+  pos += field_len;
+  return GetVarint(payload + pos, len - pos, reads) != 0;
+}
+
+bool HasLogMagic(const char *data, size_t len) {
+  return len >= sizeof(kLogMagic) &&
+    memcmp(data, kLogMagic, sizeof(kLogMagic)) == 0;
+}
+
+bool ParseFileHeader(const char *data, size_t len, LogFileInfo *info) {
+  if (len < kFixedFileHeaderSize || !HasLogMagic(data, len)) return false;
+  info->version = GetLE(data + 8, 2);
+  if (info->version < 2) return false;
+  info->clock_source = (ClockSource)GetLE(data + 10, 2);
+  info->header_size = GetLE(data + 12, 4);
+  info->start_wallclock_ns = GetLE(data + 16, 8);
+  if (info->header_size < kFixedFileHeaderSize) return false;
+  if (len < info->header_size) return true;  // Caller needs to get the rest.
+
+  const char *pos = data + kFixedFileHeaderSize;
+  const char *end = data + info->header_size;
+  if (pos >= end) return true;
+  int count = (uint8_t)*pos++;
+  info->channel_names.clear();
+  while (count-- > 0 && pos + 2 <= end) {
+    const int channel = (uint8_t)pos[0];
+    const size_t name_len = (uint8_t)pos[1];
+    pos += 2;
+    if (pos + name_len > end) return false;
+    info->channel_names[channel].assign(pos, name_len);
+    pos += name_len;
+  }
+  return true;
+}
+
+size_t DecodeRecordHeader(const LogFileInfo &info, const char *data,
+                          size_t len, RecordHeader *header,
+                          bool *is_extension) {
+  if (info.version == 1) {
+    if (len < sizeof(BlockHeader)) return 0;
+    BlockHeader v1;
+    memcpy(&v1, data, sizeof(v1));
+    header->timestamp_ns = v1.timestamp_ns;
+    header->channel = v1.channel;
+    header->channel_closed = v1.channel_closed;
+    header->block_size = v1.block_size;
+    header->extension = false;
+    *is_extension = false;
+    return sizeof(v1);
+  }
+  uint64_t tag, time;
+  const size_t tag_len = GetVarint(data, len, &tag);
+  if (!tag_len) return 0;
+  const size_t time_len = GetVarint(data + tag_len, len - tag_len, &time);
+  if (!time_len) return 0;
+  header->channel = tag & 0x0f;
+  header->channel_closed = tag & 0x10;
+  *is_extension = header->extension = tag & 0x20;
+  header->block_size = tag >> 6;
+  header->timestamp_ns = info.start_wallclock_ns + UnZigZag(time);
+  return tag_len + time_len;
+}
@@ -0,0 +1,131 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+// On-disk format of the log.
+//
+// Version 1 is just a sequence of BlockHeader (see block-header.h), each
+// followed by block_size bytes of payload. Timestamps are nanoseconds
+// since the epoch, derived from the clock source and the wall clock at
+// the start.
+//
+// Version 2 starts with a file header, all integers little endian:
+//   char[8]  "BIDI-TEE"
+//   uint16   version             (2)
+//   uint16   clock source        (ClockSource)
+//   uint32   header size         (all of the file header, including this)
+//   int64    start wall clock    (nanoseconds since the epoch), the anchor
+//            that maps the clock source to the wall clock
+//   uint8    number of channel names, each of which is
+//            uint8 channel, uint8 length, <length> bytes name
+// Readers skip anything up to header size they don't understand.
+//
+// Records then have a header of two varints, followed by the payload
+//   tag:    block_size << 6 | extension << 5 | channel_closed << 4 | channel
+//   time:   zigzag encoded nanoseconds since the start wall clock.
+// Records with the extension bit set carry metadata instead of channel
+// data; their payload starts with a varint type. Readers skip extension
+// records they don't understand.
+//
+// Extension types:
+//   1  compressed frame: varint codec, varint uncompressed size, followed by
+//      the compressed bytes of a sequence of regular records. Each frame
+//      can be decompressed on its own. The timestamp is the one of the
+//      first record in the frame.
+//   2  skipped: varint bytes, varint reads. Capture sampling left out this
+//      many bytes of the channel, of this many reads, at this point of the
+//      channel's data. The time is the one of the last of these reads.
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "block-header.h"
+#include "clock.h"
+
+static constexpr char kLogMagic[8] = { 'B','I','D','I','-','T','E','E' };
+static constexpr size_t kFixedFileHeaderSize = 24;  // Without channel names.
+static constexpr size_t kMaxRecordHeaderSize = 20;  // Two 64 bit varints.
+
+enum class ExtensionType : uint8_t {
+  kCompressedFrame = 1,
+  kSkipped = 2,
+};
+
+// Largest payload of a skipped record: three varints.
+static constexpr size_t kMaxSkippedRecordSize = 30;
+
+// Compression of compressed frames.
+enum class Codec : uint8_t {
+  kNone = 0,
+  kZlib = 1,
+};
+
+// Everything in the file header.
+struct LogFileInfo {
+  int version = 1;
+  ClockSource clock_source = ClockSource::kMonotonic;
+  int64_t start_wallclock_ns = 0;
+  std::map<int, std::string> channel_names;
+  size_t header_size = 0;   // Bytes before the first record.
+};
+
+// Serializes records in a particular version of the format.
+class LogEncoder {
+public:
+  // Record timestamps are in the clock domain of "origin", which
+  // corresponds to start_wallclock_ns.
+  LogEncoder(const LogFileInfo &info, int64_t origin);
+
+  int version() const { return info_.version; }
+
+  // Largest payload a single record can have.
+  size_t max_block_size() const;
+
+  // To be written at the beginning of each file; empty for version 1.
+  std::string FileHeader() const;
+
+  // Write header to out, which has room for kMaxRecordHeaderSize.
+  // Returns the number of bytes used. Extension records are only
+  // supported from version 2 on.
+  size_t EncodeHeader(const RecordHeader &header, char *out) const;
+
+  // Record timestamp as nanoseconds since the epoch, as a reader sees it.
+  int64_t WallclockNs(int64_t timestamp) const {
+    return info_.start_wallclock_ns + (timestamp - origin_);
+  }
+
+private:
+  const LogFileInfo info_;
+  const int64_t origin_;
+};
+
+// Varint as used in the format: seven bits at a time, lowest first. Writes
+// at most 10 bytes. GetVarint() returns bytes consumed or 0 if incomplete.
+size_t PutVarint(char *out, uint64_t value);
+size_t GetVarint(const char *data, size_t len, uint64_t *value);
+
+// Payload of a skipped record, written to out with room for
+// kMaxSkippedRecordSize; returns its size. Decoding returns false if the
+// payload is not a valid skipped record.
+size_t EncodeSkipped(uint64_t bytes, uint64_t reads, char *out);
+bool DecodeSkipped(const char *payload, size_t len, uint64_t *bytes,
+                   uint64_t *reads);
+
+// Returns true if data starts with the version 2+ magic.
+bool HasLogMagic(const char *data, size_t len);
+
+// Parse a file header of at least kFixedFileHeaderSize into info. Returns
+// false if this is not a header we understand. The header is complete if
+// len >= info->header_size.
+bool ParseFileHeader(const char *data, size_t len, LogFileInfo *info);
+
+// Decode a record header at data. Timestamps are converted to nanoseconds
+// since the epoch. Returns the number of bytes consumed, 0 if len is not
+// enough for the full header. For extension records, *is_extension (and
+// header->extension) is set.
+size_t DecodeRecordHeader(const LogFileInfo &info, const char *data,
+                          size_t len, RecordHeader *header,
+                          bool *is_extension);
+
+#endif // LOG_FORMAT_H
@@ -0,0 +1,80 @@
+#include "log-index.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr char kIndexMagic[8] = { 'B','I','D','I','-','I','D','X' };
+static constexpr uint32_t kIndexVersion = 1;
+static constexpr uint32_t kIndexHeaderSize = 16;
+
+// The index is only meant to be read on machines with the same endianness,
+// so we keep it simple and write the structs as they are.
+static_assert(sizeof(IndexEntry) == 16, "Index entry unexpected size");
+
+std::string IndexFilename(const char *log_filename) {
+  return std::string(log_filename) + ".idx";
+}
+
+LogIndexWriter *LogIndexWriter::Create(const std::string &filename,
+                                       int every_records, int64_t every_ns) {
+  FILE *out = fopen(filename.c_str(), "wb");
+  if (!out) return nullptr;
+  fwrite(kIndexMagic, sizeof(kIndexMagic), 1, out);
+  fwrite(&kIndexVersion, sizeof(kIndexVersion), 1, out);
+  fwrite(&kIndexHeaderSize, sizeof(kIndexHeaderSize), 1, out);
+  return new LogIndexWriter(out, every_records, every_ns);
+}
+
+LogIndexWriter::LogIndexWriter(FILE *out, int every_records, int64_t every_ns)
+  : out_(out), every_records_(every_records), every_ns_(every_ns) {
+}
+
+LogIndexWriter::~LogIndexWriter() {
+  fclose(out_);
+}
+
+void LogIndexWriter::AddRecord(int64_t timestamp_ns, uint64_t offset) {
+  const bool due = !any_entry_
+    || (every_records_ > 0 && records_since_entry_ >= every_records_)
+    || (every_ns_ > 0 && timestamp_ns - last_entry_ns_ >= every_ns_);
+  ++records_since_entry_;
+  if (!due) return;
+  const IndexEntry entry = { timestamp_ns, offset };
+  fwrite(&entry, sizeof(entry), 1, out_);
+  records_since_entry_ = 1;
+  last_entry_ns_ = timestamp_ns;
+  any_entry_ = true;
+}
+
+bool ReadLogIndex(const std::string &filename, std::vector<IndexEntry> *out) {
+  FILE *in = fopen(filename.c_str(), "rb");
+  if (!in) return false;
+  char magic[sizeof(kIndexMagic)];
+  uint32_t version, header_size;
+  bool success = fread(magic, sizeof(magic), 1, in) == 1
+    && memcmp(magic, kIndexMagic, sizeof(magic)) == 0
+    && fread(&version, sizeof(version), 1, in) == 1
+    && version == kIndexVersion
+    && fread(&header_size, sizeof(header_size), 1, in) == 1
+    && fseek(in, header_size, SEEK_SET) == 0;
+  if (success) {
+    out->clear();
+    IndexEntry entry;
+    while (fread(&entry, sizeof(entry), 1, in) == 1) {
+      out->push_back(entry);
+    }
+  }
+  fclose(in);
+  return success;
+}
+
+uint64_t FindIndexOffset(const std::vector<IndexEntry> &index,
+                         int64_t timestamp_ns) {
+  // Last entry before the timestamp; records from there on might match.
+  auto it = std::lower_bound(index.begin(), index.end(), timestamp_ns,
+                             [](const IndexEntry &e, int64_t ts) {
+                               return e.timestamp_ns < ts;
+                             });
+  if (it == index.begin()) return 0;
+  return (it - 1)->offset;
+}
@@ -0,0 +1,66 @@
+#ifndef LOG_INDEX_H
+#define LOG_INDEX_H
+
+// A sparse index of a log, stored next to it in "<logfile>.idx", that maps
+// timestamps to file offsets of records. Allows to start reading at a
+// particular time without going through the whole log.
+//
+// File format, all integers little endian:
+//   char[8] "BIDI-IDX"
+//   uint32  version (1)
+//   uint32  size of this header (16)
+// followed by entries of
+//   int64   timestamp in nanoseconds since the epoch
+//   uint64  file offset of the record with that timestamp.
+// Entries are in file order.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Defaults for how dense the index is.
+static constexpr int kDefaultIndexEveryRecords = 1024;
+static constexpr int64_t kDefaultIndexEveryNs = 100 * 1000000LL;
+
+struct IndexEntry {
+  int64_t timestamp_ns;
+  uint64_t offset;
+};
+
+std::string IndexFilename(const char *log_filename);
+
+class LogIndexWriter {
+public:
+  // Create index file. Adds an entry at least every_records records or
+  // when every_ns passed since the last entry; 0 to not use that criterion.
+  // Returns nullptr with errno set on failure.
+  static LogIndexWriter *Create(const std::string &filename,
+                                int every_records, int64_t every_ns);
+  ~LogIndexWriter();
+
+  // To be called for every record in the log; adds an entry if due.
+  void AddRecord(int64_t timestamp_ns, uint64_t offset);
+
+  void Flush() { fflush(out_); }
+
+private:
+  LogIndexWriter(FILE *out, int every_records, int64_t every_ns);
+
+  FILE *const out_;
+  const int every_records_;
+  const int64_t every_ns_;
+  int records_since_entry_ = 0;
+  int64_t last_entry_ns_ = 0;
+  bool any_entry_ = false;
+};
+
+// Read index generated by LogIndexWriter. Returns false if it does not
+// exist or is not a valid index.
+bool ReadLogIndex(const std::string &filename, std::vector<IndexEntry> *out);
+
+// Offset from which to read to get all records from timestamp_ns on.
+uint64_t FindIndexOffset(const std::vector<IndexEntry> &index,
+                         int64_t timestamp_ns);
+
+#endif // LOG_INDEX_H
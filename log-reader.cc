@@ -0,0 +1,565 @@
+#include "log-reader.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "log-rotation.h"
+
+// If inotify is not available, how often to check for more data.
+static constexpr int kFollowPollIntervalUs = 1000;
+
+void LogReader::CountSkipped(const RecordHeader &header,
+                             const char *payload) {
+  uint64_t bytes, reads;
+  if (!DecodeSkipped(payload, header.block_size, &bytes, &reads)) return;
+  if (filter_ && (!((filter_->channels >> header.channel) & 1) ||
+                  header.timestamp_ns < filter_->from_ns)) {
+    return;
+  }
+  skipped_.bytes[header.channel] += bytes;
+  skipped_.reads[header.channel] += reads;
+}
+
+bool LogReader::HandleExtension(const RecordHeader &header,
+                                const char *payload) {
+  const size_t len = header.block_size;
+  uint64_t type, codec, size;
+  size_t pos = GetVarint(payload, len, &type);
+  if (!pos) {
+    error_ = "Invalid extension record";
+    return false;
+  }
+  if (type == (uint64_t)ExtensionType::kSkipped) {
+    CountSkipped(header, payload);
+    return true;
+  }
+  if (type != (uint64_t)ExtensionType::kCompressedFrame) {
+    return true;  // None other that we know of yet.
+  }
+  size_t field_len = GetVarint(payload + pos, len - pos, &codec);
+  if (field_len) {
+    pos += field_len;
+    field_len = GetVarint(payload + pos, len - pos, &size);
+  }
+  if (!field_len || size > 0xffffffff) {
+    error_ = "Invalid compressed frame";
+    return false;
+  }
+  pos += field_len;
+  if (!decompressor_ || decompressor_codec_ != (Codec)codec) {
+    decompressor_.reset(Decompressor::Create((Codec)codec));
+    decompressor_codec_ = (Codec)codec;
+    if (!decompressor_) {
+      error_ = "Unsupported compression codec " + std::to_string(codec);
+      return false;
+    }
+  }
+  frame_.resize(size);
+  frame_pos_ = 0;
+  if (!decompressor_->Decompress(payload + pos, len - pos,
+                                 frame_.data(), frame_.size())) {
+    error_ = "Corrupt compressed frame";
+    return false;
+  }
+  return true;
+}
+
+bool LogReader::NextFromFrame(RecordHeader *header, const char **payload) {
+  while (frame_pos_ < frame_.size()) {
+    bool is_extension = false;
+    const size_t remaining = frame_.size() - frame_pos_;
+    const size_t consumed = DecodeRecordHeader(info_,
+                                               frame_.data() + frame_pos_,
+                                               remaining, header,
+                                               &is_extension);
+    if (!consumed || header->block_size > remaining - consumed) {
+      error_ = "Corrupt record in compressed frame";
+      DropFrame();
+      return false;
+    }
+    *payload = frame_.data() + frame_pos_ + consumed;
+    frame_pos_ += consumed + header->block_size;
+    if (is_extension) {
+      CountSkipped(*header, *payload);  // Frames don't nest.
+      continue;
+    }
+    switch (Check(*header)) {
+    case Verdict::kAccept: return true;
+    case Verdict::kSkip: continue;
+    case Verdict::kStop: DropFrame(); return false;
+    }
+  }
+  return false;
+}
+
+StreamLogReader::StreamLogReader(FILE *in) : in_(in) {
+  // Version 2+ files start with the magic, otherwise this is version 1 and
+  // we just read the beginning of the first record.
+  char magic[sizeof(kLogMagic)];
+  const size_t got = fread(magic, 1, sizeof(magic), in_);
+  if (!HasLogMagic(magic, got)) {
+    pending_.assign(magic, got);
+    return;
+  }
+
+  std::string header(magic, got);
+  header.resize(kFixedFileHeaderSize);
+  if (!ReadBytes(&header[got], kFixedFileHeaderSize - got) ||
+      !ParseFileHeader(header.data(), header.size(), &info_)) {
+    error_ = "Not a log file format version we understand";
+    return;
+  }
+  header.resize(info_.header_size);
+  if (!ReadBytes(&header[kFixedFileHeaderSize],
+                 info_.header_size - kFixedFileHeaderSize) ||
+      !ParseFileHeader(header.data(), header.size(), &info_)) {
+    error_ = "Unexpected end of file reading the file header";
+  }
+}
+
+StreamLogReader::~StreamLogReader() {
+  if (in_ != stdin) fclose(in_);
+}
+
+bool StreamLogReader::ReadBytes(char *out, size_t n) {
+  const size_t from_pending = std::min(n, pending_.size());
+  memcpy(out, pending_.data(), from_pending);
+  pending_.erase(0, from_pending);
+  n -= from_pending;
+  return n == 0 || fread(out + from_pending, n, 1, in_) == 1;
+}
+
+bool StreamLogReader::SkipBytes(size_t n) {
+  const size_t from_pending = std::min(n, pending_.size());
+  pending_.erase(0, from_pending);
+  n -= from_pending;
+  if (n == 0 || fseeko(in_, n, SEEK_CUR) == 0) return true;
+  // Not seekable, e.g. a pipe; read and throw away.
+  char discard[65536];
+  while (n > 0) {
+    const size_t chunk = std::min(n, sizeof(discard));
+    if (fread(discard, chunk, 1, in_) != 1) return false;
+    n -= chunk;
+  }
+  return true;
+}
+
+bool StreamLogReader::Next(RecordHeader *header, const char **payload) {
+  for (;;) {
+    if (!error_.empty() || past_end_) return false;
+    if (NextFromFrame(header, payload)) return true;
+    if (past_end_) return false;
+    // Version 1 headers have a fixed size, later ones are varints that we
+    // have to read byte by byte until complete.
+    const size_t chunk = (info_.version == 1) ? sizeof(BlockHeader) : 1;
+    char encoded[kMaxRecordHeaderSize];
+    size_t len = 0;
+    size_t consumed = 0;
+    bool is_extension = false;
+    while (consumed == 0) {
+      if (len + chunk > sizeof(encoded) || !ReadBytes(encoded + len, chunk)) {
+        if (len > 0) error_ = "Unexpected end of file reading record header";
+        return false;
+      }
+      len += chunk;
+      consumed = DecodeRecordHeader(info_, encoded, len, header,
+                                    &is_extension);
+    }
+
+    const Verdict verdict = is_extension ? Verdict::kAccept : Check(*header);
+    if (verdict == Verdict::kStop) return false;
+    if (verdict == Verdict::kSkip) {
+      if (!SkipBytes(header->block_size)) {
+        error_ = "Unexpected end of file skipping " +
+          std::to_string(header->block_size) + " bytes";
+        return false;
+      }
+      continue;
+    }
+
+    if (header->block_size > buffer_.size()) {
+      buffer_.resize(header->block_size);
+    }
+    if (header->block_size > 0 &&
+        !ReadBytes(buffer_.data(), header->block_size)) {
+      error_ = "Unexpected end of file reading " +
+        std::to_string(header->block_size) + " bytes";
+      return false;
+    }
+    if (is_extension) {
+      HandleExtension(*header, buffer_.data());
+      continue;
+    }
+
+    *payload = buffer_.data();
+    return true;
+  }
+}
+
+MmapLogReader *MmapLogReader::Create(int fd) {
+  struct stat s;
+  if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0) {
+    return nullptr;
+  }
+  void *data = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) return nullptr;
+  madvise(data, s.st_size, MADV_SEQUENTIAL);
+  return new MmapLogReader((const char *)data, s.st_size);
+}
+
+MmapLogReader::MmapLogReader(const char *data, size_t size)
+  : data_(data), size_(size) {
+  if (!HasLogMagic(data_, size_)) return;  // Version 1.
+  if (!ParseFileHeader(data_, size_, &info_)) {
+    error_ = "Not a log file format version we understand";
+  } else if (info_.header_size > size_) {
+    error_ = "Unexpected end of file reading the file header";
+  } else {
+    pos_ = info_.header_size;
+  }
+}
+
+MmapLogReader::~MmapLogReader() {
+  if (owns_mapping_) munmap((void *)data_, size_);
+}
+
+MmapLogReader *MmapLogReader::CreateView(size_t begin, size_t end) const {
+  MmapLogReader *view = new MmapLogReader(data_, end);
+  view->owns_mapping_ = false;
+  view->info_ = info_;
+  view->error_.clear();  // View might not start with the file header.
+  view->pos_ = begin;
+  view->filter_ = filter_;
+  return view;
+}
+
+MmapLogReader *MmapLogReader::CreatePart(size_t begin, size_t end) const {
+  MmapLogReader *part = new MmapLogReader(data_ + begin, end - begin);
+  part->owns_mapping_ = false;
+  part->filter_ = filter_;
+  return part;
+}
+
+std::vector<size_t> MmapLogReader::SplitPoints(size_t begin,
+                                               size_t chunk_size) const {
+  std::vector<size_t> result;
+  size_t pos = begin;
+  while (pos < size_) {
+    if (result.empty() || pos - result.back() >= chunk_size) {
+      result.push_back(pos);
+    }
+    RecordHeader header;
+    bool is_extension;
+    const size_t consumed = DecodeRecordHeader(info_, data_ + pos,
+                                               size_ - pos, &header,
+                                               &is_extension);
+    if (!consumed) break;  // Reader will report that.
+    pos += consumed + header.block_size;
+  }
+  return result;
+}
+
+bool MmapLogReader::Next(RecordHeader *header, const char **payload) {
+  for (;;) {
+    if (!error_.empty() || past_end_) return false;
+    if (NextFromFrame(header, payload)) return true;
+    if (past_end_ || pos_ >= size_) return false;
+    record_pos_ = pos_;
+    bool is_extension = false;
+    const size_t consumed = DecodeRecordHeader(info_, data_ + pos_,
+                                               size_ - pos_, header,
+                                               &is_extension);
+    if (!consumed) {
+      error_ = "Unexpected end of file reading record header";
+      return false;
+    }
+    if (header->block_size > size_ - pos_ - consumed) {
+      error_ = "Unexpected end of file reading " +
+        std::to_string(header->block_size) + " bytes";
+      return false;
+    }
+    *payload = data_ + pos_ + consumed;
+    pos_ += consumed + header->block_size;
+    if (is_extension) {
+      HandleExtension(*header, *payload);
+      continue;
+    }
+    switch (Check(*header)) {
+    case Verdict::kAccept: return true;
+    case Verdict::kSkip: continue;  // Payload is never touched.
+    case Verdict::kStop: return false;
+    }
+  }
+}
+
+FollowLogReader::FollowLogReader(int fd, const char *filename) : fd_(fd) {
+  struct stat s;
+  is_regular_file_ = fstat(fd_, &s) == 0 && S_ISREG(s.st_mode);
+  if (!is_regular_file_) return;  // Reads on pipes block anyway.
+  inotify_fd_ = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd_ >= 0 &&
+      inotify_add_watch(inotify_fd_, filename, IN_MODIFY) < 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+}
+
+FollowLogReader::~FollowLogReader() {
+  if (inotify_fd_ >= 0) close(inotify_fd_);
+  if (fd_ != STDIN_FILENO) close(fd_);
+}
+
+bool FollowLogReader::WaitForData() {
+  if (!is_regular_file_) return false;
+  if (idle_callback_) idle_callback_();
+  if (inotify_fd_ < 0) {
+    usleep(kFollowPollIntervalUs);
+    return true;
+  }
+  // Events queued since the last read are not lost, so there is no race
+  // with data being appended after we saw the end of file.
+  char events[4096];
+  while (read(inotify_fd_, events, sizeof(events)) < 0) {
+    if (errno != EINTR) return false;
+  }
+  return true;
+}
+
+bool FollowLogReader::Fill(size_t n) {
+  if (end_ - start_ >= n) return true;
+  if (start_ > 0) {
+    memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
+    end_ -= start_;
+    start_ = 0;
+  }
+  if (buffer_.size() < n) {
+    buffer_.resize(std::max(n, (size_t)(256 << 10)));
+  }
+  while (end_ < n) {
+    if (!is_regular_file_ && idle_callback_) {
+      // Reads on pipes and sockets block, so show what we have first.
+      pollfd p = { fd_, POLLIN, 0 };
+      if (poll(&p, 1, 0) == 0) idle_callback_();
+    }
+    const ssize_t r = read(fd_, buffer_.data() + end_, buffer_.size() - end_);
+    if (r > 0) {
+      end_ += r;
+    } else if (r == 0) {
+      if (!WaitForData()) return false;
+    } else if (errno != EINTR) {
+      error_ = std::string("Reading log: ") + strerror(errno);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FollowLogReader::Skip(size_t n) {
+  const size_t buffered = std::min(n, end_ - start_);
+  start_ += buffered;
+  n -= buffered;
+  if (n == 0) return true;
+  start_ = end_ = 0;
+  // Seeking beyond what is written so far is fine, reads just wait for it.
+  if (is_regular_file_ && lseek(fd_, n, SEEK_CUR) >= 0) return true;
+  // A read can get more than is skipped; that stays buffered.
+  while (n > 0) {
+    if (!Fill(1)) return false;
+    const size_t taken = std::min(n, end_ - start_);
+    start_ += taken;
+    n -= taken;
+  }
+  return true;
+}
+
+bool FollowLogReader::ReadFileHeader() {
+  header_read_ = true;
+  // Enough to distinguish the magic from the first version 1 timestamp.
+  if (!Fill(sizeof(kLogMagic))) return false;
+  if (!HasLogMagic(buffer_.data() + start_, end_ - start_)) return true;
+  if (!Fill(kFixedFileHeaderSize) ||
+      !ParseFileHeader(buffer_.data() + start_, end_ - start_, &info_) ||
+      !Fill(info_.header_size) ||
+      !ParseFileHeader(buffer_.data() + start_, end_ - start_, &info_)) {
+    if (error_.empty()) error_ = "Not a log file format version we understand";
+    return false;
+  }
+  start_ += info_.header_size;
+  return true;
+}
+
+bool FollowLogReader::Next(RecordHeader *header, const char **payload) {
+  if (!header_read_ && !ReadFileHeader()) return false;
+  for (;;) {
+    if (!error_.empty() || past_end_) return false;
+    if (NextFromFrame(header, payload)) return true;
+    if (past_end_) return false;
+    // The record might only be partially written yet; get more until
+    // complete.
+    size_t needed = (info_.version == 1) ? sizeof(BlockHeader) : 1;
+    size_t consumed = 0;
+    bool is_extension = false;
+    while (consumed == 0) {
+      if (needed > kMaxRecordHeaderSize || !Fill(needed)) {
+        if (end_ > start_ && error_.empty()) {
+          error_ = "Unexpected end of file reading record header";
+        }
+        return false;
+      }
+      consumed = DecodeRecordHeader(info_, buffer_.data() + start_,
+                                    end_ - start_, header, &is_extension);
+      needed = end_ - start_ + 1;
+    }
+    const Verdict verdict = is_extension ? Verdict::kAccept : Check(*header);
+    if (verdict == Verdict::kStop) return false;
+    if (verdict == Verdict::kSkip) {
+      start_ += consumed;
+      if (!Skip(header->block_size)) {
+        if (error_.empty()) {
+          error_ = "Unexpected end of file skipping " +
+            std::to_string(header->block_size) + " bytes";
+        }
+        return false;
+      }
+      continue;
+    }
+    if (!Fill(consumed + header->block_size)) {
+      if (error_.empty()) {
+        error_ = "Unexpected end of file reading " +
+          std::to_string(header->block_size) + " bytes";
+      }
+      return false;
+    }
+    *payload = buffer_.data() + start_ + consumed;
+    start_ += consumed + header->block_size;
+    if (is_extension) {
+      HandleExtension(*header, *payload);
+      continue;
+    }
+    return true;
+  }
+}
+
+ChainedLogReader::ChainedLogReader(
+  std::vector<std::unique_ptr<LogReader>> parts)
+  : parts_(std::move(parts)) {
+  if (!parts_.empty()) info_ = parts_[0]->info();
+}
+
+bool ChainedLogReader::Next(RecordHeader *header, const char **payload) {
+  while (current_ < parts_.size() && !past_end_) {
+    LogReader *part = parts_[current_].get();
+    part->SetFilter(filter_);
+    if (part->Next(header, payload)) return true;
+    if (!part->error().empty()) {
+      error_ = part->error();
+      return false;
+    }
+    past_end_ = part->past_filter_end();
+    ++current_;
+  }
+  return false;
+}
+
+SkippedCounts ChainedLogReader::skipped() const {
+  SkippedCounts result = skipped_;
+  for (const std::unique_ptr<LogReader> &part : parts_) {
+    result.Add(part->skipped());
+  }
+  return result;
+}
+
+RingLogReader *RingLogReader::Create(std::unique_ptr<MmapLogReader> mapping) {
+  RingLayout layout;
+  std::vector<RingSlot> slots;
+  if (!ParseRingFile(mapping->data(), mapping->size(), &layout, &slots)) {
+    return nullptr;
+  }
+  std::vector<std::unique_ptr<LogReader>> parts;
+  for (const RingSlot &slot : slots) {
+    parts.emplace_back(mapping->CreatePart(slot.offset,
+                                           slot.offset + slot.used));
+  }
+  return new RingLogReader(std::move(mapping), std::move(parts));
+}
+
+RingLogReader::RingLogReader(std::unique_ptr<MmapLogReader> mapping,
+                             std::vector<std::unique_ptr<LogReader>> parts)
+  : ChainedLogReader(std::move(parts)), mapping_(std::move(mapping)) {
+}
+
+// Subscribe to the live broadcast of a session at a Unix-domain socket.
+static int ConnectToBroadcast(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+std::unique_ptr<LogReader> OpenLogReader(const char *filename, bool follow) {
+  struct stat s;
+  const bool is_socket = stat(filename, &s) == 0 && S_ISSOCK(s.st_mode);
+  const int fd = (strcmp(filename, "-") == 0)
+    ? STDIN_FILENO
+    : (is_socket ? ConnectToBroadcast(filename) : open(filename, O_RDONLY));
+  if (fd < 0 && errno == ENOENT && !follow) {
+    std::vector<std::unique_ptr<LogReader>> parts;
+    for (const std::string &part : FindRotatedFiles(filename)) {
+      std::unique_ptr<LogReader> reader = OpenLogReader(part.c_str());
+      if (!reader) return nullptr;
+      parts.push_back(std::move(reader));
+    }
+    if (parts.empty()) {
+      errno = ENOENT;
+      return nullptr;
+    }
+    return std::unique_ptr<LogReader>(new ChainedLogReader(std::move(parts)));
+  }
+  if (fd < 0) return nullptr;
+
+  if (follow) {
+    return std::unique_ptr<LogReader>(new FollowLogReader(fd, filename));
+  }
+
+  MmapLogReader *mapped = MmapLogReader::Create(fd);
+  if (mapped) {
+    if (fd != STDIN_FILENO) close(fd);  // Mapping stays valid.
+    if (HasRingMagic(mapped->data(), mapped->size())) {
+      RingLogReader *ring =
+        RingLogReader::Create(std::unique_ptr<MmapLogReader>(mapped));
+      if (!ring) errno = EINVAL;
+      return std::unique_ptr<LogReader>(ring);
+    }
+    return std::unique_ptr<LogReader>(mapped);
+  }
+
+  FILE *in = (fd == STDIN_FILENO) ? stdin : fdopen(fd, "rb");
+  if (!in) {
+    close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<LogReader>(new StreamLogReader(in));
+}
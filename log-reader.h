@@ -0,0 +1,237 @@
+#ifndef LOG_READER_H
+#define LOG_READER_H
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "block-header.h"
+#include "log-compression.h"
+#include "log-format.h"
+#include "record-filter.h"
+
+// What capture sampling left out of the log, per channel.
+struct SkippedCounts {
+  uint64_t bytes[16] = {};
+  uint64_t reads[16] = {};
+
+  bool any() const {
+    for (uint64_t r : reads) if (r) return true;
+    return false;
+  }
+  void Add(const SkippedCounts &other) {
+    for (int i = 0; i < 16; ++i) {
+      bytes[i] += other.bytes[i];
+      reads[i] += other.reads[i];
+    }
+  }
+};
+
+// Reads the records of a log, in any of the format versions.
+class LogReader {
+public:
+  virtual ~LogReader() {}
+
+  // The file header; for version 1 files, just the version is set.
+  const LogFileInfo &info() const { return info_; }
+
+  // Get the next record with the timestamp in nanoseconds since the epoch
+  // and its block_size bytes of payload, which stays valid until the next
+  // call. Returns false at the end of the log or if there
+  // was a problem, in which case error() is not empty.
+  virtual bool Next(RecordHeader *header, const char **payload) = 0;
+
+  const std::string &error() const { return error_; }
+
+  // Only return records accepted by the filter, which has to outlive the
+  // reader; nullptr for all. Payloads of other records are skipped.
+  void SetFilter(const RecordFilter *filter) { filter_ = filter; }
+
+  // Reading stopped at a record after the time range of the filter.
+  bool past_filter_end() const { return past_end_; }
+
+  // Of the channels and time range of the filter, what was not logged
+  // because of sampling, according to the skipped records read so far.
+  virtual SkippedCounts skipped() const { return skipped_; }
+
+protected:
+  enum class Verdict { kAccept, kSkip, kStop };
+  Verdict Check(const RecordHeader &header) {
+    if (!filter_) return Verdict::kAccept;
+    if (filter_->PastEnd(header)) {
+      past_end_ = true;
+      return Verdict::kStop;
+    }
+    return filter_->Accepts(header) ? Verdict::kAccept : Verdict::kSkip;
+  }
+
+  // Deal with the payload of an extension record; compressed frames are
+  // unpacked to be returned by NextFromFrame(). Returns false on error.
+  bool HandleExtension(const RecordHeader &header, const char *payload);
+
+  // If the extension record is a skipped record, count it.
+  void CountSkipped(const RecordHeader &header, const char *payload);
+
+  // Next record of the current compressed frame; false if there is none.
+  bool NextFromFrame(RecordHeader *header, const char **payload);
+
+  void DropFrame() { frame_.clear(); frame_pos_ = 0; }
+
+  LogFileInfo info_;
+  std::string error_;
+  const RecordFilter *filter_ = nullptr;
+  bool past_end_ = false;
+  SkippedCounts skipped_;
+
+private:
+  std::unique_ptr<Decompressor> decompressor_;
+  Codec decompressor_codec_ = Codec::kNone;
+  std::vector<char> frame_;
+  size_t frame_pos_ = 0;
+};
+
+// Reads the log as a stream, so works for pipes as well.
+class StreamLogReader : public LogReader {
+public:
+  explicit StreamLogReader(FILE *in);  // Takes ownership.
+  ~StreamLogReader() override;
+
+  bool Next(RecordHeader *header, const char **payload) override;
+
+private:
+  bool ReadBytes(char *out, size_t n);
+  bool SkipBytes(size_t n);
+
+  FILE *const in_;
+  std::string pending_;  // Read while probing the header, not consumed yet.
+  std::vector<char> buffer_;
+};
+
+// Maps the whole file into memory and hands out the payload directly from
+// the mapping, without copying.
+class MmapLogReader : public LogReader {
+public:
+  // Returns nullptr if fd can't be mapped, e.g. because it is a pipe.
+  static MmapLogReader *Create(int fd);
+  ~MmapLogReader() override;
+
+  bool Next(RecordHeader *header, const char **payload) override;
+
+  // Offset in the file of the next record.
+  size_t position() const { return pos_; }
+
+  // Offset from which the record last returned can be read again; for
+  // records in compressed frames, that is the start of the frame.
+  size_t record_position() const { return record_pos_; }
+
+  // Continue reading at position, which has to be the start of a record.
+  void Seek(size_t position) {
+    pos_ = position;
+    DropFrame();
+  }
+
+  // The whole file.
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // A reader of the records in [begin, end) of the same mapping, which has
+  // to outlive it. Both have to be record boundaries.
+  MmapLogReader *CreateView(size_t begin, size_t end) const;
+
+  // A reader of a complete log, starting with its own file header, in
+  // [begin, end) of the same mapping, which has to outlive it.
+  MmapLogReader *CreatePart(size_t begin, size_t end) const;
+
+  // Record boundaries that split [begin, size()) into pieces of about
+  // chunk_size, starting with begin. Only looks at record headers, so
+  // compressed frames are not decompressed.
+  std::vector<size_t> SplitPoints(size_t begin, size_t chunk_size) const;
+
+private:
+  MmapLogReader(const char *data, size_t size);
+
+  const char *const data_;
+  const size_t size_;
+  bool owns_mapping_ = true;
+  size_t pos_ = 0;
+  size_t record_pos_ = 0;
+};
+
+// Reads a log that is still being written: at the end of a regular file,
+// waits until more is appended instead of returning. Uses inotify to get
+// woken up and falls back to polling if not available. The file header is
+// only read with the first call to Next().
+class FollowLogReader : public LogReader {
+public:
+  FollowLogReader(int fd, const char *filename);  // Takes ownership of fd.
+  ~FollowLogReader() override;
+
+  bool Next(RecordHeader *header, const char **payload) override;
+
+  // Called whenever we're about to wait for more data, e.g. to flush output.
+  void SetIdleCallback(std::function<void()> callback) {
+    idle_callback_ = callback;
+  }
+
+private:
+  bool ReadFileHeader();
+
+  // Make sure at least n bytes are buffered, waiting for them to be
+  // written if needed. Returns false at the end of non-regular files or
+  // on error.
+  bool Fill(size_t n);
+  bool WaitForData();
+  bool Skip(size_t n);
+
+  const int fd_;
+  bool is_regular_file_ = false;
+  int inotify_fd_ = -1;
+  bool header_read_ = false;
+  std::function<void()> idle_callback_;
+  std::vector<char> buffer_;
+  size_t start_ = 0;  // Beginning of unconsumed data in buffer_.
+  size_t end_ = 0;
+};
+
+// Reads several logs one after the other, e.g. the parts of a rotated log.
+// The file header is the one of the first part.
+class ChainedLogReader : public LogReader {
+public:
+  explicit ChainedLogReader(std::vector<std::unique_ptr<LogReader>> parts);
+
+  bool Next(RecordHeader *header, const char **payload) override;
+  SkippedCounts skipped() const override;
+
+protected:
+  std::vector<std::unique_ptr<LogReader>> parts_;
+  size_t current_ = 0;
+};
+
+// Reads the parts in the slots of a ring file (see log-rotation.h), oldest
+// first.
+class RingLogReader : public ChainedLogReader {
+public:
+  // Returns nullptr if the mapped file is not a ring file we understand.
+  static RingLogReader *Create(std::unique_ptr<MmapLogReader> mapping);
+
+private:
+  RingLogReader(std::unique_ptr<MmapLogReader> mapping,
+                std::vector<std::unique_ptr<LogReader>> parts);
+
+  // Owns the mapping the parts read from; destructed after them.
+  std::unique_ptr<MmapLogReader> mapping_;
+};
+
+// Open log file, "-" for stdin. Regular files are memory mapped, anything
+// else is read as a stream; for a Unix-domain socket, that is the live
+// broadcast of bidi-tee (see log-broadcast.h). With follow, a
+// FollowLogReader is returned.
+// Ring files are read in chronological order. If there is no such file but
+// the parts of a rotated log, these are read one after the other. Returns
+// nullptr with errno set if it can't be opened.
+std::unique_ptr<LogReader> OpenLogReader(const char *filename,
+                                         bool follow = false);
+
+#endif // LOG_READER_H
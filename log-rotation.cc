@@ -0,0 +1,163 @@
+#include "log-rotation.h"
+
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+static constexpr char kRingMagic[8] = { 'B','I','D','I','-','R','N','G' };
+static constexpr uint32_t kRingVersion = 1;
+
+struct RingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t slot_size;
+  uint32_t slot_count;
+  uint32_t unused;
+};
+
+struct SlotHeader {
+  uint64_t part_plus_one;
+  uint64_t used;
+};
+
+static_assert(sizeof(RingHeader) == 32, "Ring header unexpected size");
+static_assert(sizeof(SlotHeader) == 16, "Slot header unexpected size");
+
+// Enough slots that not too much is lost when the oldest one is overwritten,
+// but large enough that per-part file headers don't matter.
+static constexpr uint32_t kRingSlots = 16;
+static constexpr uint64_t kMaxSlotSize = 64 << 20;
+
+std::string RotatedFilename(const char *log_filename, uint64_t part) {
+  return std::string(log_filename) + "." + std::to_string(part);
+}
+
+std::vector<std::string> FindRotatedFiles(const char *log_filename) {
+  std::vector<std::pair<uint64_t, std::string>> parts;
+  const std::string prefix = std::string(log_filename) + ".";
+  glob_t matches;
+  // Escaping the name for glob() is not worth it: we check what we get.
+  if (glob((prefix + "[0-9]*").c_str(), 0, nullptr, &matches) == 0) {
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+      const char *name = matches.gl_pathv[i];
+      if (strncmp(name, prefix.c_str(), prefix.size()) != 0) continue;
+      const char *number = name + prefix.size();
+      char *end;
+      const uint64_t part = strtoull(number, &end, 10);
+      if (*end) continue;  // e.g. the .idx
+      parts.emplace_back(part, name);
+    }
+  }
+  globfree(&matches);
+  std::sort(parts.begin(), parts.end());
+  std::vector<std::string> result;
+  for (const auto &p : parts) result.push_back(p.second);
+  return result;
+}
+
+uint64_t RingLayout::SlotOffset(uint64_t part) const {
+  return sizeof(RingHeader) + (part % slot_count) * slot_size;
+}
+
+uint64_t RingLayout::capacity() const {
+  return slot_size - sizeof(SlotHeader);
+}
+
+int CreateRingFile(const char *filename, uint64_t size, RingLayout *layout) {
+  size = std::max<uint64_t>(size, kMinRingSize);
+  layout->slot_count = std::max<uint64_t>(kRingSlots,
+                                          (size + kMaxSlotSize - 1)
+                                          / kMaxSlotSize);
+  layout->slot_size = (size - sizeof(RingHeader)) / layout->slot_count;
+  layout->slot_size &= ~(uint64_t)4095;  // Keep slots page aligned-ish.
+
+  const int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  const off_t total = sizeof(RingHeader)
+    + layout->slot_size * layout->slot_count;
+  // Allocate all blocks now, so that we don't run out of space later and
+  // don't fragment the file. Filesystems without fallocate() get a sparse
+  // file.
+  if (fallocate(fd, 0, 0, total) < 0 && ftruncate(fd, total) < 0) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  RingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kRingMagic, sizeof(kRingMagic));
+  header.version = kRingVersion;
+  header.header_size = sizeof(header);
+  header.slot_size = layout->slot_size;
+  header.slot_count = layout->slot_count;
+  // A reused file might still have old slot headers.
+  const SlotHeader empty = { 0, 0 };
+  bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+  for (uint32_t i = 0; ok && i < layout->slot_count; ++i) {
+    ok = pwrite(fd, &empty, sizeof(empty), layout->SlotOffset(i))
+      == sizeof(empty);
+  }
+  if (!ok) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+bool BeginRingSlot(int fd, const RingLayout &layout, uint64_t part) {
+  const SlotHeader header = { part + 1, 0 };
+  const off_t offset = layout.SlotOffset(part);
+  return pwrite(fd, &header, sizeof(header), offset) == sizeof(header) &&
+    lseek(fd, offset + sizeof(header), SEEK_SET) >= 0;
+}
+
+void SetRingSlotUsed(int fd, const RingLayout &layout, uint64_t part,
+                     uint64_t used) {
+  if (pwrite(fd, &used, sizeof(used),
+             layout.SlotOffset(part) + offsetof(SlotHeader, used)) < 0) {
+    // Nothing we can do; the reader will see less of this part.
+  }
+}
+
+bool HasRingMagic(const char *data, size_t len) {
+  return len >= sizeof(kRingMagic) &&
+    memcmp(data, kRingMagic, sizeof(kRingMagic)) == 0;
+}
+
+bool ParseRingFile(const char *data, size_t len, RingLayout *layout,
+                   std::vector<RingSlot> *slots) {
+  RingHeader header;
+  if (len < sizeof(header) || !HasRingMagic(data, len)) return false;
+  memcpy(&header, data, sizeof(header));
+  if (header.version != kRingVersion || header.slot_count == 0 ||
+      header.slot_size <= sizeof(SlotHeader) ||
+      header.header_size != sizeof(header)) {
+    return false;
+  }
+  layout->slot_size = header.slot_size;
+  layout->slot_count = header.slot_count;
+  slots->clear();
+  for (uint32_t i = 0; i < layout->slot_count; ++i) {
+    const uint64_t offset = layout->SlotOffset(i);
+    if (offset + layout->slot_size > len) return false;
+    SlotHeader slot;
+    memcpy(&slot, data + offset, sizeof(slot));
+    if (slot.part_plus_one == 0 || slot.used == 0) continue;
+    slots->push_back({ slot.part_plus_one - 1, offset + sizeof(slot),
+                       std::min(slot.used, layout->capacity()) });
+  }
+  std::sort(slots->begin(), slots->end(),
+            [](const RingSlot &a, const RingSlot &b) {
+              return a.part < b.part;
+            });
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef LOG_ROTATION_H
+#define LOG_ROTATION_H
+
+// Long recordings can be split into parts, each of which is a complete log
+// with its own file header:
+//
+// Rotated logs are parts in "<logfile>.0", "<logfile>.1", ..., numbered in
+// chronological order. Old parts might have been deleted.
+//
+// A ring file ("flight recorder") is a preallocated file of fixed size
+// that keeps overwriting the oldest part. It is split into slots that each
+// take one part:
+//   char[8] "BIDI-RNG"
+//   uint32  version (1)
+//   uint32  size of this header (32)
+//   uint64  slot size (including the slot header)
+//   uint32  number of slots
+//   uint32  unused
+// followed by the slots, each starting with a slot header of
+//   uint64  part number + 1; 0 if the slot was never used
+//   uint64  number of bytes used by the log in the slot after this header.
+// Like the index, the headers are written as structs in native byte order.
+// The slots, ordered by part number, give the log in chronological order.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+static constexpr size_t kMinRingSize = 1 << 20;
+
+std::string RotatedFilename(const char *log_filename, uint64_t part);
+
+// The parts of a rotated log that exist, in order. Empty if there are none.
+std::vector<std::string> FindRotatedFiles(const char *log_filename);
+
+struct RingLayout {
+  uint64_t slot_size = 0;
+  uint32_t slot_count = 0;
+
+  // Offset of the slot header for part.
+  uint64_t SlotOffset(uint64_t part) const;
+  // Room in a slot for the log.
+  uint64_t capacity() const;
+};
+
+// Create the ring file of about the given total size, allocating all of it
+// right away. Returns the file descriptor or -1 with errno set.
+int CreateRingFile(const char *filename, uint64_t size, RingLayout *layout);
+
+// Mark the slot for part as used by it and empty; position fd after the
+// slot header to write the log of the part. Returns false on error.
+bool BeginRingSlot(int fd, const RingLayout &layout, uint64_t part);
+
+// Record that the part has the given number of bytes in its slot.
+void SetRingSlotUsed(int fd, const RingLayout &layout, uint64_t part,
+                     uint64_t used);
+
+// Returns true if data starts with the magic of a ring file.
+bool HasRingMagic(const char *data, size_t len);
+
+struct RingSlot {
+  uint64_t part;
+  uint64_t offset;  // Of the log in the slot.
+  uint64_t used;
+};
+
+// Get the layout and the used slots, ordered by part, of a ring file in
+// memory. Returns false if it is not a ring file we understand.
+bool ParseRingFile(const char *data, size_t len, RingLayout *layout,
+                   std::vector<RingSlot> *slots);
+
+#endif // LOG_ROTATION_H
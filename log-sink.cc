@@ -0,0 +1,345 @@
+#include "log-sink.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "clock.h"
+#include "telemetry.h"
+
+// Reconnect attempts to a collector start at the minimum interval and back
+// off to the maximum while it stays unreachable.
+static constexpr int64_t kMinReconnectNs = 100 * 1000000LL;
+static constexpr int64_t kMaxReconnectNs = 10 * 1000000000LL;
+static constexpr int kConnectTimeoutMs = 1000;
+// A collector not taking any data for this long counts as gone.
+static constexpr int kSendTimeoutSeconds = 10;
+
+static constexpr size_t kDefaultDatagramSize = 1472;  // Ethernet MTU.
+static constexpr size_t kMinDatagramSize = 512;
+static constexpr size_t kMaxDatagramSize = 65507;
+
+FdSink::~FdSink() {
+  close(fd_);
+}
+
+void FdSink::Write(iovec *iov, int count) {
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  while (count > 0) {
+    ssize_t w = writev(fd_, iov, count);
+    if (w < 0) {
+      if (telemetry) telemetry->short_writes.Add(1);
+      return;  // Uhm.
+    }
+    while (count > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+      if (telemetry) telemetry->short_writes.Add(1);
+    }
+  }
+}
+
+// Send all of iov; false on error, after which the stream is unusable.
+static bool SendAll(int fd, iovec *iov, int count) {
+  while (count > 0) {
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    while (count > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return true;
+}
+
+static size_t TotalSize(const iovec *iov, int count) {
+  size_t result = 0;
+  for (int i = 0; i < count; ++i) result += iov[i].iov_len;
+  return result;
+}
+
+namespace {
+// Where a collector is.
+struct Address {
+  std::string name;  // As given by the user, for messages.
+  sockaddr_storage addr;
+  socklen_t len = 0;
+};
+
+// Stream socket that reconnects whenever the connection is lost.
+class StreamSocketSink : public LogSink {
+public:
+  explicit StreamSocketSink(const Address &address) : address_(address) {}
+  ~StreamSocketSink() override;
+
+  void Begin(const std::string &file_header) override {
+    file_header_ = file_header;
+    Connect();
+  }
+  void Write(iovec *blocks, int count) override;
+
+private:
+  bool Connect();
+  void Disconnect();
+
+  const Address address_;
+  std::string file_header_;
+  int fd_ = -1;
+  bool reported_down_ = false;
+  int64_t next_attempt_ = 0;
+  int64_t backoff_ = kMinReconnectNs;
+  uint64_t lost_bytes_ = 0;
+};
+
+// Connected UDP socket; each Write() is one datagram.
+class DatagramSink : public LogSink {
+public:
+  DatagramSink(const Address &address, int fd, size_t datagram_size)
+    : address_(address), fd_(fd), datagram_size_(datagram_size) {}
+  ~DatagramSink() override;
+
+  void Begin(const std::string &file_header) override {
+    file_header_ = file_header;
+  }
+  void Write(iovec *blocks, int count) override;
+  size_t max_write_size() const override {
+    return datagram_size_ - file_header_.size();
+  }
+
+private:
+  const Address address_;
+  const int fd_;
+  const size_t datagram_size_;
+  std::string file_header_;
+  bool reported_error_ = false;
+  uint64_t lost_bytes_ = 0;
+};
+}  // namespace
+
+StreamSocketSink::~StreamSocketSink() {
+  if (fd_ >= 0) close(fd_);
+  if (lost_bytes_) {
+    fprintf(stderr, "bidi-tee: %" PRIu64 " bytes could not be sent to %s\n",
+            lost_bytes_, address_.name.c_str());
+  }
+}
+
+bool StreamSocketSink::Connect() {
+  const int64_t now = GetTimeNanoseconds();
+  if (now < next_attempt_) return false;
+  const sockaddr *addr = (const sockaddr *)&address_.addr;
+  fd_ = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+               0);
+  if (fd_ < 0) return false;
+
+  // Don't wait forever for hosts that don't answer at all.
+  int err = 0;
+  if (connect(fd_, addr, address_.len) < 0) {
+    err = errno;
+    if (err == EINPROGRESS) {
+      pollfd p = { fd_, POLLOUT, 0 };
+      if (poll(&p, 1, kConnectTimeoutMs) == 1) {
+        socklen_t err_len = sizeof(err);
+        getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &err_len);
+      } else {
+        err = ETIMEDOUT;
+      }
+    }
+  }
+  if (!err) {
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
+    const timeval timeout = { kSendTimeoutSeconds, 0 };
+    setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    iovec header = { (void *)file_header_.data(), file_header_.size() };
+    if (!SendAll(fd_, &header, 1)) err = errno;
+  }
+  if (err) {
+    close(fd_);
+    fd_ = -1;
+    if (!reported_down_) {
+      fprintf(stderr, "bidi-tee: can't connect to %s: %s; retrying\n",
+              address_.name.c_str(), strerror(err));
+      reported_down_ = true;
+    }
+    next_attempt_ = now + backoff_;
+    backoff_ = std::min(2 * backoff_, kMaxReconnectNs);
+    return false;
+  }
+  if (reported_down_) {
+    fprintf(stderr, "bidi-tee: connected to %s\n", address_.name.c_str());
+    reported_down_ = false;
+  }
+  backoff_ = kMinReconnectNs;
+  return true;
+}
+
+void StreamSocketSink::Disconnect() {
+  fprintf(stderr, "bidi-tee: lost connection to %s: %s; reconnecting\n",
+          address_.name.c_str(), strerror(errno));
+  close(fd_);
+  fd_ = -1;
+  reported_down_ = true;
+  next_attempt_ = 0;  // Retry right away, it might just have restarted.
+}
+
+void StreamSocketSink::Write(iovec *blocks, int count) {
+  const size_t size = TotalSize(blocks, count);
+  if (fd_ < 0 && !Connect()) {
+    lost_bytes_ += size;
+    return;
+  }
+  if (!SendAll(fd_, blocks, count)) {
+    // The rest of the record is lost; the next connection starts over
+    // with the file header.
+    lost_bytes_ += TotalSize(blocks, count);
+    Disconnect();
+  }
+}
+
+DatagramSink::~DatagramSink() {
+  close(fd_);
+  if (lost_bytes_) {
+    fprintf(stderr, "bidi-tee: %" PRIu64 " bytes could not be sent to %s\n",
+            lost_bytes_, address_.name.c_str());
+  }
+}
+
+void DatagramSink::Write(iovec *blocks, int count) {
+  const size_t size = TotalSize(blocks, count);
+  iovec datagram[8];
+  if (count + 1 > 8 || size > max_write_size()) {
+    lost_bytes_ += size;
+    return;
+  }
+  datagram[0].iov_base = (void *)file_header_.data();
+  datagram[0].iov_len = file_header_.size();
+  std::copy(blocks, blocks + count, datagram + 1);
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = datagram;
+  msg.msg_iovlen = count + 1;
+  ssize_t w;
+  do {
+    w = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+  } while (w < 0 && errno == EINTR);
+  if (w < 0) {
+    // E.g. ECONNREFUSED while nobody listens; later datagrams might be
+    // accepted again.
+    if (!reported_error_) {
+      fprintf(stderr, "bidi-tee: can't send to %s: %s\n",
+              address_.name.c_str(), strerror(errno));
+      reported_error_ = true;
+    }
+    lost_bytes_ += size;
+  }
+}
+
+bool IsNetworkAddress(const char *name) {
+  return strncmp(name, "tcp://", 6) == 0 || strncmp(name, "udp://", 6) == 0 ||
+    strncmp(name, "unix:", 5) == 0;
+}
+
+// Resolve "<host>:<port>"; the host might be a [bracketed] IPv6 address.
+static bool ResolveHostPort(const std::string &host_port, int socktype,
+                            Address *address) {
+  const size_t colon = host_port.rfind(':');
+  if (colon == std::string::npos || colon + 1 == host_port.size()) {
+    fprintf(stderr, "%s: expected <host>:<port>\n", address->name.c_str());
+    return false;
+  }
+  std::string host = host_port.substr(0, colon);
+  const std::string port = host_port.substr(colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = socktype;
+  addrinfo *result;
+  const int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", address->name.c_str(), gai_strerror(err));
+    return false;
+  }
+  memcpy(&address->addr, result->ai_addr, result->ai_addrlen);
+  address->len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+LogSink *CreateNetworkSink(const char *name) {
+  Address address;
+  address.name = name;
+  memset(&address.addr, 0, sizeof(address.addr));
+
+  if (strncmp(name, "unix:", 5) == 0) {
+    sockaddr_un *un = (sockaddr_un *)&address.addr;
+    const char *path = name + 5;
+    if (!*path || strlen(path) >= sizeof(un->sun_path)) {
+      fprintf(stderr, "%s: expected unix:<path> with a shorter path\n", name);
+      return nullptr;
+    }
+    un->sun_family = AF_UNIX;
+    strncpy(un->sun_path, path, sizeof(un->sun_path) - 1);
+    address.len = sizeof(sockaddr_un);
+    return new StreamSocketSink(address);
+  }
+
+  if (strncmp(name, "tcp://", 6) == 0) {
+    if (!ResolveHostPort(name + 6, SOCK_STREAM, &address)) return nullptr;
+    return new StreamSocketSink(address);
+  }
+
+  if (strncmp(name, "udp://", 6) == 0) {
+    std::string host_port = name + 6;
+    size_t datagram_size = kDefaultDatagramSize;
+    const size_t slash = host_port.find('/');
+    if (slash != std::string::npos) {
+      datagram_size = atoi(host_port.c_str() + slash + 1);
+      host_port.resize(slash);
+      if (datagram_size < kMinDatagramSize ||
+          datagram_size > kMaxDatagramSize) {
+        fprintf(stderr, "%s: datagram size needs to be %zu..%zu\n",
+                name, kMinDatagramSize, kMaxDatagramSize);
+        return nullptr;
+      }
+    }
+    if (!ResolveHostPort(host_port, SOCK_DGRAM, &address)) return nullptr;
+    const sockaddr *addr = (const sockaddr *)&address.addr;
+    const int fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, addr, address.len) < 0) {
+      perror(name);
+      if (fd >= 0) close(fd);
+      return nullptr;
+    }
+    return new DatagramSink(address, fd, datagram_size);
+  }
+
+  fprintf(stderr, "%s: not a tcp://, udp:// or unix: address\n", name);
+  return nullptr;
+}
@@ -0,0 +1,68 @@
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Where the encoded log goes: a file or a remote collector. Gets the file
+// header first, then blocks of whole records.
+class LogSink {
+public:
+  virtual ~LogSink() {}
+
+  // The file header, before anything else. Sinks that start over, e.g. on
+  // a new connection, send it again.
+  virtual void Begin(const std::string &file_header) {
+    iovec block = { (void *)file_header.data(), file_header.size() };
+    Write(&block, 1);
+  }
+
+  // Write all blocks. Might modify the iovecs.
+  virtual void Write(iovec *blocks, int count) = 0;
+
+  // Most bytes a single Write() can take; 0 if there is no limit.
+  virtual size_t max_write_size() const { return 0; }
+
+  // File descriptor that can be written to directly, -1 if there is none.
+  virtual int fd() const { return -1; }
+};
+
+// Writes to a file descriptor, which is closed at the end.
+class FdSink : public LogSink {
+public:
+  explicit FdSink(int fd) : fd_(fd) {}
+  ~FdSink() override;
+
+  void Write(iovec *blocks, int count) override;
+  int fd() const override { return fd_; }
+
+private:
+  const int fd_;
+};
+
+// Is this the address of a collector (see CreateNetworkSink()) instead of
+// a file name.
+bool IsNetworkAddress(const char *name);
+
+// Connect to a collector at "tcp://<host>:<port>", "unix:<path>" or
+// "udp://<host>:<port>[/<datagram-size>]". Prints what is wrong and returns
+// nullptr if the address is not valid; a collector that is not reachable
+// yet is not an error.
+//
+// On stream sockets, each connection gets the file header and from then on
+// whole records, so whatever a collector receives on one connection is a
+// complete log. If the connection breaks, data is discarded until it is
+// re-established, with increasing time between attempts. Sending blocks
+// until the collector takes the data, so this is meant to be behind an
+// AsyncLogWriter.
+//
+// With UDP, each datagram is a complete small log: the file header followed
+// by as many records as fit.
+LogSink *CreateNetworkSink(const char *address);
+
+#endif // LOG_SINK_H
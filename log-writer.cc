@@ -0,0 +1,521 @@
+#include "log-writer.h"
+
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "telemetry.h"
+
+// Room to leave in writes limited by the sink for record and frame
+// headers, and for compressed data growing a little.
+static size_t WriteLimitSlack(size_t max_write) {
+  return 2 * kMaxRecordHeaderSize + 64 + max_write / 128;
+}
+
+// Starts the sink, so that its limit includes the file header.
+static LogSink *BeginSink(LogSink *sink, const LogEncoder &encoder) {
+  sink->Begin(encoder.FileHeader());
+  return sink;
+}
+
+FileLogWriter::FileLogWriter(int fd, const LogEncoder &encoder,
+                             size_t buffer_size, int64_t flush_window_ns)
+  : FileLogWriter(std::unique_ptr<LogSink>(new FdSink(fd)), encoder,
+                  buffer_size, flush_window_ns) {
+}
+
+FileLogWriter::FileLogWriter(std::unique_ptr<LogSink> sink,
+                             const LogEncoder &encoder, size_t buffer_size,
+                             int64_t flush_window_ns)
+  : sink_(BeginSink(sink.release(), encoder)), encoder_(encoder),
+    max_block_size_(sink_->max_write_size()
+                    ? std::min(encoder_.max_block_size(),
+                               sink_->max_write_size()
+                               - WriteLimitSlack(sink_->max_write_size()))
+                    : encoder_.max_block_size()),
+    buffer_size_(sink_->max_write_size()
+                 ? std::min(buffer_size, max_block_size_ + kMaxRecordHeaderSize)
+                 : buffer_size),
+    flush_window_ns_(flush_window_ns),
+    buffer_(buffer_size_ ? new char[buffer_size_] : nullptr) {
+  written_ = encoder_.FileHeader().size();
+}
+
+FileLogWriter::~FileLogWriter() {
+  Flush();
+  delete [] buffer_;
+}
+
+void FileLogWriter::Append(const RecordHeader &header, const char *data) {
+  char encoded[kMaxRecordHeaderSize];
+  const size_t header_len = encoder_.EncodeHeader(header, encoded);
+  const size_t len = header.block_size;
+  const size_t record_size = header_len + len;
+  if (pending_ && (pending_ + record_size > buffer_size_ ||
+                   header.timestamp_ns >= flush_deadline_)) {
+    Flush();
+  }
+  if (index_) {
+    // Compressed records can only be found by the start of their frame.
+    const uint64_t offset = written_ + (compressor_ ? 0 : pending_);
+    index_->AddRecord(encoder_.WallclockNs(header.timestamp_ns), offset);
+  }
+  if (record_size <= buffer_size_) {
+    if (!pending_) {
+      flush_deadline_ = header.timestamp_ns + flush_window_ns_;
+      buffer_timestamp_ = header.timestamp_ns;
+    }
+    memcpy(buffer_ + pending_, encoded, header_len);
+    memcpy(buffer_ + pending_ + header_len, data, len);
+    pending_ += record_size;
+    if (header.channel_closed) Flush();
+    return;
+  }
+
+  // Not buffering or does not fit the buffer at all: write directly.
+  iovec block[2];
+  block[0].iov_base = encoded;
+  block[0].iov_len = header_len;
+  block[1].iov_base = const_cast<char *>(data);
+  block[1].iov_len = len;
+  WriteRecords(block, 2, header.timestamp_ns);
+}
+
+void FileLogWriter::Flush() {
+  if (pending_) {
+    iovec block = { buffer_, pending_ };
+    WriteRecords(&block, 1, buffer_timestamp_);
+    pending_ = 0;
+  }
+  if (index_) index_->Flush();
+}
+
+void FileLogWriter::WriteRecords(iovec *records, int count,
+                                 timestamp_t timestamp) {
+  if (!compressor_) {
+    for (int i = 0; i < count; ++i) written_ += records[i].iov_len;
+    WriteToSink(records, count);
+    return;
+  }
+
+  size_t uncompressed_size = 0;
+  for (int i = 0; i < count; ++i) uncompressed_size += records[i].iov_len;
+  compressor_->Compress(records, count, &compressed_);
+
+  char frame_header[30];  // Three varints.
+  size_t frame_header_len = PutVarint(
+    frame_header, (uint64_t)ExtensionType::kCompressedFrame);
+  frame_header_len += PutVarint(frame_header + frame_header_len,
+                                (uint64_t)compressor_->codec());
+  frame_header_len += PutVarint(frame_header + frame_header_len,
+                                uncompressed_size);
+
+  RecordHeader header;
+  header.timestamp_ns = timestamp;
+  header.block_size = frame_header_len + compressed_.size();
+  header.channel = 0;
+  header.channel_closed = false;
+  header.extension = true;
+  char encoded[kMaxRecordHeaderSize];
+  const size_t header_len = encoder_.EncodeHeader(header, encoded);
+
+  iovec block[3];
+  block[0].iov_base = encoded;
+  block[0].iov_len = header_len;
+  block[1].iov_base = frame_header;
+  block[1].iov_len = frame_header_len;
+  block[2].iov_base = &compressed_[0];
+  block[2].iov_len = compressed_.size();
+  WriteToSink(block, 3);
+  written_ += header_len + header.block_size;
+}
+
+void FileLogWriter::WriteToSink(iovec *blocks, int count) {
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  const timestamp_t start = telemetry ? GetTimeNanoseconds() : 0;
+  sink_->Write(blocks, count);
+  if (telemetry) telemetry->log_write_ns.Record(GetTimeNanoseconds() - start);
+}
+
+uint64_t FileLogWriter::max_size_after(size_t block_size) const {
+  uint64_t unwritten = pending_ + kMaxRecordHeaderSize + block_size;
+  if (compressor_) {
+    // Pending and new record might end up in separate frames, each of which
+    // can be slightly larger than its input.
+    unwritten += unwritten / 256 + 2 * (64 + kMaxRecordHeaderSize);
+  }
+  return written_ + unwritten;
+}
+
+// Any record has to fit into an empty part, with room to spare for the
+// overhead of compression.
+static size_t MaxBlockSize(uint64_t max_bytes, const FileLogWriter *empty) {
+  const size_t result = empty->max_block_size();
+  if (!max_bytes) return result;
+  const uint64_t overhead = empty->bytes_written() + 256 + (max_bytes >> 7);
+  return std::min<uint64_t>(result, max_bytes > overhead
+                            ? max_bytes - overhead : 1);
+}
+
+RotatingLogWriter *RotatingLogWriter::Create(uint64_t max_bytes,
+                                             int64_t max_age_ns,
+                                             OpenPart open_part,
+                                             PartWritten part_written,
+                                             PartDone part_done) {
+  FileLogWriter *first = open_part(0);
+  if (!first) return nullptr;
+  return new RotatingLogWriter(max_bytes, max_age_ns, open_part,
+                               part_written, part_done, first);
+}
+
+RotatingLogWriter::RotatingLogWriter(uint64_t max_bytes, int64_t max_age_ns,
+                                     OpenPart open_part,
+                                     PartWritten part_written,
+                                     PartDone part_done, FileLogWriter *first)
+  : max_bytes_(max_bytes), max_age_ns_(max_age_ns), open_part_(open_part),
+    part_written_(part_written), part_done_(part_done),
+    max_block_size_(MaxBlockSize(max_bytes, first)), current_(first) {
+  ReportWritten();
+}
+
+RotatingLogWriter::~RotatingLogWriter() {
+  current_->Flush();
+  ReportWritten();
+  current_.reset();
+  if (retire_thread_.joinable()) retire_thread_.join();
+}
+
+void RotatingLogWriter::ReportWritten() {
+  if (!part_written_ || current_->bytes_written() == reported_) return;
+  reported_ = current_->bytes_written();
+  part_written_(part_, reported_);
+}
+
+void RotatingLogWriter::Append(const RecordHeader &header, const char *data) {
+  if (part_empty_) {
+    part_start_ = header.timestamp_ns;
+  } else if (max_age_ns_ && header.timestamp_ns - part_start_ >= max_age_ns_) {
+    Rotate(header.timestamp_ns);
+  } else if (max_bytes_ &&
+             current_->max_size_after(header.block_size) > max_bytes_) {
+    // Compressed, the pending records might need much less room than
+    // estimated; see what is really left before giving up on this part.
+    current_->Flush();
+    ReportWritten();
+    if (current_->max_size_after(header.block_size) > max_bytes_) {
+      Rotate(header.timestamp_ns);
+    }
+  }
+  current_->Append(header, data);
+  part_empty_ = false;
+  ReportWritten();
+}
+
+void RotatingLogWriter::Flush() {
+  current_->Flush();
+  ReportWritten();
+}
+
+void RotatingLogWriter::Rotate(timestamp_t timestamp) {
+  // Parts might share the file position, so the current one has to be done
+  // writing before the next one is set up.
+  current_->Flush();
+  ReportWritten();
+  FileLogWriter *next = open_part_(part_ + 1);
+  if (!next) {
+    // Better to keep writing the current part than to lose records.
+    if (!open_failed_) perror("bidi-tee: could not start next part of log");
+    open_failed_ = true;
+    part_start_ = timestamp;
+    return;
+  }
+
+  // Only one part is closed at a time; by now, the previous is long done.
+  if (retire_thread_.joinable()) retire_thread_.join();
+  FileLogWriter *old = current_.release();
+  const uint64_t old_part = part_;
+  const PartDone part_done = part_done_;
+  retire_thread_ = std::thread([old, old_part, part_done]() {
+    delete old;
+    if (part_done) part_done(old_part);
+  });
+
+  current_.reset(next);
+  ++part_;
+  part_empty_ = true;
+  part_start_ = timestamp;
+  reported_ = 0;
+  open_failed_ = false;
+  ReportWritten();
+}
+
+static size_t RoundUpPowerOfTwo(size_t v) {
+  size_t result = 1;
+  while (result < v) result <<= 1;
+  return result;
+}
+
+static constexpr size_t kEntryAlign = 8;
+static size_t AlignEntry(size_t v) {
+  return (v + kEntryAlign - 1) & ~(kEntryAlign - 1);
+}
+
+// The ring has to be able to hold a couple of maximum size records.
+static constexpr size_t kMaxRingRecord = 256 << 10;
+static constexpr size_t kMinRingSize = 4 * kMaxRingRecord;
+
+AsyncLogWriter::AsyncLogWriter(std::unique_ptr<LogWriter> delegate,
+                               size_t ring_size, FullPolicy policy)
+  : delegate_(std::move(delegate)), policy_(policy),
+    capacity_(RoundUpPowerOfTwo(std::max(ring_size, kMinRingSize))),
+    ring_(new char[capacity_]) {
+  thread_ = std::thread(&AsyncLogWriter::Run, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    exit_requested_ = true;
+    data_available_.notify_one();
+  }
+  thread_.join();
+  delete [] ring_;
+  if (dropped_records_) {
+    fprintf(stderr, "bidi-tee: log writer could not keep up; dropped "
+            "%" PRIu64 " records (%" PRIu64 " bytes)\n",
+            dropped_records_, dropped_bytes_);
+  }
+}
+
+size_t AsyncLogWriter::max_block_size() const {
+  return std::min(delegate_->max_block_size(), kMaxRingRecord);
+}
+
+void AsyncLogWriter::Append(const RecordHeader &header, const char *data) {
+  ThreadTelemetry *telemetry = GetThreadTelemetry();
+  if (telemetry) {
+    telemetry->async_queue.Record(head_.load(std::memory_order_relaxed) -
+                                  tail_.load(std::memory_order_relaxed));
+  }
+  if (!spilling_.load(std::memory_order_acquire) &&
+      TryPushRing(header, data)) {
+    WakeWriter();
+    return;
+  }
+
+  switch (policy_) {
+  case FullPolicy::kBlock:
+    PushBlocking(header, data);
+    break;
+  case FullPolicy::kDrop:
+    ++dropped_records_;
+    dropped_bytes_ += header.block_size;
+    return;
+  case FullPolicy::kSpill:
+    PushSpill(header, data);
+    break;
+  }
+  WakeWriter();
+}
+
+void AsyncLogWriter::Flush() {
+  std::unique_lock<std::mutex> l(mutex_);
+  flush_requested_ = true;
+  data_available_.notify_one();
+  drained_.wait(l, [this]() {
+    return !flush_requested_ && writer_idle_ && spill_.empty() &&
+      tail_.load(std::memory_order_acquire) ==
+      head_.load(std::memory_order_acquire);
+  });
+}
+
+bool AsyncLogWriter::TryPushRing(const RecordHeader &header,
+                                 const char *data) {
+  const size_t len = header.block_size;
+  const size_t entry_size = AlignEntry(sizeof(EntryPrefix) + sizeof(header)
+                                       + len);
+  uint64_t head = head_.load(std::memory_order_relaxed);
+  const uint64_t tail = tail_.load(std::memory_order_seq_cst);
+  size_t pos = head & (capacity_ - 1);
+  const size_t to_end = capacity_ - pos;
+
+  // Entries are never split around the end of the ring; if it does not fit
+  // anymore, the rest is skipped.
+  const size_t needed = entry_size + (to_end < entry_size ? to_end : 0);
+  if (capacity_ - (head - tail) < needed)
+    return false;
+
+  if (to_end < entry_size) {
+    const EntryPrefix wrap = { kWrapMarker, 0 };
+    memcpy(ring_ + pos, &wrap, sizeof(wrap));
+    head += to_end;
+    pos = 0;
+  }
+  const EntryPrefix prefix = { (uint32_t)entry_size, 0 };
+  char *entry = ring_ + pos;
+  memcpy(entry, &prefix, sizeof(prefix));
+  memcpy(entry + sizeof(prefix), &header, sizeof(header));
+  memcpy(entry + sizeof(prefix) + sizeof(header), data, len);
+  head_.store(head + entry_size, std::memory_order_seq_cst);
+  return true;
+}
+
+void AsyncLogWriter::PushBlocking(const RecordHeader &header,
+                                  const char *data) {
+  std::unique_lock<std::mutex> l(mutex_);
+  for (;;) {
+    producer_waiting_.store(true, std::memory_order_seq_cst);
+    if (TryPushRing(header, data)) break;
+    space_available_.wait(l);
+  }
+  producer_waiting_.store(false, std::memory_order_relaxed);
+}
+
+void AsyncLogWriter::PushSpill(const RecordHeader &header,
+                               const char *data) {
+  std::string entry;
+  entry.reserve(sizeof(header) + header.block_size);
+  entry.append((const char *)&header, sizeof(header));
+  entry.append(data, header.block_size);
+  std::lock_guard<std::mutex> l(mutex_);
+  spilling_.store(true, std::memory_order_release);
+  spill_.emplace_back(std::move(entry));
+}
+
+void AsyncLogWriter::WakeWriter() {
+  if (writer_waiting_.load(std::memory_order_seq_cst)) {
+    std::lock_guard<std::mutex> l(mutex_);
+    data_available_.notify_one();
+  }
+}
+
+size_t AsyncLogWriter::DrainRing() {
+  size_t count = 0;
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  while (tail != head) {
+    const size_t pos = tail & (capacity_ - 1);
+    EntryPrefix prefix;
+    memcpy(&prefix, ring_ + pos, sizeof(prefix));
+    if (prefix.entry_size == kWrapMarker) {
+      tail += capacity_ - pos;
+      continue;
+    }
+    RecordHeader header;
+    memcpy(&header, ring_ + pos + sizeof(prefix), sizeof(header));
+    delegate_->Append(header, ring_ + pos + sizeof(prefix) + sizeof(header));
+    tail += prefix.entry_size;
+    ++count;
+
+    // Free up space as we go, the producer might be waiting for it.
+    tail_.store(tail, std::memory_order_seq_cst);
+    if (producer_waiting_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> l(mutex_);
+      space_available_.notify_one();
+    }
+  }
+  return count;
+}
+
+size_t AsyncLogWriter::DrainSpill() {
+  std::deque<std::string> pending;
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    // Spilled records are newer than what is still in the ring.
+    if (head_.load(std::memory_order_acquire) !=
+        tail_.load(std::memory_order_relaxed)) {
+      return 0;
+    }
+    if (spill_.empty()) {
+      // Ring is drained and nothing spilled since: back to normal.
+      spilling_.store(false, std::memory_order_release);
+      return 0;
+    }
+    pending.swap(spill_);
+  }
+  for (const std::string &entry : pending) {
+    RecordHeader header;
+    memcpy(&header, entry.data(), sizeof(header));
+    delegate_->Append(header, entry.data() + sizeof(header));
+  }
+  return pending.size();
+}
+
+void AsyncLogWriter::Run() {
+  for (;;) {
+    size_t written = DrainRing();
+    written += DrainSpill();
+    if (written > 0) continue;
+
+    // All caught up. Flush what the delegate buffered if asked for or due.
+    bool flush;
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      flush = flush_requested_;
+    }
+    if (flush) {
+      delegate_->Flush();
+    } else {
+      delegate_->FlushIfDue(GetTimeNanoseconds());
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    writer_waiting_.store(true, std::memory_order_seq_cst);
+    const bool empty = spill_.empty() &&
+      head_.load(std::memory_order_seq_cst) ==
+      tail_.load(std::memory_order_relaxed);
+    if (empty) {
+      if (exit_requested_) break;
+      if (flush) flush_requested_ = false;
+      if (!flush_requested_) {
+        writer_idle_ = true;
+        drained_.notify_all();
+        const timestamp_t deadline = delegate_->flush_deadline();
+        if (deadline >= 0) {
+          const int64_t wait_ns = deadline - GetTimeNanoseconds();
+          data_available_.wait_for(l, std::chrono::nanoseconds(
+                                     std::max<int64_t>(wait_ns, 0)));
+        } else {
+          data_available_.wait(l);
+        }
+        writer_idle_ = false;
+      }
+    }
+    writer_waiting_.store(false, std::memory_order_relaxed);
+  }
+  delegate_->Flush();
+}
+
+FramingLogWriter::FramingLogWriter(std::unique_ptr<LogWriter> delegate,
+                                   Framing framing, uint16_t channels)
+  : delegate_(std::move(delegate)), framer_(framing, channels),
+    pass_([this](const RecordHeader &header, const char *data) {
+      Pass(header, data);
+    }) {
+}
+
+FramingLogWriter::~FramingLogWriter() {
+  framer_.Finish(last_timestamp_, pass_);
+}
+
+void FramingLogWriter::Append(const RecordHeader &header, const char *data) {
+  last_timestamp_ = header.timestamp_ns;
+  framer_.Process(header, data, pass_);
+}
+
+void FramingLogWriter::Pass(const RecordHeader &header, const char *data) {
+  const size_t max_size = delegate_->max_block_size();
+  if (header.block_size <= max_size) {
+    delegate_->Append(header, data);
+    return;
+  }
+  RecordHeader piece = header;
+  for (size_t done = 0; done < header.block_size; done += piece.block_size) {
+    piece.block_size = std::min(max_size, header.block_size - done);
+    delegate_->Append(piece, data + done);
+  }
+}
@@ -0,0 +1,279 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "block-header.h"
+#include "clock.h"
+#include "log-compression.h"
+#include "log-format.h"
+#include "log-index.h"
+#include "log-sink.h"
+#include "message-framer.h"
+
+// Receives the records to be logged. Implementations either write them
+// out directly or pass them on to another LogWriter.
+class LogWriter {
+public:
+  virtual ~LogWriter() {}
+
+  // Log the given header and its block_size bytes of payload. The data
+  // only needs to be valid for the duration of the call.
+  virtual void Append(const RecordHeader &header, const char *data) = 0;
+
+  // Largest block_size a record can have.
+  virtual size_t max_block_size() const = 0;
+
+  // Make sure all records so far are written to the sink.
+  virtual void Flush() {}
+
+  // If records are buffered, the time by which Flush() should be called
+  // at the latest; -1 if nothing is pending.
+  virtual timestamp_t flush_deadline() const { return -1; }
+
+  void FlushIfDue(timestamp_t now) {
+    const timestamp_t deadline = flush_deadline();
+    if (deadline >= 0 && now >= deadline) Flush();
+  }
+
+  // If records can be written to by bypassing this writer (e.g. by
+  // splice()-ing into it), the file descriptor to do so; -1 otherwise.
+  virtual int direct_fd() const { return -1; }
+
+  // The encoding records written to direct_fd() have to be in.
+  virtual const LogEncoder *encoder() const { return nullptr; }
+};
+
+// Synchronously writes records to a file descriptor or another sink,
+// starting with the file header. With a buffer_size, records are coalesced
+// into a buffer that is written when full, when a channel closes or after
+// flush_window_ns. With a compressor, each buffer written is a compressed
+// frame. If the sink limits the size of writes, so are buffer and records.
+class FileLogWriter : public LogWriter {
+public:
+  FileLogWriter(int fd, const LogEncoder &encoder, size_t buffer_size = 0,
+                int64_t flush_window_ns = 0);
+  FileLogWriter(std::unique_ptr<LogSink> sink, const LogEncoder &encoder,
+                size_t buffer_size = 0, int64_t flush_window_ns = 0);
+  ~FileLogWriter() override;
+
+  void Append(const RecordHeader &header, const char *data) override;
+  size_t max_block_size() const override { return max_block_size_; }
+  void Flush() override;
+  timestamp_t flush_deadline() const override {
+    return pending_ ? flush_deadline_ : -1;
+  }
+
+  // Maintain a time index of the log while writing it.
+  void SetIndex(std::unique_ptr<LogIndexWriter> index) {
+    index_ = std::move(index);
+  }
+
+  // Compress records in frames; needs a buffer_size to be useful.
+  void SetCompressor(std::unique_ptr<Compressor> compressor) {
+    compressor_ = std::move(compressor);
+  }
+
+  // Buffered records would be overtaken by direct writes, and the index
+  // and compression need to see every record.
+  int direct_fd() const override {
+    return (buffer_size_ || index_ || compressor_) ? -1 : sink_->fd();
+  }
+  const LogEncoder *encoder() const override { return &encoder_; }
+
+  // Bytes written to the file so far, including the file header.
+  uint64_t bytes_written() const { return written_; }
+
+  // Upper bound of the file size once a record of block_size is appended
+  // and everything is flushed.
+  uint64_t max_size_after(size_t block_size) const;
+
+private:
+  // Write encoded records out, as a compressed frame if configured.
+  void WriteRecords(iovec *records, int count, timestamp_t timestamp);
+  void WriteToSink(iovec *blocks, int count);
+
+  const std::unique_ptr<LogSink> sink_;
+  const LogEncoder encoder_;
+  const size_t max_block_size_;
+  const size_t buffer_size_;
+  const int64_t flush_window_ns_;
+  char *const buffer_;
+  size_t pending_ = 0;
+  timestamp_t flush_deadline_ = -1;
+  timestamp_t buffer_timestamp_ = 0;  // Of first record in buffer.
+  std::unique_ptr<LogIndexWriter> index_;
+  std::unique_ptr<Compressor> compressor_;
+  std::string compressed_;
+  uint64_t written_ = 0;  // Bytes written to the sink so far.
+};
+
+// Splits the log into parts, each written by its own FileLogWriter, e.g.
+// into rotated files or the slots of a ring file. A new part is started
+// before the current one would grow beyond max_bytes or when it is older
+// than max_age_ns. The old part is flushed, but closing it (and whatever
+// the part_done callback does, e.g. deleting old files) happens in a
+// separate thread.
+class RotatingLogWriter : public LogWriter {
+public:
+  // Create the writer for the given part; nullptr on failure.
+  using OpenPart = std::function<FileLogWriter *(uint64_t part)>;
+  // Called whenever the part wrote more.
+  using PartWritten = std::function<void(uint64_t part, uint64_t bytes)>;
+  // Called in the background once the part is closed after the next one
+  // was started.
+  using PartDone = std::function<void(uint64_t part)>;
+
+  // Returns nullptr if the first part can't be opened.
+  static RotatingLogWriter *Create(uint64_t max_bytes, int64_t max_age_ns,
+                                   OpenPart open_part,
+                                   PartWritten part_written = nullptr,
+                                   PartDone part_done = nullptr);
+  ~RotatingLogWriter() override;
+
+  void Append(const RecordHeader &header, const char *data) override;
+  // Might be asked from other threads, so does not depend on current_.
+  size_t max_block_size() const override { return max_block_size_; }
+  void Flush() override;
+  timestamp_t flush_deadline() const override {
+    return current_->flush_deadline();
+  }
+
+private:
+  RotatingLogWriter(uint64_t max_bytes, int64_t max_age_ns,
+                    OpenPart open_part, PartWritten part_written,
+                    PartDone part_done, FileLogWriter *first);
+
+  void Rotate(timestamp_t timestamp);
+  void ReportWritten();
+
+  const uint64_t max_bytes_;
+  const int64_t max_age_ns_;
+  const OpenPart open_part_;
+  const PartWritten part_written_;
+  const PartDone part_done_;
+  const size_t max_block_size_;
+
+  std::unique_ptr<FileLogWriter> current_;
+  uint64_t part_ = 0;
+  bool part_empty_ = true;
+  timestamp_t part_start_ = 0;
+  uint64_t reported_ = 0;
+  bool open_failed_ = false;  // Reported already.
+  std::thread retire_thread_;
+};
+
+// Logs whole messages instead of whatever each read() returned: records of
+// the framed channels are reassembled into one record per message before
+// they are passed on to the delegate. Messages larger than the delegate
+// can take in one record are split.
+class FramingLogWriter : public LogWriter {
+public:
+  FramingLogWriter(std::unique_ptr<LogWriter> delegate, Framing framing,
+                   uint16_t channels);
+  ~FramingLogWriter() override;  // Logs incomplete messages.
+
+  void Append(const RecordHeader &header, const char *data) override;
+  size_t max_block_size() const override {
+    return delegate_->max_block_size();
+  }
+  void Flush() override { delegate_->Flush(); }
+  timestamp_t flush_deadline() const override {
+    return delegate_->flush_deadline();
+  }
+
+private:
+  void Pass(const RecordHeader &header, const char *data);
+
+  std::unique_ptr<LogWriter> delegate_;
+  RecordFramer framer_;
+  const RecordFramer::Emit pass_;
+  timestamp_t last_timestamp_ = 0;
+};
+
+// Takes records on the forwarding path and hands them via a lock-free
+// single-producer/single-consumer ring to a separate thread that passes
+// them on to the slower delegate. Any thread can be the producer, but only
+// one at a time.
+class AsyncLogWriter : public LogWriter {
+public:
+  // What to do with a record if the ring is full.
+  enum class FullPolicy {
+    kBlock,  // Wait for the writer thread to make room.
+    kDrop,   // Discard the record and count it.
+    kSpill,  // Queue it in an unbounded in-memory overflow.
+  };
+
+  AsyncLogWriter(std::unique_ptr<LogWriter> delegate, size_t ring_size,
+                 FullPolicy policy);
+  ~AsyncLogWriter() override;  // Drains all pending records.
+
+  void Append(const RecordHeader &header, const char *data) override;
+  size_t max_block_size() const override;
+  void Flush() override;
+
+  uint64_t dropped_records() const { return dropped_records_; }
+  uint64_t dropped_bytes() const { return dropped_bytes_; }
+
+private:
+  // Every record in the ring is prefixed by the size (header+payload+
+  // padding) to get to the next entry.
+  struct EntryPrefix {
+    uint32_t entry_size;
+    uint32_t unused;
+  };
+  static constexpr uint32_t kWrapMarker = 0xffffffff;
+
+  bool TryPushRing(const RecordHeader &header, const char *data);
+  void PushBlocking(const RecordHeader &header, const char *data);
+  void PushSpill(const RecordHeader &header, const char *data);
+  void WakeWriter();
+
+  // Writer thread: drain ring, then spill; return number of records.
+  size_t DrainRing();
+  size_t DrainSpill();
+  void Run();
+
+  std::unique_ptr<LogWriter> delegate_;
+  const FullPolicy policy_;
+  const size_t capacity_;  // Power of two.
+  char *const ring_;
+
+  // Monotonically increasing byte positions; index into ring & mask.
+  std::atomic<uint64_t> head_{0};   // Written by producer.
+  std::atomic<uint64_t> tail_{0};   // Written by writer thread.
+
+  // Only used for sleeping and waking up, not on the fast path.
+  std::mutex mutex_;
+  std::condition_variable data_available_;
+  std::condition_variable space_available_;
+  std::condition_variable drained_;
+  std::atomic<bool> writer_waiting_{false};
+  std::atomic<bool> producer_waiting_{false};
+  bool writer_idle_ = false;
+  bool flush_requested_ = false;
+  bool exit_requested_ = false;
+
+  // Once the ring overflowed in kSpill policy, all records go to the spill
+  // queue until the writer thread caught up, so that order is preserved.
+  std::atomic<bool> spilling_{false};
+  std::deque<std::string> spill_;  // Guarded by mutex_.
+
+  uint64_t dropped_records_ = 0;
+  uint64_t dropped_bytes_ = 0;
+
+  std::thread thread_;
+};
+
+#endif // LOG_WRITER_H
@@ -0,0 +1,166 @@
+#include "message-framer.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "newline-scan.h"
+#include "substring-search.h"
+
+bool ParseFramingName(const char *name, Framing *framing) {
+  if (strcmp(name, "newline") == 0) {
+    *framing = Framing::kNewline;
+  } else if (strcmp(name, "content-length") == 0) {
+    *framing = Framing::kContentLength;
+  } else if (strcmp(name, "length32") == 0) {
+    *framing = Framing::kLengthPrefix;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Value of the Content-Length header in the headers [begin, end), or -1.
+static int64_t ContentLength(const char *begin, const char *end) {
+  static constexpr char kHeader[] = "Content-Length:";
+  static constexpr size_t kHeaderLen = sizeof(kHeader) - 1;
+  for (const char *line = begin; line < end; /**/) {
+    const char *eol = FindNewline(line, end);
+    if (!eol) eol = end;
+    if ((size_t)(eol - line) > kHeaderLen &&
+        strncasecmp(line, kHeader, kHeaderLen) == 0) {
+      const char *value = line + kHeaderLen;
+      while (value < eol && *value == ' ') ++value;
+      int64_t result = 0;
+      bool any = false;
+      for (/**/; value < eol && *value >= '0' && *value <= '9'; ++value) {
+        result = result * 10 + (*value - '0');
+        if (result > (int64_t)MessageFramer::kMaxMessageSize) return -1;
+        any = true;
+      }
+      return any ? result : -1;
+    }
+    line = eol + 1;
+  }
+  return -1;
+}
+
+size_t MessageFramer::MessageLength(const char *data, size_t len,
+                                    size_t scanned) const {
+  switch (framing_) {
+  case Framing::kNone:
+    return len;
+  case Framing::kNewline: {
+    const char *eol = FindNewline(data + scanned, data + len);
+    if (eol) return eol - data + 1;
+    return len >= kMaxMessageSize ? len : 0;
+  }
+  case Framing::kContentLength: {
+    // The separator can straddle what was scanned before and what's new.
+    const size_t from = scanned > 3 ? scanned - 3 : 0;
+    const char *header_end = FindSubstring(data + from, data + len,
+                                           "\r\n\r\n", 4);
+    if (!header_end) return len >= kMaxHeaderSize ? len : 0;
+    const size_t header_len = header_end - data + 4;
+    const int64_t body_len = ContentLength(data, header_end);
+    return header_len + (body_len > 0 ? body_len : 0);
+  }
+  case Framing::kLengthPrefix: {
+    if (len < 4) return 0;
+    const uint32_t body_len = ((uint32_t)(uint8_t)data[0] << 24)
+      | ((uint32_t)(uint8_t)data[1] << 16) | ((uint32_t)(uint8_t)data[2] << 8)
+      | (uint32_t)(uint8_t)data[3];
+    if (body_len > kMaxMessageSize) return len;  // Not our framing.
+    return 4 + (size_t)body_len;
+  }
+  }
+  return len;
+}
+
+void MessageFramer::Feed(const char *data, size_t len, const Emit &emit) {
+  while (len > 0) {
+    if (pending_.empty()) {
+      const size_t n = MessageLength(data, len, 0);
+      if (n && n <= len) {
+        emit(data, n);
+        data += n;
+        len -= n;
+        continue;
+      }
+      pending_.assign(data, len);
+      need_ = n;
+      return;
+    }
+
+    if (!need_) {
+      // Only now we might learn the length; take what we need of the new
+      // data, the rest is to be looked at on its own.
+      const size_t scanned = pending_.size();
+      pending_.append(data, len);
+      need_ = MessageLength(pending_.data(), pending_.size(), scanned);
+      if (!need_) return;
+      pending_.resize(std::min(need_, pending_.size()));
+      const size_t used = pending_.size() - scanned;
+      data += used;
+      len -= used;
+    } else {
+      const size_t used = std::min(need_ - pending_.size(), len);
+      pending_.append(data, used);
+      data += used;
+      len -= used;
+    }
+    if (pending_.size() == need_) {
+      emit(pending_.data(), pending_.size());
+      pending_.clear();
+      need_ = 0;
+    }
+  }
+}
+
+void MessageFramer::Finish(const Emit &emit) {
+  if (!pending_.empty()) emit(pending_.data(), pending_.size());
+  pending_.clear();
+  need_ = 0;
+}
+
+RecordFramer::RecordFramer(Framing framing, uint16_t channels)
+  : channels_(channels), framers_(16, MessageFramer(framing)) {
+}
+
+void RecordFramer::Process(const RecordHeader &header, const char *data,
+                           const Emit &emit) {
+  if (header.extension || !((channels_ >> (header.channel & 0x0f)) & 1)) {
+    emit(header, data);
+    return;
+  }
+  RecordHeader message = header;
+  message.channel_closed = false;
+  const MessageFramer::Emit emit_message =
+    [&message, &emit](const char *data, size_t len) {
+      message.block_size = len;
+      emit(message, data);
+    };
+  MessageFramer &framer = framers_[header.channel & 0x0f];
+  framer.Feed(data, header.block_size, emit_message);
+  if (header.channel_closed) {
+    framer.Finish(emit_message);
+    message.block_size = 0;
+    message.channel_closed = true;
+    emit(message, data);
+  }
+}
+
+void RecordFramer::Finish(int64_t timestamp, const Emit &emit) {
+  RecordHeader message;
+  memset(&message, 0, sizeof(message));
+  message.timestamp_ns = timestamp;
+  for (size_t i = 0; i < framers_.size(); ++i) {
+    message.channel = i;
+    framers_[i].Finish([&message, &emit](const char *data, size_t len) {
+      message.block_size = len;
+      emit(message, data);
+    });
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef MESSAGE_FRAMER_H
+#define MESSAGE_FRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "block-header.h"
+
+// How messages are delimited in a byte stream.
+enum class Framing {
+  kNone,
+  kNewline,        // Each line is a message.
+  kContentLength,  // Headers, "Content-Length: <n>", empty line, n bytes
+                   // body, as in LSP. The message includes the headers.
+  kLengthPrefix,   // uint32 big endian length, then that many bytes. The
+                   // message includes the prefix.
+};
+
+// Parse "newline", "content-length" or "length32". Returns false if unknown.
+bool ParseFramingName(const char *name, Framing *framing);
+
+// Reassembles messages from a stream fed in arbitrary pieces. Messages
+// entirely in one piece are passed on without copying; only the start of
+// those spanning pieces is kept, in a buffer reused for all messages.
+// If the stream does not follow the framing (e.g. no header end within
+// kMaxHeaderSize), what is there is passed on unframed.
+class MessageFramer {
+public:
+  // Called with a complete message, valid only for the duration of the call.
+  using Emit = std::function<void(const char *data, size_t len)>;
+
+  static constexpr size_t kMaxHeaderSize = 4096;
+  static constexpr size_t kMaxMessageSize = 256 << 20;
+
+  explicit MessageFramer(Framing framing) : framing_(framing) {}
+
+  // Feed the next piece of the stream.
+  void Feed(const char *data, size_t len, const Emit &emit);
+
+  // Pass on what is left of an incomplete message, e.g. at the end of the
+  // stream.
+  void Finish(const Emit &emit);
+
+private:
+  // Length of the message at the start of data, if it can be determined
+  // from the len bytes available, or 0. The first "scanned" bytes have
+  // been looked at before without finding the end of the header.
+  size_t MessageLength(const char *data, size_t len, size_t scanned) const;
+
+  const Framing framing_;
+  std::string pending_;  // Start of a message spanning pieces.
+  size_t need_ = 0;      // Length of that message, if already known.
+};
+
+// Turns the records of the selected channels into records of one whole
+// message each; records of other channels are passed through. A message
+// gets the timestamp of the record that completes it. When a channel
+// closes, an incomplete message is passed on before the closing record.
+class RecordFramer {
+public:
+  using Emit = std::function<void(const RecordHeader &header,
+                                  const char *data)>;
+
+  RecordFramer(Framing framing, uint16_t channels);
+
+  void Process(const RecordHeader &header, const char *data,
+               const Emit &emit);
+
+  // Pass on the incomplete messages of all channels.
+  void Finish(int64_t timestamp, const Emit &emit);
+
+private:
+  const uint16_t channels_;
+  std::vector<MessageFramer> framers_;  // One per channel.
+};
+
+#endif // MESSAGE_FRAMER_H
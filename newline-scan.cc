@@ -0,0 +1,82 @@
+#include "newline-scan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+static const char *FindNewlineScalar(const char *pos, const char *end) {
+  return (const char *)memchr(pos, '\n', end - pos);
+}
+
+#if defined(__SSE2__)
+static const char *FindNewlineSSE2(const char *pos, const char *end) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (/**/; end - pos >= 16; pos += 16) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)pos);
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (mask) return pos + __builtin_ctz(mask);
+  }
+  return FindNewlineScalar(pos, end);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NEWLINE_SCAN_AVX2 1
+__attribute__((target("avx2")))
+static const char *FindNewlineAVX2(const char *pos, const char *end) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  // Two vectors at a time; most payload lines are longer than that.
+  for (/**/; end - pos >= 64; pos += 64) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)pos);
+    const __m256i b = _mm256_loadu_si256((const __m256i *)(pos + 32));
+    const __m256i eq_a = _mm256_cmpeq_epi8(a, newline);
+    const __m256i eq_b = _mm256_cmpeq_epi8(b, newline);
+    if (_mm256_testz_si256(_mm256_or_si256(eq_a, eq_b),
+                           _mm256_or_si256(eq_a, eq_b))) {
+      continue;
+    }
+    const uint64_t mask = (uint32_t)_mm256_movemask_epi8(eq_a)
+      | (uint64_t)(uint32_t)_mm256_movemask_epi8(eq_b) << 32;
+    return pos + __builtin_ctzll(mask);
+  }
+  return FindNewlineSSE2(pos, end);
+}
+#endif
+
+#elif defined(__ARM_NEON)
+static const char *FindNewlineNEON(const char *pos, const char *end) {
+  const uint8x16_t newline = vdupq_n_u8('\n');
+  for (/**/; end - pos >= 16; pos += 16) {
+    const uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)pos), newline);
+    // Narrow each byte of the comparison to four bits of a 64 bit mask.
+    const uint64_t mask = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    if (mask) return pos + (__builtin_ctzll(mask) >> 2);
+  }
+  return FindNewlineScalar(pos, end);
+}
+#endif
+
+typedef const char *(*FindNewlineFun)(const char *, const char *);
+
+static FindNewlineFun ChooseImplementation() {
+#if defined(NEWLINE_SCAN_AVX2)
+  if (__builtin_cpu_supports("avx2")) return FindNewlineAVX2;
+#endif
+#if defined(__SSE2__)
+  return FindNewlineSSE2;
+#elif defined(__ARM_NEON)
+  return FindNewlineNEON;
+#else
+  return FindNewlineScalar;
+#endif
+}
+
+const char *FindNewline(const char *begin, const char *end) {
+  static const FindNewlineFun implementation = ChooseImplementation();
+  return implementation(begin, end);
+}
@@ -0,0 +1,8 @@
+#ifndef NEWLINE_SCAN_H
+#define NEWLINE_SCAN_H
+
+// Returns pointer to the first '\n' in [begin, end) or nullptr if there
+// is none. Vectorized with AVX2, SSE2 or NEON, whatever the CPU supports.
+const char *FindNewline(const char *begin, const char *end);
+
+#endif // NEWLINE_SCAN_H
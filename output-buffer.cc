@@ -0,0 +1,79 @@
+#include "output-buffer.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+OutputBuffer::OutputBuffer(int fd, size_t capacity)
+  : fd_(fd), sink_(nullptr), capacity_(capacity), buffer_(new char[capacity]) {
+}
+
+OutputBuffer::OutputBuffer(std::string *sink, size_t capacity)
+  : fd_(-1), sink_(sink), capacity_(capacity), buffer_(new char[capacity]) {
+}
+
+OutputBuffer::~OutputBuffer() {
+  Flush();
+  delete [] buffer_;
+}
+
+void OutputBuffer::AppendSlowPath(const char *data, size_t len) {
+  Flush();
+  if (len < capacity_) {
+    memcpy(buffer_, data, len);
+    pending_ = len;
+    return;
+  }
+  // Large chunks are written directly without copying.
+  WriteOut(data, len);
+}
+
+void OutputBuffer::WriteOut(const char *data, size_t len) {
+  if (sink_) {
+    sink_->append(data, len);
+    return;
+  }
+  while (len > 0 && !failed_) {
+    const ssize_t w = write(fd_, data, len);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      failed_ = true;
+      break;
+    }
+    data += w;
+    len -= w;
+  }
+}
+
+void OutputBuffer::AppendNumber(uint64_t value, int width, char pad) {
+  char digits[20];
+  int len = 0;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  if (capacity_ - pending_ < (size_t)(width + len)) Flush();
+  for (int i = len; i < width; ++i) buffer_[pending_++] = pad;
+  while (len) buffer_[pending_++] = digits[--len];
+}
+
+void OutputBuffer::AppendDateTime(int64_t timestamp_ns) {
+  const int64_t second = timestamp_ns / 1000000000;
+  if (second != cached_second_) {
+    const time_t t = second;
+    struct tm prdate;
+    localtime_r(&t, &prdate);
+    cached_datetime_len_ = strftime(cached_datetime_, sizeof(cached_datetime_),
+                                    "%Y-%m-%d %H:%M:%S", &prdate);
+    cached_second_ = second;
+  }
+  Append(cached_datetime_, cached_datetime_len_);
+  Append('.');
+  AppendNumber(timestamp_ns % 1000000000, 9, '0');
+}
+
+void OutputBuffer::Flush() {
+  WriteOut(buffer_, pending_);
+  pending_ = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Collects formatted output in a large buffer that is written to a file
+// descriptor with few write() calls. Numbers are formatted by hand, which
+// is a lot faster than going through printf().
+class OutputBuffer {
+public:
+  explicit OutputBuffer(int fd, size_t capacity = 1 << 20);
+
+  // Collect all output in memory in sink instead.
+  explicit OutputBuffer(std::string *sink, size_t capacity = 1 << 16);
+  ~OutputBuffer();  // Flushes.
+
+  void Append(const char *data, size_t len) {
+    if (len > capacity_ - pending_) {
+      AppendSlowPath(data, len);
+      return;
+    }
+    memcpy(buffer_ + pending_, data, len);
+    pending_ += len;
+  }
+  void Append(const char *str) { Append(str, strlen(str)); }
+  void Append(char c) {
+    if (pending_ == capacity_) Flush();
+    buffer_[pending_++] = c;
+  }
+
+  // Decimal value, right-aligned to at least width with the pad char.
+  void AppendNumber(uint64_t value, int width = 0, char pad = ' ');
+
+  // "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" local time. The date and time part
+  // is only re-formatted when the second changes.
+  void AppendDateTime(int64_t timestamp_ns);
+
+  void Flush();
+
+  // If writing failed, e.g. because the reader went away.
+  bool failed() const { return failed_; }
+
+private:
+  void AppendSlowPath(const char *data, size_t len);
+  void WriteOut(const char *data, size_t len);
+
+  const int fd_;
+  std::string *const sink_;
+  const size_t capacity_;
+  char *const buffer_;
+  size_t pending_ = 0;
+  bool failed_ = false;
+
+  int64_t cached_second_ = -1;
+  char cached_datetime_[32];
+  size_t cached_datetime_len_ = 0;
+};
+
+#endif // OUTPUT_BUFFER_H
@@ -0,0 +1,271 @@
+#include "record-exporter.h"
+
+#include <cstring>
+
+// pcapng block types and options.
+static constexpr uint32_t kSectionHeaderBlock = 0x0a0d0d0a;
+static constexpr uint32_t kInterfaceDescriptionBlock = 0x00000001;
+static constexpr uint32_t kEnhancedPacketBlock = 0x00000006;
+static constexpr uint32_t kByteOrderMagic = 0x1a2b3c4d;
+static constexpr uint16_t kLinktypeUser0 = 147;
+static constexpr uint16_t kOptEndOfOpt = 0;
+static constexpr uint16_t kOptComment = 1;
+static constexpr uint16_t kIfName = 2;
+static constexpr uint16_t kIfTsresol = 9;
+static constexpr uint16_t kEpbFlags = 2;
+
+static size_t Padded(size_t len) { return (len + 3) & ~(size_t)3; }
+
+bool ParseExportFormatName(const char *name, ExportFormat *format) {
+  if (strcmp(name, "jsonl") == 0) {
+    *format = ExportFormat::kJsonl;
+  } else if (strcmp(name, "csv") == 0) {
+    *format = ExportFormat::kCsv;
+  } else if (strcmp(name, "pcapng") == 0) {
+    *format = ExportFormat::kPcapng;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Strict UTF-8: no overlong encodings, surrogates or values > U+10FFFF.
+static bool IsValidUtf8(const uint8_t *data, size_t len) {
+  const uint8_t *const end = data + len;
+  while (data < end) {
+    if (*data < 0x80) {
+      ++data;
+      continue;
+    }
+    int follow;
+    uint8_t min2 = 0x80, max2 = 0xbf;  // Allowed range of second byte.
+    if (*data >= 0xc2 && *data <= 0xdf) {
+      follow = 1;
+    } else if (*data >= 0xe0 && *data <= 0xef) {
+      follow = 2;
+      if (*data == 0xe0) min2 = 0xa0;
+      if (*data == 0xed) max2 = 0x9f;
+    } else if (*data >= 0xf0 && *data <= 0xf4) {
+      follow = 3;
+      if (*data == 0xf0) min2 = 0x90;
+      if (*data == 0xf4) max2 = 0x8f;
+    } else {
+      return false;
+    }
+    if (end - data <= follow) return false;
+    if (data[1] < min2 || data[1] > max2) return false;
+    for (int i = 2; i <= follow; ++i) {
+      if ((data[i] & 0xc0) != 0x80) return false;
+    }
+    data += follow + 1;
+  }
+  return true;
+}
+
+RecordExporter::RecordExporter(ExportFormat format,
+                               const std::map<int, std::string> &channel_names,
+                               OutputBuffer *out)
+  : format_(format), channel_names_(channel_names), out_(out) {
+  if (channel_names_.empty()) {
+    channel_names_ = { {0, "stdin"}, {1, "stdout"}, {2, "stderr"} };
+  }
+  for (int &interface : interface_of_channel_) interface = -1;
+  switch (format_) {
+  case ExportFormat::kJsonl:
+    break;
+  case ExportFormat::kCsv:
+    out_->Append("timestamp_ns,channel,channel_closed,encoding,data\r\n");
+    break;
+  case ExportFormat::kPcapng:
+    AppendU32(kSectionHeaderBlock);
+    AppendU32(28);
+    AppendU32(kByteOrderMagic);
+    AppendU16(1);  // Version 1.0
+    AppendU16(0);
+    AppendU32(0xffffffff);  // Section length unknown.
+    AppendU32(0xffffffff);
+    AppendU32(28);
+    break;
+  }
+}
+
+void RecordExporter::Export(const RecordHeader &header, const char *payload) {
+  switch (format_) {
+  case ExportFormat::kJsonl: ExportJsonl(header, payload); break;
+  case ExportFormat::kCsv: ExportCsv(header, payload); break;
+  case ExportFormat::kPcapng: ExportPcapng(header, payload); break;
+  }
+}
+
+void RecordExporter::ExportJsonl(const RecordHeader &header,
+                                 const char *payload) {
+  out_->Append("{\"timestamp_ns\":");
+  out_->AppendNumber(header.timestamp_ns);
+  out_->Append(",\"channel\":");
+  out_->AppendNumber(header.channel);
+  out_->Append(header.channel_closed ? ",\"channel_closed\":true"
+                                     : ",\"channel_closed\":false");
+  if (IsValidUtf8((const uint8_t *)payload, header.block_size)) {
+    out_->Append(",\"data\":\"");
+    AppendJsonString(payload, header.block_size);
+  } else {
+    out_->Append(",\"data_base64\":\"");
+    AppendBase64(payload, header.block_size);
+  }
+  out_->Append("\"}\n");
+}
+
+void RecordExporter::ExportCsv(const RecordHeader &header,
+                               const char *payload) {
+  out_->AppendNumber(header.timestamp_ns);
+  out_->Append(',');
+  out_->AppendNumber(header.channel);
+  out_->Append(header.channel_closed ? ",1," : ",0,");
+  // NUL bytes are valid UTF-8, but not something CSV tools cope with.
+  if (!memchr(payload, 0, header.block_size) &&
+      IsValidUtf8((const uint8_t *)payload, header.block_size)) {
+    out_->Append("text,\"");
+    AppendCsvString(payload, header.block_size);
+  } else {
+    out_->Append("base64,\"");
+    AppendBase64(payload, header.block_size);
+  }
+  out_->Append("\"\r\n");
+}
+
+void RecordExporter::ExportPcapng(const RecordHeader &header,
+                                  const char *payload) {
+  const int channel = header.channel & 0x0f;
+  if (interface_of_channel_[channel] < 0) AppendInterfaceBlock(channel);
+
+  static constexpr char kClosedComment[] = "channel closed";
+  const size_t data_len = Padded(header.block_size);
+  const bool has_direction = channel <= 2;
+  size_t options_len = 0;
+  if (has_direction) options_len += 4 + 4;
+  if (header.channel_closed) options_len += 4 + Padded(strlen(kClosedComment));
+  if (options_len) options_len += 4;  // End of options.
+  const uint32_t total = 28 + data_len + options_len + 4;
+
+  const uint64_t timestamp = header.timestamp_ns;
+  AppendU32(kEnhancedPacketBlock);
+  AppendU32(total);
+  AppendU32(interface_of_channel_[channel]);
+  AppendU32(timestamp >> 32);
+  AppendU32(timestamp & 0xffffffff);
+  AppendU32(header.block_size);  // Captured length.
+  AppendU32(header.block_size);  // Original length.
+  out_->Append(payload, header.block_size);
+  AppendPadding(data_len - header.block_size);
+  if (has_direction) {
+    // Inbound to the program on stdin, outbound on stdout and stderr.
+    const uint32_t flags = (channel == 0) ? 1 : 2;
+    AppendPcapngOption(kEpbFlags, (const char *)&flags, 4);
+  }
+  if (header.channel_closed) {
+    AppendPcapngOption(kOptComment, kClosedComment, strlen(kClosedComment));
+  }
+  if (options_len) AppendPcapngOption(kOptEndOfOpt, nullptr, 0);
+  AppendU32(total);
+}
+
+void RecordExporter::AppendInterfaceBlock(int channel) {
+  std::string name = channel_names_[channel];
+  if (name.empty()) name = "channel " + std::to_string(channel);
+  if (name.size() > 255) name.resize(255);
+  const uint8_t nanoseconds = 9;  // Timestamp resolution 10^-9.
+  const uint32_t total = 20 + (4 + Padded(name.size())) + (4 + 4) + 4;
+
+  AppendU32(kInterfaceDescriptionBlock);
+  AppendU32(total);
+  AppendU16(kLinktypeUser0);
+  AppendU16(0);
+  AppendU32(0);  // No snap length limit.
+  AppendPcapngOption(kIfName, name.data(), name.size());
+  AppendPcapngOption(kIfTsresol, (const char *)&nanoseconds, 1);
+  AppendPcapngOption(kOptEndOfOpt, nullptr, 0);
+  AppendU32(total);
+  interface_of_channel_[channel] = interfaces_++;
+}
+
+void RecordExporter::AppendPcapngOption(uint16_t code, const char *data,
+                                        uint16_t len) {
+  AppendU16(code);
+  AppendU16(len);
+  if (len) out_->Append(data, len);
+  AppendPadding(Padded(len) - len);
+}
+
+void RecordExporter::AppendPadding(size_t len) {
+  static constexpr char kZeros[4] = {};
+  out_->Append(kZeros, len);
+}
+
+void RecordExporter::AppendJsonString(const char *data, size_t len) {
+  static constexpr char kHex[] = "0123456789abcdef";
+  const char *const end = data + len;
+  while (data < end) {
+    // Copy runs that need no escaping in one go.
+    const char *run = data;
+    while (data < end && (uint8_t)*data >= 0x20 && *data != '"' &&
+           *data != '\\') {
+      ++data;
+    }
+    out_->Append(run, data - run);
+    if (data == end) break;
+    const char c = *data++;
+    switch (c) {
+    case '"': out_->Append("\\\"", 2); break;
+    case '\\': out_->Append("\\\\", 2); break;
+    case '\n': out_->Append("\\n", 2); break;
+    case '\r': out_->Append("\\r", 2); break;
+    case '\t': out_->Append("\\t", 2); break;
+    default: {
+      const char escaped[6] = { '\\', 'u', '0', '0', kHex[(c >> 4) & 0x0f],
+                                kHex[c & 0x0f] };
+      out_->Append(escaped, 6);
+    }
+    }
+  }
+}
+
+void RecordExporter::AppendCsvString(const char *data, size_t len) {
+  const char *const end = data + len;
+  while (data < end) {
+    const char *quote = (const char *)memchr(data, '"', end - data);
+    if (!quote) {
+      out_->Append(data, end - data);
+      break;
+    }
+    out_->Append(data, quote + 1 - data);
+    out_->Append('"');  // Quotes are doubled.
+    data = quote + 1;
+  }
+}
+
+void RecordExporter::AppendBase64(const char *data, size_t len) {
+  static constexpr char kAlphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char encoded[4096];
+  const uint8_t *in = (const uint8_t *)data;
+  size_t pos = 0;
+  for (/**/; len >= 3; in += 3, len -= 3) {
+    const uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    encoded[pos++] = kAlphabet[v >> 18];
+    encoded[pos++] = kAlphabet[(v >> 12) & 0x3f];
+    encoded[pos++] = kAlphabet[(v >> 6) & 0x3f];
+    encoded[pos++] = kAlphabet[v & 0x3f];
+    if (pos == sizeof(encoded)) {
+      out_->Append(encoded, pos);
+      pos = 0;
+    }
+  }
+  if (len) {
+    const uint32_t v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+    encoded[pos++] = kAlphabet[v >> 18];
+    encoded[pos++] = kAlphabet[(v >> 12) & 0x3f];
+    encoded[pos++] = len > 1 ? kAlphabet[(v >> 6) & 0x3f] : '=';
+    encoded[pos++] = '=';
+  }
+  out_->Append(encoded, pos);
+}
@@ -0,0 +1,59 @@
+#ifndef RECORD_EXPORTER_H
+#define RECORD_EXPORTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "block-header.h"
+#include "output-buffer.h"
+
+// Machine readable formats records can be exported in.
+enum class ExportFormat {
+  kJsonl,   // One JSON object per line.
+  kCsv,     // RFC 4180, with a header line.
+  kPcapng,  // One interface per channel, one packet per record.
+};
+
+// Parse "jsonl", "csv" or "pcapng"; returns false if unknown.
+bool ParseExportFormatName(const char *name, ExportFormat *format);
+
+// Writes every record with its channel, timestamp_ns and channel_closed,
+// including empty records and closed markers. Payloads are binary-safe:
+// in JSONL and CSV, data that is not valid UTF-8 is base64 encoded instead.
+// Everything is formatted straight into the OutputBuffer.
+class RecordExporter {
+public:
+  // Writes what the format needs at the start, e.g. the CSV header line.
+  RecordExporter(ExportFormat format,
+                 const std::map<int, std::string> &channel_names,
+                 OutputBuffer *out);
+
+  void Export(const RecordHeader &header, const char *payload);
+
+private:
+  void ExportJsonl(const RecordHeader &header, const char *payload);
+  void ExportCsv(const RecordHeader &header, const char *payload);
+  void ExportPcapng(const RecordHeader &header, const char *payload);
+
+  void AppendJsonString(const char *data, size_t len);
+  void AppendCsvString(const char *data, size_t len);
+  void AppendBase64(const char *data, size_t len);
+
+  // pcapng blocks are written in host byte order, as declared in the
+  // section header.
+  void AppendU16(uint16_t value) { out_->Append((const char *)&value, 2); }
+  void AppendU32(uint32_t value) { out_->Append((const char *)&value, 4); }
+  void AppendPadding(size_t len);
+  void AppendPcapngOption(uint16_t code, const char *data, uint16_t len);
+  void AppendInterfaceBlock(int channel);
+
+  const ExportFormat format_;
+  std::map<int, std::string> channel_names_;
+  OutputBuffer *const out_;
+  int interface_of_channel_[16];  // pcapng interface id, -1 if none yet.
+  int interfaces_ = 0;
+};
+
+#endif // RECORD_EXPORTER_H
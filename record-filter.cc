@@ -0,0 +1,17 @@
+#include "record-filter.h"
+
+#include <cstdlib>
+
+bool ParseChannelList(const char *list, uint16_t *mask) {
+  *mask = 0;
+  const char *pos = list;
+  for (;;) {
+    char *end;
+    const long channel = strtol(pos, &end, 10);
+    if (end == pos || channel < 0 || channel > 15) return false;
+    *mask |= 1 << channel;
+    if (*end == '\0') return true;
+    if (*end != ',') return false;
+    pos = end + 1;
+  }
+}
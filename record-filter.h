@@ -0,0 +1,38 @@
+#ifndef RECORD_FILTER_H
+#define RECORD_FILTER_H
+
+#include <cstdint>
+
+#include "block-header.h"
+
+// Which records to look at. Readers given a filter skip the payload of
+// records not accepted without reading it.
+struct RecordFilter {
+  enum class Closed { kAny, kOnly, kExclude };
+
+  uint16_t channels = 0xffff;  // Bit per channel.
+  int64_t from_ns = INT64_MIN;
+  int64_t to_ns = INT64_MAX;   // Reading stops at the first record after.
+  uint32_t min_size = 0;
+  uint32_t max_size = UINT32_MAX;
+  Closed closed = Closed::kAny;
+
+  bool Accepts(const RecordHeader &header) const {
+    // Not short-circuiting; cheaper than a branch for each field.
+    return ((channels >> (header.channel & 0x0f)) & 1)
+      & (header.timestamp_ns >= from_ns)
+      & (header.block_size >= min_size)
+      & (header.block_size <= max_size)
+      & (closed == Closed::kAny ||
+         (closed == Closed::kOnly) == header.channel_closed);
+  }
+
+  bool PastEnd(const RecordHeader &header) const {
+    return header.timestamp_ns > to_ns;
+  }
+};
+
+// Parse comma-separated list of channels 0..15 into a mask.
+bool ParseChannelList(const char *list, uint16_t *mask);
+
+#endif // RECORD_FILTER_H
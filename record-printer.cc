@@ -0,0 +1,128 @@
+#include "record-printer.h"
+
+#include <functional>
+
+#include "newline-scan.h"
+
+// Things to wrap communication around, so that we have a colored
+// output.
+static constexpr const char *kColors[3] = {
+    "\033[1;31m", // bold red
+    "\033[1;34m", // bold blue
+    "",           // regular
+};
+
+static constexpr char kSuffix[] = "\033[0m";
+
+// Write payload; with color, each line is wrapped in it on its own, as
+// pagers such as less -R don't carry colors over to the next line. If given,
+// line_prefix is called at the beginning of every line but the first.
+static void write_lines(OutputBuffer *out, const char *color,
+                        const char *buf, size_t size,
+                        const std::function<void()> &line_prefix) {
+  if (!color && !line_prefix) {
+    out->Append(buf, size);
+    return;
+  }
+  const char *pos = buf;
+  const char *const end = buf + size;
+  while (pos < end) {
+    const char *newline = FindNewline(pos, end);
+    const char *line_end = newline ? newline : end;
+    if (color) out->Append(color);
+    out->Append(pos, line_end - pos);
+    if (color) out->Append(kSuffix, sizeof(kSuffix) - 1);
+    if (!newline) break;
+    out->Append('\n');
+    pos = newline + 1;
+    if (pos < end && line_prefix) line_prefix();
+  }
+}
+
+// Print nanoseconds as milliseconds with six decimals, the integer part
+// right-aligned to width.
+static void write_milliseconds(OutputBuffer *out, int64_t ns, int width) {
+  if (ns < 0) {
+    out->Append('-');
+    ns = -ns;
+    --width;
+  }
+  out->AppendNumber(ns / 1000000, width);
+  out->Append('.');
+  out->AppendNumber(ns % 1000000, 6, '0');
+  out->Append("ms: ", 4);
+}
+
+RecordPrinter::RecordPrinter(const PrintOptions &options,
+                             int64_t start_timestamp, OutputBuffer *out)
+  : options_(options), start_timestamp_(start_timestamp), out_(out),
+    last_timestamp_(start_timestamp) {
+}
+
+void RecordPrinter::PrintTimestamp(int64_t timestamp_ns) {
+  switch (options_.print_timestamp) {
+  case TSPrint::kNone: break;
+  case TSPrint::kStartFile:
+    write_milliseconds(out_, timestamp_ns - start_timestamp_, 6);
+    break;
+  case TSPrint::kDelta:
+    out_->Append(first_delta_ ? ' ' : '+');
+    write_milliseconds(out_, timestamp_ns - last_timestamp_, 5);
+    first_delta_ = false;
+    last_timestamp_ = timestamp_ns;
+    break;
+  case TSPrint::kAbsolute:
+    out_->Append('[');
+    out_->AppendDateTime(timestamp_ns);
+    out_->Append("]: ", 3);
+    break;
+  }
+}
+
+void RecordPrinter::PrintRecordStart(int64_t timestamp_ns) {
+  if (options_.print_timestamp != TSPrint::kNone && !last_was_newline_)
+    out_->Append('\n');  // make sure timestamps start in a new line.
+  PrintTimestamp(timestamp_ns);
+}
+
+void RecordPrinter::ContinueFrom(const RecordPrinter &other) {
+  if (!other.printed_any_) return;
+  printed_any_ = true;
+  last_timestamp_ = other.last_timestamp_;
+  last_was_newline_ = other.last_was_newline_;
+  first_delta_ = false;
+}
+
+bool RecordPrinter::Selected(const RecordHeader &header) const {
+  return header.block_size > 0 && options_.filter.Accepts(header) &&
+    !options_.filter.PastEnd(header);
+}
+
+void RecordPrinter::Print(const RecordHeader &header, const char *payload) {
+  if (!Selected(header))
+    return;
+
+  const int64_t timestamp_ns = header.timestamp_ns;
+  if (defer_first_start_ && !printed_any_) {
+    // Somebody else prints the start, but we still need the state of
+    // having done so.
+    first_timestamp_ = timestamp_ns;
+    last_timestamp_ = timestamp_ns;
+    first_delta_ = false;
+  } else {
+    PrintRecordStart(timestamp_ns);
+  }
+
+  const char *color = nullptr;
+  if (options_.print_colored) {
+    color = header.channel < 3 ? kColors[header.channel] : "";
+  }
+  const bool prefix_lines = options_.timestamp_every_line &&
+    options_.print_timestamp != TSPrint::kNone;
+  write_lines(out_, color, payload, header.block_size,
+              prefix_lines
+              ? std::function<void()>([&]() { PrintTimestamp(timestamp_ns); })
+              : std::function<void()>());
+  last_was_newline_ = payload[header.block_size - 1] == '\n';
+  printed_any_ = true;
+}
@@ -0,0 +1,63 @@
+#ifndef RECORD_PRINTER_H
+#define RECORD_PRINTER_H
+
+#include <cstdint>
+
+#include "block-header.h"
+#include "output-buffer.h"
+#include "record-filter.h"
+
+enum class TSPrint { kNone, kStartFile, kDelta, kAbsolute };
+
+struct PrintOptions {
+  RecordFilter filter;
+  TSPrint print_timestamp = TSPrint::kNone;
+  bool timestamp_every_line = false;
+  bool print_colored = true;
+};
+
+// Formats records as configured in the PrintOptions. Separators and delta
+// timestamps depend on what was printed before, which is tracked here.
+class RecordPrinter {
+public:
+  // Timestamps are printed relative to start_timestamp.
+  RecordPrinter(const PrintOptions &options, int64_t start_timestamp,
+                OutputBuffer *out);
+
+  // Does the record pass the filter; empty records are never printed.
+  bool Selected(const RecordHeader &header) const;
+
+  // Print record if it is Selected().
+  void Print(const RecordHeader &header, const char *payload);
+
+  // For printing a part of the log without knowing what comes before it:
+  // the first record is printed without separator and timestamp; whoever
+  // knows the state then prints them with PrintRecordStart() before the
+  // output of this printer, and continues with ContinueFrom().
+  void DeferFirstRecordStart() { defer_first_start_ = true; }
+
+  // Separator and timestamp for a record.
+  void PrintRecordStart(int64_t timestamp_ns);
+
+  // Take over the state after everything printed by the other printer.
+  void ContinueFrom(const RecordPrinter &other);
+
+  bool printed_any() const { return printed_any_; }
+  int64_t first_timestamp() const { return first_timestamp_; }
+
+private:
+  void PrintTimestamp(int64_t timestamp_ns);
+
+  const PrintOptions &options_;
+  const int64_t start_timestamp_;
+  OutputBuffer *const out_;
+  bool defer_first_start_ = false;
+
+  bool printed_any_ = false;
+  int64_t first_timestamp_ = 0;
+  int64_t last_timestamp_;
+  bool last_was_newline_ = true;
+  bool first_delta_ = true;
+};
+
+#endif // RECORD_PRINTER_H
@@ -0,0 +1,71 @@
+#include "record-replayer.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+
+// Sleeping wakes up late by tens of microseconds; this much before the
+// deadline we poll the clock instead.
+static constexpr int64_t kSpinNs = 100000;
+
+static int64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns how late we are, or 0 if on time.
+static int64_t WaitUntil(int64_t deadline) {
+  int64_t now = Now();
+  if (now >= deadline) return now - deadline;
+  if (deadline - now > kSpinNs) {
+    const int64_t wake = deadline - kSpinNs;
+    struct timespec ts = { (time_t)(wake / 1000000000),
+                           (long)(wake % 1000000000) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                           nullptr) == EINTR) {}
+  }
+  while (Now() < deadline) {}
+  return 0;
+}
+
+RecordReplayer::RecordReplayer(int fd, int64_t start_timestamp, double speed)
+  : fd_(fd), start_timestamp_(start_timestamp), speed_(speed), start_(Now()) {
+}
+
+void RecordReplayer::WaitFor(const RecordHeader &header) {
+  if (speed_ <= 0) return;
+  const int64_t offset = header.timestamp_ns - start_timestamp_;
+  late_.Record(WaitUntil(start_ + (int64_t)(std::max<int64_t>(0, offset)
+                                            / speed_)));
+}
+
+bool RecordReplayer::Replay(const RecordHeader &header, const char *payload) {
+  WaitFor(header);
+  size_t written = 0;
+  while (written < header.block_size) {
+    const ssize_t w = write(fd_, payload + written,
+                            header.block_size - written);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) return false;
+    written += w;
+  }
+  records_++;
+  bytes_ += written;
+  last_write_ = Now();
+  return true;
+}
+
+void RecordReplayer::Report(FILE *out) const {
+  fprintf(out, "Replayed %" PRIu64 " records, %" PRIu64 " bytes in %.3fs",
+          records_, bytes_, records_ ? (last_write_ - start_) / 1e9 : 0.0);
+  if (late_.count()) {
+    fprintf(out, "; late by p50 %.1fus, p99 %.1fus, max %.1fus",
+            late_.Percentile(0.5) / 1e3, late_.Percentile(0.99) / 1e3,
+            late_.max() / 1e3);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,44 @@
+#ifndef RECORD_REPLAYER_H
+#define RECORD_REPLAYER_H
+
+#include <cstdint>
+#include <cstdio>
+
+#include "block-header.h"
+#include "histogram.h"
+
+// Writes the payloads of records to a file descriptor, e.g. the stdin of a
+// program, each at the time it was captured at relative to a start, so the
+// program gets its input with the timing of the captured session again.
+// Each write has an absolute deadline; one that is late does not delay the
+// ones after. For high rates, the last bit before a deadline is spent
+// polling the clock instead of sleeping, for microsecond accuracy.
+class RecordReplayer {
+public:
+  // Times are since start_timestamp, divided by speed; 0 writes as fast as
+  // possible. The replay starts now.
+  RecordReplayer(int fd, int64_t start_timestamp, double speed);
+
+  // Write the payload once it is due. Returns false if that failed, e.g.
+  // because the program closed its stdin.
+  bool Replay(const RecordHeader &header, const char *payload);
+
+  // Wait till the record is due without writing, e.g. to close the
+  // program's stdin at the time the channel was closed.
+  void WaitFor(const RecordHeader &header);
+
+  // Records and bytes written, and how late the writes were.
+  void Report(FILE *out) const;
+
+private:
+  const int fd_;
+  const int64_t start_timestamp_;
+  const double speed_;
+  const int64_t start_;  // Clock when the replay started.
+  uint64_t records_ = 0;
+  uint64_t bytes_ = 0;
+  int64_t last_write_ = 0;
+  Histogram late_;
+};
+
+#endif // RECORD_REPLAYER_H
@@ -0,0 +1,196 @@
+#include "record-search.h"
+
+#include <algorithm>
+#include <regex>
+
+#include "newline-scan.h"
+#include "substring-search.h"
+
+// How far regular expression matches across records can reach.
+static constexpr size_t kRegexAcrossWindow = 256;
+
+namespace {
+class LiteralMatcher : public PayloadMatcher {
+public:
+  explicit LiteralMatcher(const std::string &pattern) : pattern_(pattern) {}
+
+  bool Matches(const char *data, size_t len) const override {
+    return FindSubstring(data, data + len, pattern_.data(), pattern_.size());
+  }
+
+  // With window() bytes on each side, every match is across.
+  bool MatchesAcross(const char *data, size_t len, size_t, bool,
+                     bool) const override {
+    return Matches(data, len);
+  }
+
+  size_t window() const override {
+    return pattern_.empty() ? 0 : pattern_.size() - 1;
+  }
+
+private:
+  const std::string pattern_;
+};
+
+class RegexMatcher : public PayloadMatcher {
+public:
+  explicit RegexMatcher(const std::regex &regex) : regex_(regex) {}
+
+  // Like grep, line by line, so that ^ and $ match at the start and end of
+  // each line. The newline at the end of a record doesn't start another.
+  bool Matches(const char *data, size_t len) const override {
+    const char *const end = data + len;
+    for (const char *line = data; /**/; /**/) {
+      const char *newline = FindNewline(line, end);
+      if (std::regex_search(line, newline ? newline : end, regex_)) {
+        return true;
+      }
+      if (!newline || newline + 1 == end) return false;
+      line = newline + 1;
+    }
+  }
+
+  // Only the line around the boundary can have a match across it.
+  bool MatchesAcross(const char *data, size_t len, size_t boundary,
+                     bool starts_record, bool ends_record) const override {
+    size_t begin = boundary;
+    while (begin > 0 && data[begin - 1] != '\n') --begin;
+    const char *newline = FindNewline(data + boundary, data + len);
+    const size_t end = newline ? newline - data : len;
+    if (end == boundary) return false;
+    auto flags = std::regex_constants::match_default;
+    if (begin == 0 && !starts_record) {
+      flags |= std::regex_constants::match_not_bol;
+    }
+    if (end == len && !ends_record) {
+      flags |= std::regex_constants::match_not_eol;
+    }
+    std::cregex_iterator it(data + begin, data + end, regex_, flags);
+    for (/**/; it != std::cregex_iterator(); ++it) {
+      const size_t start = begin + it->position();
+      if (start >= boundary) break;
+      if (start + it->length() > boundary) return true;
+    }
+    return false;
+  }
+
+  size_t window() const override { return kRegexAcrossWindow; }
+
+private:
+  const std::regex regex_;
+};
+}  // namespace
+
+PayloadMatcher *PayloadMatcher::CreateLiteral(const std::string &pattern) {
+  return new LiteralMatcher(pattern);
+}
+
+PayloadMatcher *PayloadMatcher::CreateRegex(const std::string &pattern,
+                                            std::string *error) {
+  try {
+    return new RegexMatcher(std::regex(pattern, std::regex::extended |
+                                       std::regex::optimize));
+  } catch (const std::regex_error &e) {
+    *error = e.what();
+    return nullptr;
+  }
+}
+
+RecordSearch::RecordSearch(std::unique_ptr<PayloadMatcher> matcher,
+                           int context, RecordPrinter *printer)
+  : matcher_(std::move(matcher)), context_(std::max(context, 0)),
+    printer_(printer) {
+}
+
+void RecordSearch::Store(const RecordHeader &header, const char *payload,
+                         bool payload_stays_valid, uint64_t seq,
+                         StoredRecord *record) {
+  record->seq = seq;
+  record->header = header;
+  if (payload_stays_valid) {
+    record->payload = payload;
+    record->copy.clear();
+  } else {
+    record->payload = nullptr;
+    record->copy.assign(payload, header.block_size);
+  }
+}
+
+void RecordSearch::Emit(const RecordHeader &header, const char *payload,
+                        uint64_t seq) {
+  printer_->Print(header, payload);
+  next_unprinted_ = seq + 1;
+}
+
+void RecordSearch::Process(const RecordHeader &header, const char *payload,
+                           bool payload_stays_valid) {
+  const uint64_t seq = seq_++;
+  const size_t len = header.block_size;
+  ChannelState &channel = channels_[header.channel & 0x0f];
+  const size_t window = matcher_->window();
+
+  bool match = matcher_->Matches(payload, len);
+  bool across = false;
+  if (!match && window > 0 && !channel.tail.empty()) {
+    across_ = channel.tail;
+    across_.append(payload, std::min(len, window));
+    across = matcher_->MatchesAcross(
+      across_.data(), across_.size(), channel.tail.size(),
+      channel.tail.size() == channel.tail_records_bytes, len <= window);
+  }
+
+  if (match || across) {
+    // The records the earlier part of the match can be in and the context
+    // before, in order and unless we already printed past them; printing
+    // moves next_unprinted_, so a record in both is printed once.
+    static const std::deque<StoredRecord> kNone;
+    const std::deque<StoredRecord> &earlier = across ? channel.tail_records
+                                                     : kNone;
+    auto e = earlier.begin();
+    auto h = history_.begin();
+    while (e != earlier.end() || h != history_.end()) {
+      const StoredRecord &before =
+        (h == history_.end() || (e != earlier.end() && e->seq < h->seq))
+        ? *e++ : *h++;
+      if (before.seq >= next_unprinted_) Emit(before);
+    }
+    Emit(header, payload, seq);
+    after_context_left_ = context_;
+  } else if (after_context_left_ > 0) {
+    Emit(header, payload, seq);
+    --after_context_left_;
+  }
+
+  if (context_ > 0) {
+    if (history_.size() == context_) {
+      StoredRecord recycled = std::move(history_.front());
+      history_.pop_front();
+      history_.push_back(std::move(recycled));
+    } else {
+      history_.emplace_back();
+    }
+    Store(header, payload, payload_stays_valid, seq, &history_.back());
+  }
+
+  if (window > 0) {
+    // Short records add to what we have from before.
+    if (len >= window) {
+      channel.tail.assign(payload + len - window, window);
+    } else {
+      channel.tail.append(payload, len);
+      if (channel.tail.size() > window) {
+        channel.tail.erase(0, channel.tail.size() - window);
+      }
+    }
+    std::deque<StoredRecord> &records = channel.tail_records;
+    records.emplace_back();
+    Store(header, payload, payload_stays_valid, seq, &records.back());
+    channel.tail_records_bytes += len;
+    // Drop those the tail doesn't reach back to anymore.
+    while (channel.tail_records_bytes - records.front().header.block_size
+           >= window) {
+      channel.tail_records_bytes -= records.front().header.block_size;
+      records.pop_front();
+    }
+  }
+}
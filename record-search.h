@@ -0,0 +1,84 @@
+#ifndef RECORD_SEARCH_H
+#define RECORD_SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "block-header.h"
+#include "record-printer.h"
+
+// Finds a pattern in payloads.
+class PayloadMatcher {
+public:
+  virtual ~PayloadMatcher() {}
+
+  static PayloadMatcher *CreateLiteral(const std::string &pattern);
+
+  // Extended regular expression. Returns nullptr and sets error if invalid.
+  static PayloadMatcher *CreateRegex(const std::string &pattern,
+                                     std::string *error);
+
+  virtual bool Matches(const char *data, size_t len) const = 0;
+
+  // Is there a match in data that starts before boundary and ends after it.
+  // Data is cut out of the records around a boundary; it only starts or
+  // ends where a record does if said so.
+  virtual bool MatchesAcross(const char *data, size_t len, size_t boundary,
+                             bool starts_record, bool ends_record) const = 0;
+
+  // Bytes on each side of a record boundary to look at for matches across.
+  virtual size_t window() const = 0;
+};
+
+// Prints only records matching the pattern, with the given number of
+// context records before and after. Also finds matches that straddle
+// consecutive records on the same channel; all of them are printed then.
+class RecordSearch {
+public:
+  RecordSearch(std::unique_ptr<PayloadMatcher> matcher, int context,
+               RecordPrinter *printer);
+
+  // Records passed have to be selected by the printer. Records that might
+  // still be printed later are kept; by pointer if the payload stays valid,
+  // e.g. because it is in a mapped file, otherwise copied.
+  void Process(const RecordHeader &header, const char *payload,
+               bool payload_stays_valid = false);
+
+private:
+  struct StoredRecord {
+    uint64_t seq = 0;
+    RecordHeader header;
+    const char *payload = nullptr;  // If it stays valid, else in copy.
+    std::string copy;
+
+    const char *data() const { return payload ? payload : copy.data(); }
+  };
+  struct ChannelState {
+    std::string tail;  // Last window() bytes seen on this channel.
+    std::deque<StoredRecord> tail_records;  // The tail is from these.
+    size_t tail_records_bytes = 0;
+  };
+
+  static void Store(const RecordHeader &header, const char *payload,
+                    bool payload_stays_valid, uint64_t seq,
+                    StoredRecord *record);
+  void Emit(const RecordHeader &header, const char *payload, uint64_t seq);
+  void Emit(const StoredRecord &record) {
+    Emit(record.header, record.data(), record.seq);
+  }
+
+  const std::unique_ptr<PayloadMatcher> matcher_;
+  const size_t context_;
+  RecordPrinter *const printer_;
+  uint64_t seq_ = 0;
+  uint64_t next_unprinted_ = 0;  // Lowest seq that may still be printed.
+  size_t after_context_left_ = 0;
+  std::deque<StoredRecord> history_;  // Last context_ records.
+  ChannelState channels_[16];
+  std::string across_;  // Scratch buffer for matches across records.
+};
+
+#endif // RECORD_SEARCH_H
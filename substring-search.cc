@@ -0,0 +1,120 @@
+#include "substring-search.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+// All implementations get needle_len >= 2 and a haystack at least as long.
+// The vectorized ones compare the first and last byte of the needle at a
+// block of candidate positions at once; only where both match, the rest
+// is compared.
+
+static const char *FindSubstringScalar(const char *pos, const char *end,
+                                       const char *needle, size_t n) {
+  const char *const last_start = end - n;
+  while (pos <= last_start) {
+    pos = (const char *)memchr(pos, needle[0], last_start - pos + 1);
+    if (!pos) return nullptr;
+    if (memcmp(pos + 1, needle + 1, n - 1) == 0) return pos;
+    ++pos;
+  }
+  return nullptr;
+}
+
+#if defined(__SSE2__)
+static const char *FindSubstringSSE2(const char *pos, const char *end,
+                                     const char *needle, size_t n) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[n - 1]);
+  for (/**/; end - pos >= (ptrdiff_t)(n + 15); pos += 16) {
+    const __m128i block_first = _mm_loadu_si128((const __m128i *)pos);
+    const __m128i block_last = _mm_loadu_si128((const __m128i *)(pos + n - 1));
+    unsigned mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                    _mm_cmpeq_epi8(block_last, last)));
+    while (mask) {
+      const int bit = __builtin_ctz(mask);
+      if (memcmp(pos + bit + 1, needle + 1, n - 2) == 0) return pos + bit;
+      mask &= mask - 1;
+    }
+  }
+  return FindSubstringScalar(pos, end, needle, n);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SUBSTRING_SEARCH_AVX2 1
+__attribute__((target("avx2")))
+static const char *FindSubstringAVX2(const char *pos, const char *end,
+                                     const char *needle, size_t n) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+  for (/**/; end - pos >= (ptrdiff_t)(n + 31); pos += 32) {
+    const __m256i block_first = _mm256_loadu_si256((const __m256i *)pos);
+    const __m256i block_last =
+      _mm256_loadu_si256((const __m256i *)(pos + n - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                       _mm256_cmpeq_epi8(block_last, last)));
+    while (mask) {
+      const int bit = __builtin_ctz(mask);
+      if (memcmp(pos + bit + 1, needle + 1, n - 2) == 0) return pos + bit;
+      mask &= mask - 1;
+    }
+  }
+  return FindSubstringSSE2(pos, end, needle, n);
+}
+#endif
+
+#elif defined(__ARM_NEON)
+static const char *FindSubstringNEON(const char *pos, const char *end,
+                                     const char *needle, size_t n) {
+  const uint8x16_t first = vdupq_n_u8(needle[0]);
+  const uint8x16_t last = vdupq_n_u8(needle[n - 1]);
+  for (/**/; end - pos >= (ptrdiff_t)(n + 15); pos += 16) {
+    const uint8x16_t eq = vandq_u8(
+      vceqq_u8(vld1q_u8((const uint8_t *)pos), first),
+      vceqq_u8(vld1q_u8((const uint8_t *)(pos + n - 1)), last));
+    // Four bits in the mask per byte position.
+    uint64_t mask = vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    while (mask) {
+      const int bit = __builtin_ctzll(mask) >> 2;
+      if (memcmp(pos + bit + 1, needle + 1, n - 2) == 0) return pos + bit;
+      mask &= ~(0xfULL << (bit * 4));
+    }
+  }
+  return FindSubstringScalar(pos, end, needle, n);
+}
+#endif
+
+typedef const char *(*FindSubstringFun)(const char *, const char *,
+                                        const char *, size_t);
+
+static FindSubstringFun ChooseImplementation() {
+#if defined(SUBSTRING_SEARCH_AVX2)
+  if (__builtin_cpu_supports("avx2")) return FindSubstringAVX2;
+#endif
+#if defined(__SSE2__)
+  return FindSubstringSSE2;
+#elif defined(__ARM_NEON)
+  return FindSubstringNEON;
+#else
+  return FindSubstringScalar;
+#endif
+}
+
+const char *FindSubstring(const char *begin, const char *end,
+                          const char *needle, size_t needle_len) {
+  static const FindSubstringFun implementation = ChooseImplementation();
+  if (needle_len == 0) return begin;
+  if ((size_t)(end - begin) < needle_len) return nullptr;
+  if (needle_len == 1) {
+    return (const char *)memchr(begin, needle[0], end - begin);
+  }
+  return implementation(begin, end, needle, needle_len);
+}
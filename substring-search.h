@@ -0,0 +1,12 @@
+#ifndef SUBSTRING_SEARCH_H
+#define SUBSTRING_SEARCH_H
+
+#include <cstddef>
+
+// Returns pointer to the first occurrence of needle in [begin, end) or
+// nullptr if there is none. Vectorized with AVX2, SSE2 or NEON, whatever
+// the CPU supports.
+const char *FindSubstring(const char *begin, const char *end,
+                          const char *needle, size_t needle_len);
+
+#endif // SUBSTRING_SEARCH_H
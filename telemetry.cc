@@ -0,0 +1,434 @@
+#include "telemetry.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "clock.h"
+
+static constexpr int kReportSignal = SIGUSR1;
+static constexpr int kHttpTimeoutSeconds = 1;
+
+static bool telemetry_enabled = false;
+
+// Sets of all threads that ever counted. Those of threads that are gone
+// are handed to new ones, still with their counts. Never destructed, as
+// threads might still finish after the end of main().
+static std::mutex registry_mutex;
+static std::vector<ThreadTelemetry *> *all_threads =
+  new std::vector<ThreadTelemetry *>();
+static std::vector<ThreadTelemetry *> *unused =
+  new std::vector<ThreadTelemetry *>();
+
+namespace {
+struct ThreadSlot {
+  ThreadSlot() {
+    std::lock_guard<std::mutex> l(registry_mutex);
+    if (unused->empty()) {
+      telemetry = new ThreadTelemetry();
+      all_threads->push_back(telemetry);
+    } else {
+      telemetry = unused->back();
+      unused->pop_back();
+    }
+  }
+  ~ThreadSlot() {
+    std::lock_guard<std::mutex> l(registry_mutex);
+    unused->push_back(telemetry);
+  }
+  ThreadTelemetry *telemetry;
+};
+
+// Sum of all threads.
+struct Totals {
+  uint64_t wakeups = 0;
+  uint64_t reads[16] = {};
+  uint64_t bytes_read[16] = {};
+  uint64_t short_writes = 0;
+  uint64_t backlog_pauses = 0;
+  uint64_t buffer_allocations = 0;
+  TelemetryHistogram::Snapshot read_size;
+  TelemetryHistogram::Snapshot forward_ns;
+  TelemetryHistogram::Snapshot log_append_ns;
+  TelemetryHistogram::Snapshot log_write_ns;
+  TelemetryHistogram::Snapshot async_queue;
+};
+}  // namespace
+
+static Totals CollectTotals() {
+  Totals result;
+  std::lock_guard<std::mutex> l(registry_mutex);
+  for (const ThreadTelemetry *t : *all_threads) {
+    result.wakeups += t->wakeups.value();
+    for (int i = 0; i < 16; ++i) {
+      result.reads[i] += t->reads[i].value();
+      result.bytes_read[i] += t->bytes_read[i].value();
+    }
+    result.short_writes += t->short_writes.value();
+    result.backlog_pauses += t->backlog_pauses.value();
+    result.buffer_allocations += t->buffer_allocations.value();
+    t->read_size.AddTo(&result.read_size);
+    t->forward_ns.AddTo(&result.forward_ns);
+    t->log_append_ns.AddTo(&result.log_append_ns);
+    t->log_write_ns.AddTo(&result.log_write_ns);
+    t->async_queue.AddTo(&result.async_queue);
+  }
+  return result;
+}
+
+void EnableTelemetry() { telemetry_enabled = true; }
+
+ThreadTelemetry *GetThreadTelemetry() {
+  if (!telemetry_enabled) return nullptr;
+  static thread_local ThreadSlot slot;
+  return slot.telemetry;
+}
+
+void BlockTelemetrySignal(sigset_t *old_mask) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, kReportSignal);
+  pthread_sigmask(SIG_BLOCK, &mask, old_mask);
+}
+
+int TelemetryHistogram::BucketIndex(uint64_t v) {
+  if (v < 4) return v;
+  const int exponent = 63 - __builtin_clzll(v);
+  return 4 * (exponent - 1) + ((v >> (exponent - 2)) & 3);
+}
+
+// Largest value (not value - 1) in the bucket.
+static uint64_t BucketUpperValue(int index) {
+  if (index < 4) return index + 1;
+  const int exponent = index / 4 + 1;
+  const uint64_t width = 1ull << (exponent - 2);
+  return (4 + index % 4) * width + width;
+}
+
+void TelemetryHistogram::AddTo(Snapshot *snapshot) const {
+  for (int i = 0; i < kBuckets; ++i) {
+    const uint64_t count = counts_[i].value();
+    snapshot->counts[i] += count;
+    snapshot->count += count;
+  }
+  snapshot->sum += sum_.value();
+}
+
+uint64_t TelemetryHistogram::Snapshot::Percentile(double fraction) const {
+  if (!count) return 0;
+  const uint64_t rank = std::max<uint64_t>(1, fraction * count + 0.5);
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += counts[i];
+    if (seen >= rank) return BucketUpperValue(i);
+  }
+  return BucketUpperValue(kBuckets - 1);
+}
+
+uint64_t TelemetryHistogram::Snapshot::CountUpToPowerOfTwo(int exponent) const {
+  const int end = std::min(kBuckets, exponent < 2 ? 1 << exponent
+                           : 4 * (exponent - 1));
+  uint64_t result = 0;
+  for (int i = 0; i < end; ++i) result += counts[i];
+  return result;
+}
+
+// Listening TCP socket at [<host>:]<port>.
+static int ListenAt(const std::string &address) {
+  const size_t colon = address.rfind(':');
+  std::string host = colon == std::string::npos
+    ? "localhost" : address.substr(0, colon);
+  const std::string port = colon == std::string::npos
+    ? address : address.substr(colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *result;
+  const int err = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                              port.c_str(), &hints, &result);
+  if (err) {
+    fprintf(stderr, "%s: %s\n", address.c_str(), gai_strerror(err));
+    return -1;
+  }
+  int fd = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const int on = 1;
+  if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (fd < 0 || bind(fd, result->ai_addr, result->ai_addrlen) < 0 ||
+      listen(fd, 16) < 0) {
+    perror(address.c_str());
+    if (fd >= 0) close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  return fd;
+}
+
+TelemetryReporter *TelemetryReporter::Create(
+  int report_fd, const std::string &listen_address,
+  std::map<int, std::string> channel_names) {
+  int listen_fd = -1;
+  if (!listen_address.empty()) {
+    listen_fd = ListenAt(listen_address);
+    if (listen_fd < 0) return nullptr;
+  }
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, kReportSignal);
+  const int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  const int wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (signal_fd < 0 || wakeup_fd < 0) {
+    perror("telemetry");
+    if (listen_fd >= 0) close(listen_fd);
+    if (signal_fd >= 0) close(signal_fd);
+    if (wakeup_fd >= 0) close(wakeup_fd);
+    return nullptr;
+  }
+  return new TelemetryReporter(report_fd, listen_fd, signal_fd, wakeup_fd,
+                               std::move(channel_names));
+}
+
+TelemetryReporter::TelemetryReporter(int report_fd, int listen_fd,
+                                     int signal_fd, int wakeup_fd,
+                                     std::map<int, std::string> channel_names)
+  : report_fd_(report_fd), listen_fd_(listen_fd), signal_fd_(signal_fd),
+    wakeup_fd_(wakeup_fd), channel_names_(std::move(channel_names)),
+    start_ns_(GetTimeNanoseconds()) {
+  thread_ = std::thread(&TelemetryReporter::Run, this);
+}
+
+TelemetryReporter::~TelemetryReporter() {
+  const uint64_t one = 1;
+  while (write(wakeup_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {}
+  thread_.join();
+  if (listen_fd_ >= 0) close(listen_fd_);
+  close(signal_fd_);
+  close(wakeup_fd_);
+}
+
+void TelemetryReporter::Run() {
+  pollfd fds[3] = {
+    { wakeup_fd_, POLLIN, 0 },
+    { signal_fd_, POLLIN, 0 },
+    { listen_fd_, POLLIN, 0 },  // Ignored by poll() if -1.
+  };
+  for (;;) {
+    if (poll(fds, 3, -1) < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    if (fds[0].revents) return;
+    if (fds[1].revents & POLLIN) {
+      signalfd_siginfo info;
+      if (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+        PrintSummary();
+      }
+    }
+    if (fds[2].revents & POLLIN) ServeHttp();
+  }
+}
+
+void TelemetryReporter::PrintSummary() {
+  const std::string summary = FormatSummary();
+  const char *pos = summary.data();
+  size_t len = summary.size();
+  while (len > 0) {
+    const ssize_t w = write(report_fd_, pos, len);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return;
+    pos += w;
+    len -= w;
+  }
+}
+
+// Answer one request with the metrics, whatever its path. Slow clients
+// time out, so they can't keep us from answering the signal.
+void TelemetryReporter::ServeHttp() {
+  const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  const timeval timeout = { kHttpTimeoutSeconds, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.find("\n\n") == std::string::npos && request.size() < 8192) {
+    const ssize_t r = recv(fd, buf, sizeof(buf), 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    request.append(buf, r);
+  }
+  const std::string body = FormatPrometheus();
+  const std::string response =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+    "Connection: close\r\n\r\n" + body;
+  size_t sent = 0;
+  while (sent < response.size()) {
+    const ssize_t w = send(fd, response.data() + sent, response.size() - sent,
+                           MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) break;
+    sent += w;
+  }
+  close(fd);
+}
+
+std::string TelemetryReporter::ChannelName(int channel) const {
+  const auto found = channel_names_.find(channel);
+  return found != channel_names_.end()
+    ? found->second : "channel " + std::to_string(channel);
+}
+
+static void Appendf(std::string *out, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+static void Appendf(std::string *out, const char *format, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(buf, sizeof(buf), format, ap);
+  va_end(ap);
+  out->append(buf);
+}
+
+static std::string FormatNs(uint64_t ns) {
+  char buf[32];
+  if (ns < 1000) {
+    snprintf(buf, sizeof(buf), "%" PRIu64 "ns", ns);
+  } else if (ns < 1000000) {
+    snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(buf, sizeof(buf), "%.2fms", ns / 1e6);
+  } else {
+    snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+  }
+  return buf;
+}
+
+static void AppendDistribution(std::string *out, const char *name,
+                               const TelemetryHistogram::Snapshot &h,
+                               bool is_time) {
+  if (!h.count) return;
+  auto format = [is_time](uint64_t v) {
+    return is_time ? FormatNs(v) : std::to_string(v);
+  };
+  Appendf(out, "  %-16s p50 %-9s p90 %-9s p99 %-9s max %-9s (%" PRIu64
+          ")\n", name, format(h.Percentile(0.5)).c_str(),
+          format(h.Percentile(0.9)).c_str(), format(h.Percentile(0.99)).c_str(),
+          format(h.Percentile(1.0)).c_str(), h.count);
+}
+
+std::string TelemetryReporter::FormatSummary() const {
+  const Totals totals = CollectTotals();
+  const double seconds = (GetTimeNanoseconds() - start_ns_) / 1e9;
+  std::string out;
+  Appendf(&out, "bidi-tee: telemetry after %.3fs\n", seconds);
+  Appendf(&out, "  %-16s %" PRIu64 " (%.0f/s)\n", "wakeups", totals.wakeups,
+          seconds > 0 ? totals.wakeups / seconds : 0);
+  for (int i = 0; i < 16; ++i) {
+    if (!totals.reads[i]) continue;
+    Appendf(&out, "  %-16s %" PRIu64 " reads, %" PRIu64 " bytes (%.1f MB/s)\n",
+            ChannelName(i).c_str(), totals.reads[i], totals.bytes_read[i],
+            seconds > 0 ? totals.bytes_read[i] / seconds / 1e6 : 0);
+  }
+  AppendDistribution(&out, "bytes per read", totals.read_size, false);
+  AppendDistribution(&out, "forward write", totals.forward_ns, true);
+  AppendDistribution(&out, "log append", totals.log_append_ns, true);
+  AppendDistribution(&out, "log write", totals.log_write_ns, true);
+  AppendDistribution(&out, "async queue", totals.async_queue, false);
+  Appendf(&out, "  %-16s %" PRIu64 "\n", "short writes", totals.short_writes);
+  Appendf(&out, "  %-16s %" PRIu64 "\n", "backlog pauses",
+          totals.backlog_pauses);
+  Appendf(&out, "  %-16s %" PRIu64 "\n", "buffer allocs",
+          totals.buffer_allocations);
+  return out;
+}
+
+static void AppendPrometheusHistogram(std::string *out, const char *name,
+                                      const char *help,
+                                      const TelemetryHistogram::Snapshot &h,
+                                      int min_exponent, int max_exponent,
+                                      double scale) {
+  Appendf(out, "# HELP bidi_tee_%s %s\n# TYPE bidi_tee_%s histogram\n",
+          name, help, name);
+  for (int e = min_exponent; e <= max_exponent; ++e) {
+    Appendf(out, "bidi_tee_%s_bucket{le=\"%g\"} %" PRIu64 "\n", name,
+            (double)(1ull << e) * scale, h.CountUpToPowerOfTwo(e));
+  }
+  Appendf(out, "bidi_tee_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, h.count);
+  if (scale == 1) {
+    Appendf(out, "bidi_tee_%s_sum %" PRIu64 "\n", name, h.sum);
+  } else {
+    Appendf(out, "bidi_tee_%s_sum %.9g\n", name, h.sum * scale);
+  }
+  Appendf(out, "bidi_tee_%s_count %" PRIu64 "\n", name, h.count);
+}
+
+std::string TelemetryReporter::FormatPrometheus() const {
+  const Totals totals = CollectTotals();
+  std::string out;
+  out.append("# HELP bidi_tee_wakeups_total Returns from waiting for data.\n"
+             "# TYPE bidi_tee_wakeups_total counter\n");
+  Appendf(&out, "bidi_tee_wakeups_total %" PRIu64 "\n", totals.wakeups);
+  out.append("# HELP bidi_tee_reads_total Reads of channel data.\n"
+             "# TYPE bidi_tee_reads_total counter\n");
+  for (int i = 0; i < 16; ++i) {
+    if (!totals.reads[i]) continue;
+    Appendf(&out, "bidi_tee_reads_total{channel=\"%s\"} %" PRIu64 "\n",
+            ChannelName(i).c_str(), totals.reads[i]);
+  }
+  out.append("# HELP bidi_tee_read_bytes_total Bytes of channel data read.\n"
+             "# TYPE bidi_tee_read_bytes_total counter\n");
+  for (int i = 0; i < 16; ++i) {
+    if (!totals.reads[i]) continue;
+    Appendf(&out, "bidi_tee_read_bytes_total{channel=\"%s\"} %" PRIu64 "\n",
+            ChannelName(i).c_str(), totals.bytes_read[i]);
+  }
+  out.append("# HELP bidi_tee_short_writes_total Writes that did not take "
+             "all the data.\n"
+             "# TYPE bidi_tee_short_writes_total counter\n");
+  Appendf(&out, "bidi_tee_short_writes_total %" PRIu64 "\n",
+          totals.short_writes);
+  out.append("# HELP bidi_tee_backlog_pauses_total Times a channel was not "
+             "read until its forward backlog drained.\n"
+             "# TYPE bidi_tee_backlog_pauses_total counter\n");
+  Appendf(&out, "bidi_tee_backlog_pauses_total %" PRIu64 "\n",
+          totals.backlog_pauses);
+  out.append("# HELP bidi_tee_buffer_allocations_total Buffers for reads "
+             "and backlogs that were not available for re-use.\n"
+             "# TYPE bidi_tee_buffer_allocations_total counter\n");
+  Appendf(&out, "bidi_tee_buffer_allocations_total %" PRIu64 "\n",
+          totals.buffer_allocations);
+  AppendPrometheusHistogram(&out, "read_size_bytes", "Bytes per read.",
+                            totals.read_size, 0, 24, 1);
+  AppendPrometheusHistogram(&out, "forward_write_seconds",
+                            "Time to forward what was read.",
+                            totals.forward_ns, 7, 34, 1e-9);
+  AppendPrometheusHistogram(&out, "log_append_seconds",
+                            "Time to hand a record to the log writer.",
+                            totals.log_append_ns, 7, 34, 1e-9);
+  AppendPrometheusHistogram(&out, "log_write_seconds",
+                            "Time to write to the log file or socket.",
+                            totals.log_write_ns, 7, 34, 1e-9);
+  AppendPrometheusHistogram(&out, "async_queue_bytes",
+                            "Bytes queued for the log writer thread.",
+                            totals.async_queue, 0, 32, 1);
+  return out;
+}
@@ -0,0 +1,122 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <signal.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+
+// Counters about bidi-tee itself, to tell when it is the bottleneck. Each
+// thread updates its own set with relaxed atomic loads and stores, which
+// are plain moves: no locks, no shared cache lines. Reports sum the sets
+// of all threads.
+
+// Only ever written by the thread owning it.
+class TelemetryCounter {
+public:
+  void Add(uint64_t n) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Distribution of values in buckets of a quarter power of two. Buckets are
+// over value - 1, so that powers of two, common for sizes, are upper
+// bounds.
+class TelemetryHistogram {
+public:
+  static constexpr int kBuckets = 256;
+
+  void Record(uint64_t value) {
+    counts_[BucketIndex(value ? value - 1 : 0)].Add(1);
+    sum_.Add(value);
+  }
+
+  // Sums of all threads.
+  struct Snapshot {
+    uint64_t counts[kBuckets] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // Value at most the given fraction (0..1) of recorded values are.
+    uint64_t Percentile(double fraction) const;
+    // Recorded values <= 2^exponent.
+    uint64_t CountUpToPowerOfTwo(int exponent) const;
+  };
+  void AddTo(Snapshot *snapshot) const;
+
+private:
+  static int BucketIndex(uint64_t v);
+
+  TelemetryCounter counts_[kBuckets];
+  TelemetryCounter sum_;
+};
+
+// What a thread counts. Channel operations are by the thread doing them,
+// the event loop for forwarding, the log writer for writing.
+struct ThreadTelemetry {
+  TelemetryCounter wakeups;       // Event loop returning from waiting.
+  TelemetryCounter reads[16];     // Per channel.
+  TelemetryCounter bytes_read[16];
+  TelemetryCounter short_writes;  // Forward or log write() not taking all.
+  TelemetryCounter backlog_pauses;  // Channel not read for its backlog.
+  TelemetryCounter buffer_allocations;  // Not available in a BufferPool.
+  TelemetryHistogram read_size;      // Bytes.
+  TelemetryHistogram forward_ns;     // Writing what was read to its fd.
+  TelemetryHistogram log_append_ns;  // Passing it to the log writer.
+  TelemetryHistogram log_write_ns;   // Writing to the log file or socket.
+  TelemetryHistogram async_queue;    // Bytes queued, seen when appending.
+};
+
+// Switch counting on; before any other thread is started.
+void EnableTelemetry();
+
+// Counters of the calling thread, or nullptr if telemetry is off.
+ThreadTelemetry *GetThreadTelemetry();
+
+// Block the signal asking for a report (SIGUSR1) in this and all threads
+// started from it afterwards, so that TelemetryReporter can get it.
+// Returns the previous signal mask in *old_mask, for a child to restore.
+void BlockTelemetrySignal(sigset_t *old_mask);
+
+// Prints the counters as a summary to report_fd on SIGUSR1 and, with a
+// listen address, serves them in the Prometheus text format over HTTP.
+class TelemetryReporter {
+public:
+  // Listen address is "[<host>:]<port>", by default on localhost; empty
+  // for none. Prints what is wrong and returns nullptr on failure.
+  static TelemetryReporter *Create(int report_fd,
+                                   const std::string &listen_address,
+                                   std::map<int, std::string> channel_names);
+  ~TelemetryReporter();
+
+  void PrintSummary();
+
+private:
+  TelemetryReporter(int report_fd, int listen_fd, int signal_fd,
+                    int wakeup_fd, std::map<int, std::string> channel_names);
+
+  void Run();
+  void ServeHttp();
+  std::string ChannelName(int channel) const;
+  std::string FormatSummary() const;
+  std::string FormatPrometheus() const;
+
+  const int report_fd_;
+  const int listen_fd_;  // -1 if not serving.
+  const int signal_fd_;
+  const int wakeup_fd_;  // eventfd
+  const std::map<int, std::string> channel_names_;
+  const int64_t start_ns_;
+  std::thread thread_;
+};
+
+#endif // TELEMETRY_H
@@ -0,0 +1,101 @@
+#include "terminal.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+// Settings of our terminal before switching it to raw; restored at exit.
+static struct termios original_termios;
+static bool termios_changed = false;
+static int pty_master = -1;
+
+bool OpenPseudoTerminal(int *master, int *slave) {
+  *master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (*master < 0) return false;
+  char name[64];
+  if (grantpt(*master) < 0 || unlockpt(*master) < 0 ||
+      ptsname_r(*master, name, sizeof(name)) != 0) {
+    const int err = errno;
+    close(*master);
+    errno = err;
+    return false;
+  }
+  *slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (*slave < 0) {
+    const int err = errno;
+    close(*master);
+    errno = err;
+    return false;
+  }
+  struct termios settings;
+  if (tcgetattr(STDIN_FILENO, &settings) == 0) {
+    tcsetattr(*slave, TCSANOW, &settings);
+  } else if (tcgetattr(*slave, &settings) == 0) {
+    // Nobody types, so nobody needs to see it; without the echo, what the
+    // program writes is all there is on stdout.
+    settings.c_lflag &= ~(ECHO | ECHONL);
+    tcsetattr(*slave, TCSANOW, &settings);
+  }
+  struct winsize size;
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0) {
+    ioctl(*slave, TIOCSWINSZ, &size);
+  }
+  return true;
+}
+
+bool MakeControllingTerminal() {
+  return setsid() >= 0 && ioctl(STDIN_FILENO, TIOCSCTTY, 0) == 0;
+}
+
+char EofCharacter(int fd) {
+  struct termios settings;
+  if (tcgetattr(fd, &settings) < 0) return 4;  // ^D
+  return settings.c_cc[VEOF];
+}
+
+static void RestoreTerminal() {
+  if (termios_changed) tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+}
+
+// Setting the size on the master makes the kernel send SIGWINCH to the
+// program.
+static void WindowSizeChanged(int) {
+  const int saved_errno = errno;
+  struct winsize size;
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0) {
+    ioctl(pty_master, TIOCSWINSZ, &size);
+  }
+  errno = saved_errno;
+}
+
+static void TerminatedBySignal(int sig) {
+  RestoreTerminal();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+void PassThroughTerminal(int master) {
+  if (tcgetattr(STDIN_FILENO, &original_termios) < 0) return;  // No tty.
+  pty_master = master;
+
+  struct sigaction action = {};
+  action.sa_handler = WindowSizeChanged;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &action, nullptr);
+
+  // Input is handled by the pseudo-terminal. Output processing stays, as
+  // output that does not go through it (e.g. stderr) might still need it.
+  struct termios raw = original_termios;
+  cfmakeraw(&raw);
+  raw.c_oflag = original_termios.c_oflag;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) return;
+  termios_changed = true;
+  atexit(RestoreTerminal);
+  const int kTerminating[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+  for (int sig : kTerminating) signal(sig, TerminatedBySignal);
+}
@@ -0,0 +1,25 @@
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+// Running the program on a pseudo-terminal, so that it behaves like it
+// does interactively, e.g. with line buffered output.
+
+// Open a pseudo-terminal, both ends close-on-exec. If our stdin is a
+// terminal, the new one starts with its settings and window size,
+// otherwise with echo turned off. Returns false with errno set on failure.
+bool OpenPseudoTerminal(int *master, int *slave);
+
+// In the child, once the slave is its stdin: start a new session with it
+// as controlling terminal, so that job control and ^C work as usual.
+bool MakeControllingTerminal();
+
+// The character that ends the input on the terminal fd, usually ^D.
+char EofCharacter(int fd);
+
+// If our stdin is a terminal, switch it to raw input until we exit, so
+// that each key press is passed on right away and the pseudo-terminal does
+// all the line editing and signal generation. Window size changes of our
+// terminal are passed on to the one at master.
+void PassThroughTerminal(int master);
+
+#endif // TERMINAL_H
@@ -0,0 +1,437 @@
+// Event loop based on io_uring. Rather than waiting for readiness and then
+// doing the read(), write() and writev() ourselves, the forward-write, the
+// log-append and the next read of a channel are submitted as one linked
+// chain, so all channels together cost just one io_uring_enter() per
+// wakeup. Each channel has its own chain, so one that can't forward does
+// not hold up the others; if its write fd is full, the write is retried
+// after polling for it to be writable.
+//
+// Using the raw system calls, as the little we need does not warrant a
+// dependency on liburing.
+
+#include "event-loop.h"
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "telemetry.h"
+
+namespace {
+class UringEventLoop : public EventLoop {
+public:
+  static UringEventLoop *Create(unsigned entries);
+  ~UringEventLoop() override;
+
+  void Run(const std::vector<ChannelCopier *> &channels,
+           LogWriter *log) override;
+
+private:
+  // Operations of a channel; part of the user_data.
+  enum Op { kRead, kForward, kLog, kPoll };
+
+  // user_data of the timeout to flush the log.
+  static constexpr uint64_t kFlushTimeout = ~0ull;
+
+  struct Channel {
+    ChannelCopier *copier;
+    // From the pool of the copier: the current block, and what the next
+    // read goes to, so that its size can follow the traffic. The block's
+    // one goes back once the read completes: as it is linked after the
+    // forward and log writes, these are done then.
+    char *buf;
+    size_t buf_capacity;
+    char *read_buf;
+    size_t read_capacity;
+    // Encoded for the log, after a skipped record if there is one.
+    char header[2 * kMaxRecordHeaderSize + kMaxSkippedRecordSize];
+    size_t header_len;
+    iovec log_iov[2];
+    size_t len;          // Bytes in buf of the current block.
+    size_t fwd_done;     // ... of those, already forwarded.
+    size_t log_len;      // ... of those, the first to be logged.
+    size_t log_size;     // Bytes to write to the log for current block.
+    size_t log_done;
+    uint64_t log_offset; // Where this block is to go in the log.
+    int in_flight;       // Submitted, but not completed operations.
+    bool closed;
+    bool wait_writable;  // Forward fd was full; poll before writing.
+    bool wait_readable;  // Read fd is non-blocking and was empty.
+  };
+
+  UringEventLoop() {}
+
+  io_uring_sqe *GetSqe();
+  void QueueChain(int idx, Channel *c, const LogWriter *log, int log_fd);
+  void StartBlock(Channel *c, int res, LogWriter *log, int log_fd);
+  void HandleCompletion(const io_uring_cqe *cqe, LogWriter *log, int log_fd);
+
+  int ring_fd_ = -1;
+  void *sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = (io_uring_sqe *)MAP_FAILED;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  io_uring_cqe *cqes_;
+
+  unsigned to_submit_ = 0;
+  __kernel_timespec flush_timeout_;
+  bool flush_timeout_armed_ = false;
+  std::vector<Channel *> channels_;
+  uint64_t next_log_offset_ = 0;
+};
+
+UringEventLoop *UringEventLoop::Create(unsigned entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) return nullptr;
+
+  UringEventLoop *result = new UringEventLoop();
+  result->ring_fd_ = fd;
+
+  result->sq_ring_size_ = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  result->cq_ring_size_ = params.cq_off.cqes +
+    params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    result->sq_ring_size_ = result->cq_ring_size_ =
+      std::max(result->sq_ring_size_, result->cq_ring_size_);
+  }
+  result->sq_ring_ = mmap(nullptr, result->sq_ring_size_,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+  if (result->sq_ring_ == MAP_FAILED) {
+    delete result;
+    return nullptr;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    result->cq_ring_ = result->sq_ring_;
+  } else {
+    result->cq_ring_ = mmap(nullptr, result->cq_ring_size_,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_CQ_RING);
+    if (result->cq_ring_ == MAP_FAILED) {
+      delete result;
+      return nullptr;
+    }
+  }
+  result->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  result->sqes_ = (io_uring_sqe *)mmap(nullptr, result->sqes_size_,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_SQES);
+  if (result->sqes_ == MAP_FAILED) {
+    delete result;
+    return nullptr;
+  }
+
+  char *const sq = (char *)result->sq_ring_;
+  result->sq_head_ = (unsigned *)(sq + params.sq_off.head);
+  result->sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+  result->sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+  result->sq_array_ = (unsigned *)(sq + params.sq_off.array);
+  char *const cq = (char *)result->cq_ring_;
+  result->cq_head_ = (unsigned *)(cq + params.cq_off.head);
+  result->cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+  result->cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+  result->cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  return result;
+}
+
+UringEventLoop::~UringEventLoop() {
+  for (Channel *c : channels_) delete c;
+  if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0) close(ring_fd_);
+}
+
+io_uring_sqe *UringEventLoop::GetSqe() {
+  const unsigned tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) > *sq_mask_) {
+    // Full. Make room by handing what we have to the kernel.
+    syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 0, 0, nullptr, 0);
+    to_submit_ = 0;
+  }
+  const unsigned idx = tail & *sq_mask_;
+  io_uring_sqe *sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++to_submit_;
+  return sqe;
+}
+
+static io_uring_sqe *PrepareRw(io_uring_sqe *sqe, int opcode, int fd,
+                               const void *addr, unsigned len,
+                               uint64_t offset, uint64_t user_data) {
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  return sqe;
+}
+
+static uint64_t UserData(int channel_idx, int op) {
+  return ((uint64_t)channel_idx << 8) | op;
+}
+
+// Submit whatever is left to do for the current block: forward, log, then
+// read the next block into the same buffer. Linked, so that the buffer is
+// only reused once everything is done with it.
+void UringEventLoop::QueueChain(int idx, Channel *c, const LogWriter *log,
+                                int log_fd) {
+  io_uring_sqe *last = nullptr;
+  if (c->copier->wants_write()) {
+    // Left at the end of input; the copier writes it once there is room.
+    PrepareRw(GetSqe(), IORING_OP_POLL_ADD, c->copier->writefd(), nullptr, 0,
+              0, UserData(idx, kPoll))->poll32_events = POLLOUT;
+    c->in_flight++;
+  }
+  if (c->fwd_done < c->len) {
+    if (c->wait_writable) {
+      last = GetSqe();
+      PrepareRw(last, IORING_OP_POLL_ADD, c->copier->writefd(), nullptr, 0, 0,
+                UserData(idx, kPoll))->poll32_events = POLLOUT;
+      last->flags |= IOSQE_IO_LINK;
+      c->in_flight++;
+    }
+    last = GetSqe();
+    PrepareRw(last, IORING_OP_WRITE, c->copier->writefd(),
+              c->buf + c->fwd_done, c->len - c->fwd_done, (uint64_t)-1,
+              UserData(idx, kForward));
+    last->flags |= IOSQE_IO_LINK;
+    c->in_flight++;
+  }
+  if (c->log_done < c->log_size) {
+    // Skip what has been written already.
+    int iov_start = 0;
+    size_t skip = c->log_done;
+    iovec *iov = c->log_iov;
+    iov[0] = { c->header, c->header_len };
+    iov[1] = { c->buf, c->log_len };
+    while (skip >= iov[iov_start].iov_len) {
+      skip -= iov[iov_start].iov_len;
+      ++iov_start;
+    }
+    iov[iov_start].iov_base = (char *)iov[iov_start].iov_base + skip;
+    iov[iov_start].iov_len -= skip;
+
+    last = GetSqe();
+    PrepareRw(last, IORING_OP_WRITEV, log_fd, &iov[iov_start], 2 - iov_start,
+              c->log_offset + c->log_done, UserData(idx, kLog));
+    last->flags |= IOSQE_IO_LINK;
+    c->in_flight++;
+  }
+  if (!c->closed && !c->copier->forward_error()) {
+    if (!c->read_buf) {
+      const size_t size = c->copier->read_size(log);
+      c->read_buf = c->copier->pool()->Get(size);
+      c->read_capacity = BufferPool::Capacity(size);
+    }
+    if (c->wait_readable) {
+      last = GetSqe();
+      PrepareRw(last, IORING_OP_POLL_ADD, c->copier->readfd(), nullptr, 0, 0,
+                UserData(idx, kPoll))->poll32_events = POLLIN;
+      last->flags |= IOSQE_IO_LINK;
+      c->in_flight++;
+    }
+    last = GetSqe();
+    PrepareRw(last, IORING_OP_READ, c->copier->readfd(),
+              c->read_buf,
+              std::min(c->copier->read_size(log), c->read_capacity),
+              (uint64_t)-1,
+              UserData(idx, kRead));
+    c->in_flight++;
+  }
+  if (last) last->flags &= ~IOSQE_IO_LINK;
+}
+
+// The read of a new block in the buffer returned res: set up what is left
+// to do with it.
+void UringEventLoop::StartBlock(Channel *c, int res, LogWriter *log,
+                                int log_fd) {
+  // Completions are reaped right after the wakeup, so this is as close
+  // to the read as we can get.
+  const RecordHeader *header =
+    c->copier->PrepareHeader(GetTimeNanoseconds(), res, c->buf);
+  c->closed = !c->copier->valid();
+  c->len = res > 0 ? res : 0;
+  c->fwd_done = 0;
+  c->log_len = header ? header->block_size : 0;
+  c->log_size = c->log_done = 0;
+  if (!header) return;  // Sampled out; only forwarded.
+  const char *skipped_payload;
+  const RecordHeader *skipped = c->copier->skipped_record(&skipped_payload);
+  if (log_fd >= 0) {
+    c->header_len = 0;
+    if (skipped) {
+      c->header_len = log->encoder()->EncodeHeader(*skipped, c->header);
+      memcpy(c->header + c->header_len, skipped_payload, skipped->block_size);
+      c->header_len += skipped->block_size;
+    }
+    c->header_len += log->encoder()->EncodeHeader(
+      *header, c->header + c->header_len);
+    c->log_size = c->header_len + c->log_len;
+    c->log_offset = next_log_offset_;
+    next_log_offset_ += c->log_size;
+  } else {
+    ThreadTelemetry *telemetry = GetThreadTelemetry();
+    const timestamp_t start = telemetry ? GetTimeNanoseconds() : 0;
+    if (skipped) log->Append(*skipped, skipped_payload);
+    log->Append(*header, c->buf);
+    if (telemetry) {
+      telemetry->log_append_ns.Record(GetTimeNanoseconds() - start);
+    }
+  }
+}
+
+void UringEventLoop::HandleCompletion(const io_uring_cqe *cqe,
+                                      LogWriter *log, int log_fd) {
+  if (cqe->user_data == kFlushTimeout) {
+    flush_timeout_armed_ = false;
+    return;
+  }
+  const int idx = cqe->user_data >> 8;
+  Channel *c = channels_[idx];
+  c->in_flight--;
+
+  // If an operation fails or is short, the rest of the chain is cancelled;
+  // it will be re-submitted once all of it came back.
+  const int res = cqe->res;
+  if (res != -ECANCELED) {
+    switch (cqe->user_data & 0xff) {
+    case kRead:
+      if (res == -EAGAIN) c->wait_readable = true;
+      if (res == -EINTR || res == -EAGAIN) break;  // Just try again.
+      if (c->buf) c->copier->pool()->Put(c->buf, c->buf_capacity);
+      c->buf = c->read_buf;
+      c->buf_capacity = c->read_capacity;
+      c->read_buf = nullptr;
+      StartBlock(c, res, log, log_fd);
+      break;
+    case kForward:
+      if (res == -EAGAIN) {
+        c->wait_writable = true;
+      } else if (res > 0) {
+        c->fwd_done += res;
+      } else if (res != -EINTR) {
+        c->copier->ForwardFailed(res < 0 ? -res : EIO, c->len - c->fwd_done);
+        c->fwd_done = c->len;
+      }
+      break;
+    case kPoll:
+      c->wait_writable = c->wait_readable = false;
+      if (c->copier->wants_write()) c->copier->Flush(log);
+      break;
+    case kLog:
+      c->log_done = (res > 0) ? c->log_done + res : c->log_size;
+      break;
+    }
+  }
+
+  if (c->in_flight == 0) {
+    if (!c->closed && c->copier->forward_error() &&
+        c->log_done >= c->log_size) {
+      // Nowhere to forward to anymore: close the channel as if at EOF.
+      StartBlock(c, 0, log, log_fd);
+    }
+    if (c->closed) c->copier->ReleaseInput();
+    QueueChain(idx, c, log, log_fd);
+  }
+}
+
+void UringEventLoop::Run(const std::vector<ChannelCopier *> &channels,
+                         LogWriter *log) {
+  // Log writes are submitted with explicit offsets, so that blocks land in
+  // the order we read them, even if the kernel executes them concurrently.
+  // If the log is not seekable, fall back to log the regular way.
+  int log_fd = log->direct_fd();
+  if (log_fd >= 0) {
+    const off_t pos = lseek(log_fd, 0, SEEK_CUR);
+    if (pos < 0) {
+      log_fd = -1;
+    } else {
+      next_log_offset_ = pos;
+    }
+  }
+
+  for (ChannelCopier *copier : channels) {
+    Channel *c = new Channel();
+    c->copier = copier;
+    c->closed = !copier->valid();
+    channels_.push_back(c);
+    QueueChain(channels_.size() - 1, c, log, log_fd);
+  }
+
+  ThreadTelemetry *const telemetry = GetThreadTelemetry();
+  for (;;) {
+    bool busy = false;
+    for (const Channel *c : channels_) {
+      busy |= (c->in_flight > 0);
+    }
+    if (!busy) break;
+
+    // If the log buffers records, make sure to wake up in time to flush.
+    const timestamp_t deadline = log->flush_deadline();
+    if (!flush_timeout_armed_ && deadline >= 0) {
+      const int64_t wait_ns = std::max<int64_t>(
+        deadline - GetTimeNanoseconds(), 0);
+      flush_timeout_.tv_sec = wait_ns / 1000000000;
+      flush_timeout_.tv_nsec = wait_ns % 1000000000;
+      PrepareRw(GetSqe(), IORING_OP_TIMEOUT, -1, &flush_timeout_, 1, 0,
+                kFlushTimeout);
+      flush_timeout_armed_ = true;
+    }
+
+    const int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 1,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    to_submit_ -= ret;
+    if (telemetry) telemetry->wakeups.Add(1);
+
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe cqe = cqes_[head & *cq_mask_];
+      __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+      HandleCompletion(&cqe, log, log_fd);
+    }
+    log->FlushIfDue(GetTimeNanoseconds());
+  }
+
+  for (Channel *c : channels_) {
+    if (c->buf) c->copier->pool()->Put(c->buf, c->buf_capacity);
+    if (c->read_buf) c->copier->pool()->Put(c->read_buf, c->read_capacity);
+    c->buf = c->read_buf = nullptr;
+  }
+
+  // Whatever comes after us continues writing at the end.
+  if (log_fd >= 0) {
+    lseek(log_fd, next_log_offset_, SEEK_SET);
+  }
+}
+}  // namespace
+
+std::unique_ptr<EventLoop> CreateUringEventLoop() {
+  // Per channel, at most five operations are in flight.
+  return std::unique_ptr<EventLoop>(UringEventLoop::Create(128));
+}